@@ -0,0 +1,285 @@
+/*
+ * (C) Copyright 2015 ETH Zurich Systems Group (http://www.systems.ethz.ch/) and others.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Contributors:
+ *     Markus Pilman <mpilman@inf.ethz.ch>
+ *     Simon Loesing <sloesing@inf.ethz.ch>
+ *     Thomas Etter <etterth@gmail.com>
+ *     Kevin Bocksrocker <kevin.bocksrocker@gmail.com>
+ *     Lucas Braun <braunl@inf.ethz.ch>
+ */
+#include "Histogram.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <istream>
+#include <limits>
+#include <ostream>
+#include <stdexcept>
+
+namespace aim {
+
+namespace {
+
+constexpr uint32_t HISTOGRAM_MAGIC = 0x48444831;    // "HDH1"
+constexpr uint32_t HISTOGRAM_FILE_MAGIC = 0x48444631;   // "HDF1"
+
+template<class T>
+void write(std::ostream& out, T value) {
+    out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template<class T>
+T read(std::istream& in) {
+    T value;
+    if (!in.read(reinterpret_cast<char*>(&value), sizeof(T))) {
+        throw std::runtime_error("Truncated histogram");
+    }
+    return value;
+}
+
+} // anonymous namespace
+
+constexpr uint64_t Histogram::DEFAULT_HIGHEST_TRACKABLE_VALUE;
+
+Histogram::Histogram(unsigned significantDigits, uint64_t highestTrackableValue)
+    : mSignificantDigits(significantDigits)
+    , mHighestTrackableValue(highestTrackableValue)
+    , mTotalCount(0)
+{
+    if (significantDigits < 1 || significantDigits > 5) {
+        throw std::invalid_argument("Histogram precision has to be 1 to 5 significant digits");
+    }
+    if (highestTrackableValue < 2) {
+        throw std::invalid_argument("Histogram range too small");
+    }
+    // values below largestSingleUnit are counted exactly
+    uint64_t largestSingleUnit = 2;
+    for (unsigned i = 0; i < significantDigits; ++i) {
+        largestSingleUnit *= 10;
+    }
+    unsigned subBucketCountMagnitude = 0;
+    while ((uint64_t(1) << subBucketCountMagnitude) < largestSingleUnit) {
+        ++subBucketCountMagnitude;
+    }
+    mSubBucketHalfCountMagnitude = subBucketCountMagnitude - 1;
+    uint64_t subBucketCount = uint64_t(1) << subBucketCountMagnitude;
+    mSubBucketHalfCount = subBucketCount / 2;
+    mSubBucketMask = subBucketCount - 1;
+
+    // every bucket covers twice the range of the previous one
+    size_t buckets = 1;
+    for (uint64_t smallestUntrackable = subBucketCount; smallestUntrackable <= highestTrackableValue;
+            smallestUntrackable <<= 1) {
+        ++buckets;
+        if (smallestUntrackable > (std::numeric_limits<uint64_t>::max() >> 1)) {
+            break;
+        }
+    }
+    mCounts.resize((buckets + 1) * mSubBucketHalfCount, 0);
+}
+
+size_t Histogram::countsIndex(uint64_t value) const {
+    unsigned pow2Ceiling = 64 - __builtin_clzll(value | mSubBucketMask);
+    unsigned bucketIndex = pow2Ceiling - mSubBucketHalfCountMagnitude - 1;
+    uint64_t subBucketIndex = value >> bucketIndex;
+    return (size_t(bucketIndex + 1) << mSubBucketHalfCountMagnitude) + (subBucketIndex - mSubBucketHalfCount);
+}
+
+uint64_t Histogram::valueFromIndex(size_t index) const {
+    int64_t bucketIndex = int64_t(index >> mSubBucketHalfCountMagnitude) - 1;
+    uint64_t subBucketIndex = (index & (mSubBucketHalfCount - 1)) + mSubBucketHalfCount;
+    if (bucketIndex < 0) {
+        subBucketIndex -= mSubBucketHalfCount;
+        bucketIndex = 0;
+    }
+    return subBucketIndex << bucketIndex;
+}
+
+uint64_t Histogram::highestEquivalentValue(size_t index) const {
+    int64_t bucketIndex = std::max<int64_t>(int64_t(index >> mSubBucketHalfCountMagnitude) - 1, 0);
+    return valueFromIndex(index) + (uint64_t(1) << bucketIndex) - 1;
+}
+
+void Histogram::record(uint64_t value, uint64_t count) {
+    mCounts[countsIndex(std::min(value, mHighestTrackableValue))] += count;
+    mTotalCount += count;
+}
+
+void Histogram::merge(const Histogram& other) {
+    if (other.mSignificantDigits != mSignificantDigits
+            || other.mHighestTrackableValue != mHighestTrackableValue) {
+        throw std::invalid_argument("Histograms with different precision or range can not be merged");
+    }
+    for (size_t i = 0; i < mCounts.size(); ++i) {
+        mCounts[i] += other.mCounts[i];
+    }
+    mTotalCount += other.mTotalCount;
+}
+
+void Histogram::reset() {
+    std::fill(mCounts.begin(), mCounts.end(), 0);
+    mTotalCount = 0;
+}
+
+uint64_t Histogram::min() const {
+    for (size_t i = 0; i < mCounts.size(); ++i) {
+        if (mCounts[i] != 0) {
+            return valueFromIndex(i);
+        }
+    }
+    return 0;
+}
+
+uint64_t Histogram::max() const {
+    for (size_t i = mCounts.size(); i > 0; --i) {
+        if (mCounts[i - 1] != 0) {
+            return std::min(highestEquivalentValue(i - 1), mHighestTrackableValue);
+        }
+    }
+    return 0;
+}
+
+double Histogram::mean() const {
+    if (mTotalCount == 0) {
+        return 0.0;
+    }
+    double sum = 0.0;
+    for (size_t i = 0; i < mCounts.size(); ++i) {
+        if (mCounts[i] != 0) {
+            // middle of the range of equivalent values
+            sum += mCounts[i] * (valueFromIndex(i) + highestEquivalentValue(i)) / 2.0;
+        }
+    }
+    return sum / mTotalCount;
+}
+
+uint64_t Histogram::percentile(double percentile) const {
+    if (mTotalCount == 0) {
+        return 0;
+    }
+    percentile = std::min(std::max(percentile, 0.0), 100.0);
+    auto countAtPercentile = std::max<uint64_t>(
+            static_cast<uint64_t>(std::ceil(percentile / 100.0 * mTotalCount)), 1);
+    uint64_t total = 0;
+    for (size_t i = 0; i < mCounts.size(); ++i) {
+        total += mCounts[i];
+        if (total >= countAtPercentile) {
+            return std::min(highestEquivalentValue(i), mHighestTrackableValue);
+        }
+    }
+    return max();
+}
+
+void Histogram::serialize(std::ostream& out) const {
+    write<uint32_t>(out, HISTOGRAM_MAGIC);
+    write<uint32_t>(out, mSignificantDigits);
+    write<uint64_t>(out, mHighestTrackableValue);
+    auto buckets = std::count_if(mCounts.begin(), mCounts.end(), [](uint64_t count) {
+        return count != 0;
+    });
+    write<uint64_t>(out, buckets);
+    for (size_t i = 0; i < mCounts.size(); ++i) {
+        if (mCounts[i] != 0) {
+            write<uint64_t>(out, i);
+            write<uint64_t>(out, mCounts[i]);
+        }
+    }
+}
+
+Histogram Histogram::deserialize(std::istream& in) {
+    if (read<uint32_t>(in) != HISTOGRAM_MAGIC) {
+        throw std::runtime_error("Not a histogram");
+    }
+    auto significantDigits = read<uint32_t>(in);
+    auto highestTrackableValue = read<uint64_t>(in);
+    Histogram histogram(significantDigits, highestTrackableValue);
+    auto buckets = read<uint64_t>(in);
+    for (uint64_t i = 0; i < buckets; ++i) {
+        auto index = read<uint64_t>(in);
+        auto count = read<uint64_t>(in);
+        if (index >= histogram.mCounts.size()) {
+            throw std::runtime_error("Histogram bucket out of range");
+        }
+        histogram.mCounts[index] += count;
+        histogram.mTotalCount += count;
+    }
+    return histogram;
+}
+
+HistogramSet::HistogramSet(unsigned significantDigits, uint64_t highestTrackableValue)
+    : mSignificantDigits(significantDigits)
+    , mHighestTrackableValue(highestTrackableValue)
+{
+    // fail early on an invalid precision
+    Histogram(significantDigits, highestTrackableValue);
+}
+
+void HistogramSet::record(const std::string& name, uint64_t value) {
+    std::lock_guard<std::mutex> _(mMutex);
+    auto iter = mTotals.find(name);
+    if (iter == mTotals.end()) {
+        iter = mTotals.emplace(name, Histogram(mSignificantDigits, mHighestTrackableValue)).first;
+        mInterval.emplace(name, Histogram(mSignificantDigits, mHighestTrackableValue));
+    }
+    iter->second.record(value);
+    mInterval.find(name)->second.record(value);
+}
+
+std::map<std::string, Histogram> HistogramSet::interval() {
+    std::lock_guard<std::mutex> _(mMutex);
+    auto result = mInterval;
+    for (auto& histogram : mInterval) {
+        histogram.second.reset();
+    }
+    return result;
+}
+
+std::map<std::string, Histogram> HistogramSet::totals() const {
+    std::lock_guard<std::mutex> _(mMutex);
+    return mTotals;
+}
+
+void writeHistograms(std::ostream& out, const std::map<std::string, Histogram>& histograms) {
+    write<uint32_t>(out, HISTOGRAM_FILE_MAGIC);
+    write<uint32_t>(out, histograms.size());
+    for (auto& histogram : histograms) {
+        write<uint32_t>(out, histogram.first.size());
+        out.write(histogram.first.data(), histogram.first.size());
+        histogram.second.serialize(out);
+    }
+}
+
+void readHistograms(std::istream& in, std::map<std::string, Histogram>& histograms) {
+    if (read<uint32_t>(in) != HISTOGRAM_FILE_MAGIC) {
+        throw std::runtime_error("Not a histogram file");
+    }
+    auto number = read<uint32_t>(in);
+    for (uint32_t i = 0; i < number; ++i) {
+        std::string name(read<uint32_t>(in), '\0');
+        if (!in.read(&name[0], name.size())) {
+            throw std::runtime_error("Truncated histogram");
+        }
+        auto histogram = Histogram::deserialize(in);
+        auto iter = histograms.find(name);
+        if (iter == histograms.end()) {
+            histograms.emplace(name, std::move(histogram));
+        } else {
+            iter->second.merge(histogram);
+        }
+    }
+}
+
+} // namespace aim
@@ -0,0 +1,143 @@
+/*
+ * (C) Copyright 2015 ETH Zurich Systems Group (http://www.systems.ethz.ch/) and others.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Contributors:
+ *     Markus Pilman <mpilman@inf.ethz.ch>
+ *     Simon Loesing <sloesing@inf.ethz.ch>
+ *     Thomas Etter <etterth@gmail.com>
+ *     Kevin Bocksrocker <kevin.bocksrocker@gmail.com>
+ *     Lucas Braun <braunl@inf.ethz.ch>
+ */
+#pragma once
+#include <cstdint>
+#include <iosfwd>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace aim {
+
+/*
+ * High dynamic range histogram of non-negative integer values (latencies in
+ * microseconds). Values are counted in log-linear buckets: every power of two
+ * range is split into the same number of sub buckets, such that every value
+ * up to highestTrackableValue is recorded with significantDigits decimal
+ * digits of precision, independent of its magnitude. The memory does not
+ * depend on the number of recorded values.
+ *
+ * Histograms with the same highestTrackableValue and significantDigits have
+ * the same buckets and merge exactly (merging the histograms of several
+ * clients gives the same counts as recording all values into one).
+ */
+class Histogram {
+public:
+    static constexpr uint64_t DEFAULT_HIGHEST_TRACKABLE_VALUE = 3600ull * 1000 * 1000;  // 1h in us
+
+    explicit Histogram(unsigned significantDigits = 3,
+            uint64_t highestTrackableValue = DEFAULT_HIGHEST_TRACKABLE_VALUE);
+
+    /*
+     * Values above highestTrackableValue are recorded as highestTrackableValue.
+     */
+    void record(uint64_t value, uint64_t count = 1);
+
+    /*
+     * Adds the counts of other, throws std::invalid_argument if it has a
+     * different precision or range.
+     */
+    void merge(const Histogram& other);
+
+    void reset();
+
+    uint64_t count() const {
+        return mTotalCount;
+    }
+
+    uint64_t min() const;
+    uint64_t max() const;
+    double mean() const;
+
+    /*
+     * Smallest value (up to the precision) such that percentile percent of
+     * the recorded values are smaller or equal.
+     */
+    uint64_t percentile(double percentile) const;
+
+    unsigned significantDigits() const {
+        return mSignificantDigits;
+    }
+
+    uint64_t highestTrackableValue() const {
+        return mHighestTrackableValue;
+    }
+
+    /*
+     * Binary format (host byte order): the precision, the range and the
+     * non-zero buckets as (index, count) pairs.
+     */
+    void serialize(std::ostream& out) const;
+    static Histogram deserialize(std::istream& in);
+
+private:
+    size_t countsIndex(uint64_t value) const;
+    uint64_t valueFromIndex(size_t index) const;
+    uint64_t highestEquivalentValue(size_t index) const;
+
+    unsigned mSignificantDigits;
+    uint64_t mHighestTrackableValue;
+    unsigned mSubBucketHalfCountMagnitude;
+    uint64_t mSubBucketHalfCount;
+    uint64_t mSubBucketMask;
+    std::vector<uint64_t> mCounts;
+    uint64_t mTotalCount;
+};
+
+/*
+ * One histogram per name (e.g. per query type) and a second one per name
+ * for the current reporting interval. All functions are thread safe.
+ */
+class HistogramSet {
+public:
+    explicit HistogramSet(unsigned significantDigits = 3,
+            uint64_t highestTrackableValue = Histogram::DEFAULT_HIGHEST_TRACKABLE_VALUE);
+
+    void record(const std::string& name, uint64_t value);
+
+    /*
+     * Returns the histograms of the interval since the last call and starts
+     * a new interval.
+     */
+    std::map<std::string, Histogram> interval();
+
+    std::map<std::string, Histogram> totals() const;
+
+private:
+    unsigned mSignificantDigits;
+    uint64_t mHighestTrackableValue;
+    mutable std::mutex mMutex;
+    std::map<std::string, Histogram> mTotals;
+    std::map<std::string, Histogram> mInterval;
+};
+
+/*
+ * A histogram file holds a sequence of named histograms. readHistograms
+ * merges the histograms of the file into histograms by name, such that the
+ * files of several client processes can be combined.
+ */
+void writeHistograms(std::ostream& out, const std::map<std::string, Histogram>& histograms);
+void readHistograms(std::istream& in, std::map<std::string, Histogram>& histograms);
+
+} // namespace aim
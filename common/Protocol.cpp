@@ -28,3 +28,9 @@
 
 #include "Protocol.hpp"
 
+namespace aim {
+
+constexpr uint64_t Q6Out::NO_SUBSCRIBER;
+constexpr int32_t Q6Out::NO_MAXIMUM;
+
+} // namespace aim
@@ -21,9 +21,19 @@
  *     Lucas Braun <braunl@inf.ethz.ch>
  */
 #pragma once
-#include <tuple>
+#include <algorithm>
 #include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <tuple>
 #include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 #include <boost/system/error_code.hpp>
 #include <boost/asio.hpp>
@@ -58,7 +68,7 @@
 
 namespace aim {
 
-#define COMMANDS (POPULATE_TABLE, CREATE_SCHEMA, PROCESS_EVENT, Q1, Q2, Q3, Q4, Q5, Q6, Q7, EXIT)
+#define COMMANDS (POPULATE_TABLE, CREATE_SCHEMA, PROCESS_EVENT, Q1, Q2, Q3, Q4, Q5, Q6, Q7, EXIT, PROCESS_EVENT_BATCH, LOOKUP, PREPARE, EXECUTE)
 
 GEN_COMMANDS(Command, COMMANDS);
 
@@ -102,6 +112,116 @@ struct Signature<Command::PROCESS_EVENT> {
     using arguments = Event;
 };
 
+template<>
+struct Signature<Command::PROCESS_EVENT_BATCH> {
+    using result = void;
+    using arguments = std::vector<Event>;
+};
+
+/*
+ * Events are sent over UDP. A PROCESS_EVENT datagram carries exactly one
+ * event while a PROCESS_EVENT_BATCH datagram carries as many events as fit
+ * into MAX_EVENT_DATAGRAM_SIZE bytes (the UDP payload of an Ethernet frame
+ * without fragmentation). Both formats start with the total size and the
+ * command, like a TCP request but without a request id (events are not
+ * answered).
+ */
+constexpr size_t MAX_EVENT_DATAGRAM_SIZE = 1472;
+
+/*
+ * Events can also be streamed over TCP or a unix domain socket, frames on a
+ * stream have the same format as the datagrams but may be larger.
+ */
+constexpr size_t MAX_EVENT_FRAME_SIZE = 0x100000;
+
+/*
+ * Returns the number of events that fit into one PROCESS_EVENT_BATCH datagram.
+ */
+inline size_t maxEventsPerDatagram() {
+    crossbow::sizer header;
+    header & header.size;
+    header & Command::PROCESS_EVENT_BATCH;
+    header & std::vector<Event>();
+    crossbow::sizer event;
+    event & Event();
+    auto num = (MAX_EVENT_DATAGRAM_SIZE - header.size) / event.size;
+    // the estimate above ignores alignment, make sure the batch really fits
+    for (; num > 1; --num) {
+        crossbow::sizer batch;
+        batch & batch.size;
+        batch & Command::PROCESS_EVENT_BATCH;
+        batch & std::vector<Event>(num);
+        if (batch.size <= MAX_EVENT_DATAGRAM_SIZE)
+            break;
+    }
+    return num;
+}
+
+/*
+ * Serializes the given events into buffer and returns the size of the
+ * datagram. A single event is sent in the PROCESS_EVENT format, everything
+ * else as PROCESS_EVENT_BATCH. The buffer has to hold
+ * MAX_EVENT_DATAGRAM_SIZE bytes for up to maxEventsPerDatagram() events.
+ */
+inline size_t serializeEvents(const std::vector<Event>& events, uint8_t* buffer) {
+    crossbow::sizer sz;
+    sz & sz.size;
+    if (events.size() == 1) {
+        sz & Command::PROCESS_EVENT;
+        sz & events.front();
+    } else {
+        sz & Command::PROCESS_EVENT_BATCH;
+        sz & events;
+    }
+    crossbow::serializer ser(buffer);
+    ser & sz.size;
+    if (events.size() == 1) {
+        ser & Command::PROCESS_EVENT;
+        ser & events.front();
+    } else {
+        ser & Command::PROCESS_EVENT_BATCH;
+        ser & events;
+    }
+    ser.buffer.release();
+    return sz.size;
+}
+
+/*
+ * Deserializes an event datagram in either format and calls fun on every
+ * event it contains. The batch is deserialized into events, which callers
+ * should keep around to reuse its memory.
+ */
+template<class Fun>
+void deserializeEvents(const uint8_t* datagram, std::vector<Event>& events, Fun fun) {
+    auto cmd = *reinterpret_cast<const Command*>(datagram + sizeof(size_t));
+    crossbow::deserializer des(datagram + sizeof(size_t) + sizeof(Command));
+    if (cmd == Command::PROCESS_EVENT_BATCH) {
+        events.clear();
+        des & events;
+        for (auto& ev : events) {
+            fun(ev);
+        }
+    } else {
+        assert(cmd == Command::PROCESS_EVENT);
+        Event ev;
+        des & ev;
+        fun(ev);
+    }
+}
+
+/*
+ * Approximate execution: Q1, Q3, Q4 and Q5 take a sample_permille. With a
+ * value between 1 and 999 the query only aggregates a deterministic sample
+ * of that many permille of the subscribers (chosen by a hash of the
+ * subscriber id) and returns estimates, every estimate comes with the half
+ * width of its 95% confidence interval (the *_error fields). 0 (the
+ * default) runs the query exactly, all errors are 0 then. Backends without
+ * sampling (Kudu) and Q1 answered from its view always run exactly.
+ */
+inline bool isApproximate(uint16_t samplePermille) {
+    return samplePermille > 0 && samplePermille < 1000;
+}
+
 /*
  * Q1: SELECT avg(total_duration_this_week)
  * FROM WT
@@ -110,6 +230,7 @@ struct Signature<Command::PROCESS_EVENT> {
 
 struct Q1In {
     uint32_t alpha;
+    uint16_t sample_permille = 0;
 };
 
 struct Q1Out {
@@ -117,12 +238,14 @@ struct Q1Out {
     bool success = true;
     crossbow::string error;
     double avg;
+    double avg_error = 0.0;
 
     template<class Archiver>
     void operator&(Archiver& ar) {
         ar & success;
         ar & error;
         ar & avg;
+        ar & avg_error;
     }
 };
 
@@ -174,11 +297,13 @@ struct Q3Out {
         using is_serializable = crossbow::is_serializable;
         uint32_t number_of_calls_this_week;
         double cost_ratio;
+        double cost_ratio_error = 0.0;
 
         template<class Archiver>
         void operator&(Archiver& ar) {
             ar & cost_ratio;
             ar & number_of_calls_this_week;
+            ar & cost_ratio_error;
         }
     };
 
@@ -194,10 +319,14 @@ struct Q3Out {
     }
 };
 
+struct Q3In {
+    uint16_t sample_permille = 0;
+};
+
 template<>
 struct Signature<Command::Q3> {
     using result = Q3Out;
-    using arguments = void;
+    using arguments = Q3In;
 };
 
 /*
@@ -213,6 +342,7 @@ struct Signature<Command::Q3> {
 struct Q4In {
     uint32_t alpha;
     uint32_t beta;
+    uint16_t sample_permille = 0;
 };
 
 struct Q4Out {
@@ -222,12 +352,16 @@ struct Q4Out {
         crossbow::string city_name;
         double avg_num_local_calls_week;
         uint64_t sum_duration_local_calls_week;
+        double avg_num_local_calls_week_error = 0.0;
+        double sum_duration_local_calls_week_error = 0.0;
 
         template<class Archiver>
         void operator&(Archiver& ar) {
             ar & city_name;
             ar & avg_num_local_calls_week;
             ar & sum_duration_local_calls_week;
+            ar & avg_num_local_calls_week_error;
+            ar & sum_duration_local_calls_week_error;
         }
     };
 
@@ -263,6 +397,7 @@ struct Signature<Command::Q4> {
 struct Q5In {
     uint16_t sub_type;
     uint16_t sub_category;
+    uint16_t sample_permille = 0;
 };
 
 struct Q5Out {
@@ -272,12 +407,16 @@ struct Q5Out {
         crossbow::string region_name;
         double sum_cost_local_calls_week;
         double sum_cost_longdistance_calls_week;
+        double sum_cost_local_calls_week_error = 0.0;
+        double sum_cost_longdistance_calls_week_error = 0.0;
 
         template<class Archiver>
         void operator&(Archiver& ar) {
             ar & region_name;
             ar & sum_cost_local_calls_week;
             ar & sum_cost_longdistance_calls_week;
+            ar & sum_cost_local_calls_week_error;
+            ar & sum_cost_longdistance_calls_week_error;
         }
     };
 
@@ -313,18 +452,25 @@ struct Q6In {
     uint16_t country_id;
 };
 
+/*
+ * A maximum without any matching call is reported as NO_MAXIMUM with
+ * NO_SUBSCRIBER as its id (subscriber ids start at 1).
+ */
 struct Q6Out {
     using is_serializable = crossbow::is_serializable;
+    static constexpr uint64_t NO_SUBSCRIBER = 0;
+    static constexpr int32_t NO_MAXIMUM = std::numeric_limits<int32_t>::min();
+
     bool success = true;
     crossbow::string error;
-    uint64_t max_local_week_id;
-    int32_t max_local_week;
-    uint64_t max_local_day_id;
-    int32_t max_local_day;
-    uint64_t max_distant_week_id;
-    int32_t max_distant_week;
-    uint64_t max_distant_day_id;
-    int32_t max_distant_day;
+    uint64_t max_local_week_id = NO_SUBSCRIBER;
+    int32_t max_local_week = NO_MAXIMUM;
+    uint64_t max_local_day_id = NO_SUBSCRIBER;
+    int32_t max_local_day = NO_MAXIMUM;
+    uint64_t max_distant_week_id = NO_SUBSCRIBER;
+    int32_t max_distant_week = NO_MAXIMUM;
+    uint64_t max_distant_day_id = NO_SUBSCRIBER;
+    int32_t max_distant_day = NO_MAXIMUM;
 
     template<class Archiver>
     void operator&(Archiver& ar) {
@@ -384,6 +530,203 @@ struct Signature<Command::Q7> {
     using arguments = Q7In;
 };
 
+/*
+ * Prepared queries: PREPARE registers one of the queries Q1 to Q7 on the
+ * connection and returns a handle to it, EXECUTE runs the query of a handle
+ * with new parameters and is answered with the QnOut of that query (the
+ * client knows its type from the handle). The parameters are the fields of
+ * the QnIn of the query in declaration order without the sample_permille
+ * (e.g. alpha, beta for Q4), which is fixed by PREPARE. The handles are
+ * only valid on the connection that prepared them, the compiled scan plans
+ * behind them are shared through the plan cache of the server.
+ */
+
+struct PrepareIn {
+    using is_serializable = crossbow::is_serializable;
+    Command query;
+    uint16_t sample_permille = 0;
+
+    template<class Archiver>
+    void operator&(Archiver& ar) {
+        ar & query;
+        ar & sample_permille;
+    }
+};
+
+struct PrepareOut {
+    using is_serializable = crossbow::is_serializable;
+    bool success = true;
+    crossbow::string error;
+    uint32_t plan = 0;
+
+    template<class Archiver>
+    void operator&(Archiver& ar) {
+        ar & success;
+        ar & error;
+        ar & plan;
+    }
+};
+
+template<>
+struct Signature<Command::PREPARE> {
+    using result = PrepareOut;
+    using arguments = PrepareIn;
+};
+
+/*
+ * query is the query the plan was prepared for, the server answers with
+ * its QnOut even if the plan is unknown.
+ */
+struct ExecuteIn {
+    using is_serializable = crossbow::is_serializable;
+    uint32_t plan;
+    Command query;
+    std::vector<uint32_t> parameters;
+
+    template<class Archiver>
+    void operator&(Archiver& ar) {
+        ar & plan;
+        ar & query;
+        ar & parameters;
+    }
+};
+
+/*
+ * The result of EXECUTE is the result of the prepared query, see
+ * client::CommandsImpl::executePrepared.
+ */
+template<>
+struct Signature<Command::EXECUTE> {
+    using arguments = ExecuteIn;
+};
+
+constexpr bool isQuery(Command command) {
+    return command >= Command::Q1 && command <= Command::Q7;
+}
+
+constexpr bool takesSample(Command query) {
+    return query == Command::Q1 || query == Command::Q3 || query == Command::Q4 || query == Command::Q5;
+}
+
+inline std::vector<uint32_t> parameters(const Q1In& in) {
+    return {in.alpha};
+}
+
+inline std::vector<uint32_t> parameters(const Q2In& in) {
+    return {in.alpha};
+}
+
+inline std::vector<uint32_t> parameters(const Q3In&) {
+    return {};
+}
+
+inline std::vector<uint32_t> parameters(const Q4In& in) {
+    return {in.alpha, in.beta};
+}
+
+inline std::vector<uint32_t> parameters(const Q5In& in) {
+    return {in.sub_type, in.sub_category};
+}
+
+inline std::vector<uint32_t> parameters(const Q6In& in) {
+    return {in.country_id};
+}
+
+inline std::vector<uint32_t> parameters(const Q7In& in) {
+    return {in.subscriber_value_type, in.window_length};
+}
+
+/*
+ * The inverse of parameters(), false if their number does not match.
+ */
+inline bool bindParameters(const std::vector<uint32_t>& parameters, uint16_t samplePermille, Q1In& in) {
+    if (parameters.size() != 1) {
+        return false;
+    }
+    in.alpha = parameters[0];
+    in.sample_permille = samplePermille;
+    return true;
+}
+
+inline bool bindParameters(const std::vector<uint32_t>& parameters, uint16_t, Q2In& in) {
+    if (parameters.size() != 1) {
+        return false;
+    }
+    in.alpha = parameters[0];
+    return true;
+}
+
+inline bool bindParameters(const std::vector<uint32_t>& parameters, uint16_t samplePermille, Q3In& in) {
+    if (!parameters.empty()) {
+        return false;
+    }
+    in.sample_permille = samplePermille;
+    return true;
+}
+
+inline bool bindParameters(const std::vector<uint32_t>& parameters, uint16_t samplePermille, Q4In& in) {
+    if (parameters.size() != 2) {
+        return false;
+    }
+    in.alpha = parameters[0];
+    in.beta = parameters[1];
+    in.sample_permille = samplePermille;
+    return true;
+}
+
+inline bool bindParameters(const std::vector<uint32_t>& parameters, uint16_t samplePermille, Q5In& in) {
+    if (parameters.size() != 2) {
+        return false;
+    }
+    in.sub_type = parameters[0];
+    in.sub_category = parameters[1];
+    in.sample_permille = samplePermille;
+    return true;
+}
+
+inline bool bindParameters(const std::vector<uint32_t>& parameters, uint16_t, Q6In& in) {
+    if (parameters.size() != 1) {
+        return false;
+    }
+    in.country_id = parameters[0];
+    return true;
+}
+
+inline bool bindParameters(const std::vector<uint32_t>& parameters, uint16_t, Q7In& in) {
+    if (parameters.size() != 2) {
+        return false;
+    }
+    in.subscriber_value_type = parameters[0];
+    in.window_length = parameters[1];
+    return true;
+}
+
+/*
+ * LOOKUP: point lookup of the record of a subscriber, bypassing the result
+ * cache and the materialized views. timestamp is the largest timestamp of
+ * the events applied to the record, an event is visible to queries once
+ * the timestamp of its caller reached its own.
+ */
+struct LookupOut {
+    using is_serializable = crossbow::is_serializable;
+    bool success = true;
+    crossbow::string error;
+    int64_t timestamp = 0;
+
+    template<class Archiver>
+    void operator&(Archiver& ar) {
+        ar & success;
+        ar & error;
+        ar & timestamp;
+    }
+};
+
+template<>
+struct Signature<Command::LOOKUP> {
+    using result = LookupOut;
+    using arguments = uint64_t; // subscriber id
+};
+
 namespace impl {
 
 template<class... Args>
@@ -408,6 +751,206 @@ struct ArgSerializer<> {
 
 }
 
+/*
+ * A request is the total request size (size_t), a request id (uint64_t)
+ * chosen by the client, the Command and its serialized arguments. A
+ * connection carries any number of requests in flight, the server answers
+ * them in the order they finish (not in the order they were sent) and the
+ * client matches the responses to its requests by their ids.
+ *
+ * Responses are sent as a sequence of chunks: a ChunkHeader followed by
+ * length bytes of payload, the last chunk has last set. Results with rows
+ * (a results vector) are streamed: the first chunk holds the result without
+ * its rows, every following chunk the number of rows in it and the rows.
+ * The server only serializes the next chunk once the previous one is
+ * written and the client deserializes every chunk as it arrives, so neither
+ * side holds more than RESPONSE_CHUNK_SIZE bytes of a serialized result
+ * (unless a single row is larger). Other results fit into a single chunk,
+ * commands without a result are answered with an empty chunk. The chunks
+ * of concurrent responses are interleaved, such that a large result does
+ * not hold back the small ones behind it.
+ */
+struct ChunkHeader {
+    uint64_t requestId;
+    uint32_t length;
+    uint32_t last;
+};
+
+constexpr size_t RESPONSE_CHUNK_SIZE = 0x10000;
+
+namespace impl {
+
+template<class Out, class = void>
+struct HasRows : std::false_type {};
+
+template<class Out>
+struct HasRows<Out, decltype(void(std::declval<Out&>().results))> : std::true_type {};
+
+/*
+ * Grows buffer to at least size bytes, the content is not preserved.
+ */
+inline void reserve(std::unique_ptr<uint8_t[]>& buffer, size_t& bufferSize, size_t size) {
+    if (bufferSize < size) {
+        buffer.reset(new uint8_t[size]);
+        bufferSize = size;
+    }
+}
+
+inline void writeChunkHeader(uint8_t* buffer, uint64_t requestId, size_t length, bool last) {
+    ChunkHeader header{requestId, static_cast<uint32_t>(length), last ? 1u : 0u};
+    memcpy(buffer, &header, sizeof(header));
+}
+
+template<class Out>
+size_t writeChunk(std::unique_ptr<uint8_t[]>& buffer, size_t& bufferSize, uint64_t requestId, const Out& out,
+        bool last) {
+    crossbow::sizer sizer;
+    sizer & out;
+    auto length = sizeof(ChunkHeader) + sizer.size;
+    reserve(buffer, bufferSize, length);
+    writeChunkHeader(buffer.get(), requestId, sizer.size, last);
+    crossbow::serializer ser(buffer.get() + sizeof(ChunkHeader));
+    ser & out;
+    ser.buffer.release();
+    return length;
+}
+
+} // namespace impl
+
+/*
+ * Serializes a response chunk by chunk, next() writes the next chunk
+ * (header and payload) into the buffer and returns its length.
+ */
+class ChunkWriter {
+public:
+    virtual ~ChunkWriter() = default;
+    virtual size_t next(std::unique_ptr<uint8_t[]>& buffer, size_t& bufferSize, bool& last) = 0;
+};
+
+template<class Out, bool = impl::HasRows<Out>::value>
+class ResultWriter : public ChunkWriter {
+    uint64_t mRequestId;
+    Out mOut;
+public:
+    ResultWriter(uint64_t requestId, const Out& out)
+        : mRequestId(requestId)
+        , mOut(out)
+    {}
+
+    size_t next(std::unique_ptr<uint8_t[]>& buffer, size_t& bufferSize, bool& last) override {
+        last = true;
+        return impl::writeChunk(buffer, bufferSize, mRequestId, mOut, true);
+    }
+};
+
+template<>
+class ResultWriter<void, false> : public ChunkWriter {
+    uint64_t mRequestId;
+public:
+    explicit ResultWriter(uint64_t requestId)
+        : mRequestId(requestId)
+    {}
+
+    size_t next(std::unique_ptr<uint8_t[]>& buffer, size_t& bufferSize, bool& last) override {
+        last = true;
+        impl::reserve(buffer, bufferSize, sizeof(ChunkHeader));
+        impl::writeChunkHeader(buffer.get(), mRequestId, 0, true);
+        return sizeof(ChunkHeader);
+    }
+};
+
+template<class Out>
+class ResultWriter<Out, true> : public ChunkWriter {
+    uint64_t mRequestId;
+    Out mOut;   // without its rows
+    decltype(mOut.results) mRows;
+    size_t mNextRow;
+    bool mHeadWritten;
+public:
+    ResultWriter(uint64_t requestId, const Out& out)
+        : mRequestId(requestId)
+        , mOut(out)
+        , mNextRow(0)
+        , mHeadWritten(false)
+    {
+        mRows.swap(mOut.results);
+    }
+
+    size_t next(std::unique_ptr<uint8_t[]>& buffer, size_t& bufferSize, bool& last) override {
+        if (!mHeadWritten) {
+            mHeadWritten = true;
+            last = mRows.empty();
+            return impl::writeChunk(buffer, bufferSize, mRequestId, mOut, last);
+        }
+        // as many rows as fit into a chunk, but at least one
+        auto end = mNextRow;
+        crossbow::sizer sizer;
+        uint32_t count = 0;
+        sizer & count;
+        do {
+            sizer & mRows[end];
+            ++end;
+        } while (end < mRows.size() && sizer.size < RESPONSE_CHUNK_SIZE);
+        count = end - mNextRow;
+        last = end == mRows.size();
+
+        auto length = sizeof(ChunkHeader) + sizer.size;
+        impl::reserve(buffer, bufferSize, length);
+        impl::writeChunkHeader(buffer.get(), mRequestId, sizer.size, last);
+        crossbow::serializer ser(buffer.get() + sizeof(ChunkHeader));
+        ser & count;
+        for (; mNextRow < end; ++mNextRow) {
+            ser & mRows[mNextRow];
+        }
+        ser.buffer.release();
+        return length;
+    }
+};
+
+/*
+ * Assembles a result from the payloads of its chunks.
+ */
+template<class Out, bool = impl::HasRows<Out>::value>
+class ResultReader {
+    Out mOut;
+public:
+    void consume(const uint8_t* payload) {
+        crossbow::deserializer des(payload);
+        des & mOut;
+    }
+
+    const Out& result() const {
+        return mOut;
+    }
+};
+
+template<class Out>
+class ResultReader<Out, true> {
+    Out mOut;
+    bool mHeadRead = false;
+public:
+    void consume(const uint8_t* payload) {
+        crossbow::deserializer des(payload);
+        if (!mHeadRead) {
+            mHeadRead = true;
+            des & mOut;
+            return;
+        }
+        uint32_t count;
+        des & count;
+        mOut.results.reserve(mOut.results.size() + count);
+        for (uint32_t i = 0; i < count; ++i) {
+            typename decltype(mOut.results)::value_type row;
+            des & row;
+            mOut.results.push_back(std::move(row));
+        }
+    }
+
+    const Out& result() const {
+        return mOut;
+    }
+};
+
 namespace client {
 
 template<class... Args>
@@ -425,124 +968,290 @@ struct argsType<> {
     using type = void;
 };
 
+/*
+ * Client side of a connection. execute() may be called again before the
+ * previous requests are answered (also from other threads), the callback of
+ * every request is called once its response is complete. Callbacks run on
+ * the io_service, one at a time per connection.
+ *
+ * Once a read or write failed the connection is closed, the requests in
+ * flight and all later ones fail with that error.
+ *
+ * The asio handlers refer to this object, it may only be moved (e.g. while
+ * a vector of clients is filled) before the first request.
+ */
 class CommandsImpl {
+    using error_code = boost::system::error_code;
+    /*
+     * Consumes the chunks of a response, called with an error code instead
+     * if the connection fails.
+     */
+    using Handler = std::function<void(const error_code&, const uint8_t* /* payload */, bool /* last */)>;
+
     boost::asio::ip::tcp::socket& mSocket;
+    std::unique_ptr<std::mutex> mMutex;
+    uint64_t mNextRequestId = 0;
+    std::unordered_map<uint64_t, Handler> mPending;     // requests without a complete response
+    std::deque<std::vector<uint8_t>> mWriteQueue;       // the front is being written
+    bool mReading = false;                              // a read is outstanding
+    error_code mError;                                  // the connection failed
+    ChunkHeader mHeader;
     size_t mCurrSize = 1024;
-    std::unique_ptr<uint8_t[]> mCurrentRequest;
+    std::unique_ptr<uint8_t[]> mCurrentResponse;
 public:
     CommandsImpl(boost::asio::ip::tcp::socket& socket)
-        : mSocket(socket), mCurrentRequest(new uint8_t[mCurrSize])
+        : mSocket(socket)
+        , mMutex(new std::mutex())
+        , mCurrentResponse(new uint8_t[mCurrSize])
     {
     }
 
-    template<class Callback, class Result>
-    typename std::enable_if<std::is_void<Result>::value, void>::type
-    readResponse(const Callback& callback, size_t bytes_read = 0) {
-        assert(bytes_read <= 1);
-        if (bytes_read) {
-            boost::system::error_code noError;
-            callback(noError);
+    /*
+     * Number of requests that are not answered yet.
+     */
+    size_t inFlight() const {
+        std::lock_guard<std::mutex> _(*mMutex);
+        return mPending.size();
+    }
+
+    template<Command C, class Callback, class... Args>
+    void execute(const Callback& callback, const Args&... args) {
+        static_assert(
+                (std::is_void<typename Signature<C>::arguments>::value && std::is_void<argsType<Args...>>::value) ||
+                std::is_same<typename Signature<C>::arguments, typename argsType<Args...>::type>::value,
+                "Wrong function arguments");
+        send<typename Signature<C>::result>(C, callback, args...);
+    }
+
+    /*
+     * Runs the query Q prepared as plan (see PREPARE) with the parameters of
+     * args, their sample_permille is the one given to PREPARE. The callback
+     * gets the result of Q.
+     */
+    template<Command Q, class Callback>
+    void executePrepared(const Callback& callback, uint32_t plan, const typename Signature<Q>::arguments& args) {
+        static_assert(isQuery(Q), "Only Q1 to Q7 can be prepared");
+        ExecuteIn in;
+        in.plan = plan;
+        in.query = Q;
+        in.parameters = parameters(args);
+        send<typename Signature<Q>::result>(Command::EXECUTE, callback, in);
+    }
+
+private:
+    /*
+     * Sends a request, its response is deserialized as ResType.
+     */
+    template<class ResType, class Callback, class... Args>
+    void send(Command command, const Callback& callback, const Args&... args) {
+        uint64_t requestId = 0;
+        crossbow::sizer sizer;
+        sizer & sizer.size;
+        sizer & requestId;
+        sizer & command;
+        impl::ArgSerializer<Args...> argSerializer;
+        argSerializer.exec(sizer, args...);
+        std::vector<uint8_t> request(sizer.size);
+
+        std::lock_guard<std::mutex> _(*mMutex);
+        if (mError) {
+            auto handle = handler<ResType>(callback);
+            auto ec = mError;
+            mSocket.get_io_service().post([handle, ec]() {
+                handle(ec, nullptr, true);
+            });
+            return;
+        }
+        requestId = mNextRequestId++;
+        crossbow::serializer ser(request.data());
+        ser & sizer.size;
+        ser & requestId;
+        ser & command;
+        argSerializer.exec(ser, args...);
+        ser.buffer.release();
+        mPending.emplace(requestId, handler<ResType>(callback));
+        mWriteQueue.push_back(std::move(request));
+        if (mWriteQueue.size() == 1) {
+            write();
         }
-        mSocket.async_read_some(boost::asio::buffer(mCurrentRequest.get(), mCurrSize),
-                [this, callback, bytes_read](const boost::system::error_code& ec, size_t br){
+        if (!mReading) {
+            mReading = true;
+            readChunk();
+        }
+    }
+
+    template<class Result, class Callback>
+    typename std::enable_if<std::is_void<Result>::value, Handler>::type
+    handler(const Callback& callback) {
+        return [callback](const error_code& ec, const uint8_t*, bool) {
+            callback(ec);
+        };
+    }
+
+    template<class Result, class Callback>
+    typename std::enable_if<!std::is_void<Result>::value, Handler>::type
+    handler(const Callback& callback) {
+        auto reader = std::make_shared<ResultReader<Result>>();
+        return [this, callback, reader](const error_code& ec, const uint8_t* payload, bool last) {
+            if (ec) {
+                error<Result>(ec, callback);
+                return;
+            }
+            reader->consume(payload);
+            if (last) {
+                callback(ec, reader->result());
+            }
+        };
+    }
+
+    /*
+     * Writes the front of the write queue, mMutex has to be held.
+     */
+    void write() {
+        auto& request = mWriteQueue.front();
+        boost::asio::async_write(mSocket, boost::asio::buffer(request.data(), request.size()),
+                [this](const error_code& ec, size_t) {
                     if (ec) {
-                        error<Result>(ec, callback);
+                        fail(ec, false);
                         return;
                     }
-                    readResponse<Callback, Result>(callback, bytes_read + br);
+                    std::lock_guard<std::mutex> _(*mMutex);
+                    mWriteQueue.pop_front();
+                    if (!mWriteQueue.empty()) {
+                        write();
+                    }
                 });
     }
 
-    template<class Callback, class Result>
-    typename std::enable_if<!std::is_void<Result>::value, void>::type
-    readResponse(const Callback& callback, size_t bytes_read = 0) {
-        auto respSize = *reinterpret_cast<size_t*>(mCurrentRequest.get());
-        if (bytes_read >= 8 && respSize == bytes_read) {
-            // response read
-            Result res;
-            boost::system::error_code noError;
-            crossbow::deserializer ser(mCurrentRequest.get() + sizeof(size_t));
-            ser & res;
-            callback(noError, res);
-            return;
-        } else if (bytes_read >= 8 && respSize > mCurrSize) {
-            std::unique_ptr<uint8_t[]> newBuf(new uint8_t[respSize]);
-            memcpy(newBuf.get(), mCurrentRequest.get(), mCurrSize);
-            mCurrentRequest.swap(newBuf);
-        }
-        mSocket.async_read_some(boost::asio::buffer(mCurrentRequest.get() + bytes_read, mCurrSize - bytes_read),
-                [this, callback, bytes_read](const boost::system::error_code& ec, size_t br){
+    /*
+     * Reads the next response chunk, there is at most one read outstanding
+     * and it stops once every request is answered.
+     */
+    void readChunk() {
+        boost::asio::async_read(mSocket, boost::asio::buffer(&mHeader, sizeof(mHeader)),
+                [this](const error_code& ec, size_t) {
                     if (ec) {
-                        Result res;
-                        callback(ec, res);
+                        fail(ec, true);
                         return;
                     }
-                    readResponse<Callback, Result>(callback, bytes_read + br);
+                    impl::reserve(mCurrentResponse, mCurrSize, mHeader.length);
+                    boost::asio::async_read(mSocket, boost::asio::buffer(mCurrentResponse.get(), mHeader.length),
+                            [this](const error_code& ec, size_t) {
+                                if (ec) {
+                                    fail(ec, true);
+                                    return;
+                                }
+                                dispatchChunk();
+                            });
                 });
     }
 
+    void dispatchChunk() {
+        Handler handler;
+        {
+            std::lock_guard<std::mutex> _(*mMutex);
+            auto iter = mPending.find(mHeader.requestId);
+            if (iter != mPending.end()) {
+                if (mHeader.last) {
+                    handler = std::move(iter->second);
+                    mPending.erase(iter);
+                } else {
+                    handler = iter->second;
+                }
+            }
+        }
+        // the handler may issue new requests, it must not hold the lock
+        if (handler) {
+            handler(error_code(), mCurrentResponse.get(), mHeader.last);
+        }
+        std::lock_guard<std::mutex> _(*mMutex);
+        if (mPending.empty()) {
+            mReading = false;
+            return;
+        }
+        readChunk();
+    }
+
+    /*
+     * Fails all requests in flight and closes the socket, which cancels the
+     * outstanding read. Only the read handler (reading) clears mReading,
+     * such that a new request never starts a second read.
+     */
+    void fail(const error_code& ec, bool reading) {
+        std::unordered_map<uint64_t, Handler> pending;
+        {
+            std::lock_guard<std::mutex> _(*mMutex);
+            if (!mError) {
+                mError = ec;
+            }
+            pending.swap(mPending);
+            mWriteQueue.clear();
+            if (reading) {
+                mReading = false;
+            }
+            error_code ignored;
+            mSocket.close(ignored);
+        }
+        for (auto& request : pending) {
+            request.second(ec, nullptr, true);
+        }
+    }
+
     template<class Res, class Callback>
     typename std::enable_if<std::is_void<Res>::value, void>::type
-    error(const boost::system::error_code& ec, const Callback& callback) {
+    error(const error_code& ec, const Callback& callback) {
         callback(ec);
     }
 
     template<class Res, class Callback>
     typename std::enable_if<!std::is_void<Res>::value, void>::type
-    error(const boost::system::error_code& ec, const Callback& callback) {
+    error(const error_code& ec, const Callback& callback) {
         Res res;
         callback(ec, res);
     }
-
-    template<Command C, class Callback, class... Args>
-    void execute(const Callback& callback, const Args&... args) {
-        static_assert(
-                (std::is_void<typename Signature<C>::arguments>::value && std::is_void<argsType<Args...>>::value) ||
-                std::is_same<typename Signature<C>::arguments, typename argsType<Args...>::type>::value,
-                "Wrong function arguments");
-        using ResType = typename Signature<C>::result;
-        crossbow::sizer sizer;
-        sizer & sizer.size;
-        sizer & C;
-        impl::ArgSerializer<Args...> argSerializer;
-        argSerializer.exec(sizer, args...);
-        if (mCurrSize < sizer.size) {
-            mCurrentRequest.reset(new uint8_t[sizer.size]);
-            mCurrSize = sizer.size;
-        }
-        crossbow::serializer ser(mCurrentRequest.get());
-        ser & sizer.size;
-        ser & C;
-        argSerializer.exec(ser, args...);
-        ser.buffer.release();
-        boost::asio::async_write(mSocket, boost::asio::buffer(mCurrentRequest.get(), sizer.size),
-                    [this, callback](const boost::system::error_code& ec, size_t){
-                        if (ec) {
-                            error<ResType>(ec, callback);
-                            return;
-                        }
-                        readResponse<Callback, ResType>(callback);
-                    });
-    }
 };
 
 } // namespace client
 
 namespace server {
 
+/*
+ * Server side of a connection. Requests are dispatched as soon as they are
+ * read, so a connection has any number of requests in flight, and the
+ * responses are written as they finish. Commands that have to run alone
+ * (see exclusive()) are only followed by the next request once they are
+ * answered.
+ */
 template<class Implementation>
 class Server {
+    struct Response {
+        std::shared_ptr<ChunkWriter> writer;
+        bool resumeRead;    // continue reading requests once written
+    };
+
     Implementation& mImpl;
     boost::asio::ip::tcp::socket& mSocket;
     size_t mBufSize = 1024;
     std::unique_ptr<uint8_t[]> mBuffer;
     using error_code = boost::system::error_code;
     bool doQuit = false;
+
+    std::mutex mMutex;
+    std::deque<Response> mResponses;    // the front is being written
+    size_t mWriteBufSize = 1024;
+    std::unique_ptr<uint8_t[]> mWriteBuffer;
+    size_t mInFlight = 0;               // requests dispatched and not answered
+    bool mReading = false;
+    bool mClosed = false;
+    bool mRejected = false;             // stop reading, close once answered
+
+    std::vector<PrepareIn> mPrepared;   // prepared queries, indexed by plan handle
 public:
     Server(Implementation& impl, boost::asio::ip::tcp::socket& socket)
         : mImpl(impl)
         , mSocket(socket)
         , mBuffer(new uint8_t[mBufSize])
+        , mWriteBuffer(new uint8_t[mWriteBufSize])
     {}
     void run() {
         read();
@@ -550,101 +1259,284 @@ public:
     void quit() {
         doQuit = true;
     }
+
+    /*
+     * Drops the request being dispatched without an answer and closes the
+     * connection once the responses in flight are written. The
+     * implementation calls it from execute instead of the callback.
+     */
+    void reject() {
+        std::lock_guard<std::mutex> _(mMutex);
+        --mInFlight;
+        mRejected = true;
+    }
 private:
+    /*
+     * Schema changes, population and exit are not run concurrently with
+     * other requests of the connection.
+     */
+    static bool exclusive(Command cmd) {
+        return cmd == Command::CREATE_SCHEMA || cmd == Command::POPULATE_TABLE || cmd == Command::EXIT;
+    }
+
+    uint64_t requestId() const {
+        return *reinterpret_cast<const uint64_t*>(mBuffer.get() + sizeof(size_t));
+    }
+
     template<Command C, class Callback>
     typename std::enable_if<std::is_void<typename Signature<C>::arguments>::value, void>::type
     execute(Callback callback) {
         mImpl.template execute<C>(callback);
     }
 
+    template<Command C>
+    typename Signature<C>::arguments arguments() const {
+        typename Signature<C>::arguments args;
+        crossbow::deserializer des(mBuffer.get() + sizeof(size_t) + sizeof(uint64_t) + sizeof(Command));
+        des & args;
+        return args;
+    }
+
     template<Command C, class Callback>
     typename std::enable_if<!std::is_void<typename Signature<C>::arguments>::value, void>::type
     execute(Callback callback) {
-        using Args = typename Signature<C>::arguments;
-        Args args;
-        crossbow::deserializer des(mBuffer.get() + sizeof(size_t) + sizeof(Command));
-        des & args;
-        mImpl.template execute<C>(args, callback);
+        mImpl.template execute<C>(arguments<C>(), callback);
     }
 
     template<Command C>
     typename std::enable_if<std::is_void<typename Signature<C>::result>::value, void>::type execute() {
-        execute<C>([this]() {
-            // send the result back
-            mBuffer[0] = 1;
-            boost::asio::async_write(mSocket,
-                    boost::asio::buffer(mBuffer.get(), 1),
-                    [this](const error_code& ec, size_t bytes_written) {
-                        if (ec) {
-                            std::cerr << ec.message() << std::endl;
-                            return;
-                        }
-                        read(0);
-                    }
-            );
+        auto id = requestId();
+        execute<C>([this, id]() {
+            respond(std::make_shared<ResultWriter<void>>(id), exclusive(C));
         });
     }
 
     template<Command C>
-    typename std::enable_if<!std::is_void<typename Signature<C>::result>::value, void>::type execute() {
+    typename std::enable_if<C != Command::PREPARE && !std::is_void<typename Signature<C>::result>::value, void>::type
+    execute() {
         using Res = typename Signature<C>::result;
-        execute<C>([this](const Res& result) {
-            // Serialize result
-            crossbow::sizer sizer;
-            sizer & sizer.size;
-            sizer & result;
-            if (mBufSize < sizer.size) {
-                mBuffer.reset(new uint8_t[sizer.size]);
-            }
-            crossbow::serializer ser(mBuffer.get());
-            ser & sizer.size;
-            ser & result;
-            ser.buffer.release();
-            // send the result back
-            boost::asio::async_write(mSocket,
-                    boost::asio::buffer(mBuffer.get(), sizer.size),
-                    [this](const error_code& ec, size_t bytes_written) {
-                        if (ec) {
-                            std::cerr << ec.message() << std::endl;
-                            mSocket.close();
-                            mImpl.close();
-                            return;
-                        }
-                        read(0);
-                    }
-            );
+        auto id = requestId();
+        execute<C>([this, id](const Res& result) {
+            respond(std::make_shared<ResultWriter<Res>>(id, result), exclusive(C));
         });
     }
-    void read(size_t bytes_read = 0) {
-        if (bytes_read == 0 && doQuit) {
-            mSocket.get_io_service().stop();
+
+    /*
+     * PREPARE and EXECUTE are handled here, the implementation only sees
+     * the queries they run.
+     */
+    template<Command C>
+    typename std::enable_if<C == Command::PREPARE, void>::type execute() {
+        auto args = arguments<C>();
+        PrepareOut result;
+        if (!isQuery(args.query)) {
+            result.success = false;
+            result.error = "Only Q1 to Q7 can be prepared";
+        } else if (isApproximate(args.sample_permille) && !takesSample(args.query)) {
+            result.success = false;
+            result.error = "Only Q1, Q3, Q4 and Q5 take a sample";
+        } else {
+            auto iter = std::find_if(mPrepared.begin(), mPrepared.end(), [&args](const PrepareIn& prepared) {
+                return prepared.query == args.query && prepared.sample_permille == args.sample_permille;
+            });
+            if (iter == mPrepared.end()) {
+                iter = mPrepared.insert(mPrepared.end(), args);
+            }
+            result.plan = iter - mPrepared.begin();
         }
-        size_t reqSize = 0;
-        if (bytes_read != 0) {
-            reqSize = *reinterpret_cast<size_t*>(mBuffer.get());
+        respond(std::make_shared<ResultWriter<PrepareOut>>(requestId(), result), false);
+    }
+
+    template<Command C>
+    typename std::enable_if<C == Command::EXECUTE, void>::type execute() {
+        auto args = arguments<C>();
+        switch (args.query) {
+        case Command::Q1:
+            executePrepared<Command::Q1>(args);
+            break;
+        case Command::Q2:
+            executePrepared<Command::Q2>(args);
+            break;
+        case Command::Q3:
+            executePrepared<Command::Q3>(args);
+            break;
+        case Command::Q4:
+            executePrepared<Command::Q4>(args);
+            break;
+        case Command::Q5:
+            executePrepared<Command::Q5>(args);
+            break;
+        case Command::Q6:
+            executePrepared<Command::Q6>(args);
+            break;
+        case Command::Q7:
+            executePrepared<Command::Q7>(args);
+            break;
+        default:
+            // there is no result type to answer with
+            std::cerr << "Closing connection: only Q1 to Q7 can be executed" << std::endl;
+            reject();
         }
-        if (bytes_read != 0 && reqSize == bytes_read) {
-            // done reading
-            auto cmd = *reinterpret_cast<Command*>(mBuffer.get() + sizeof(size_t));
-            SWITCH_CASE(Command, cmd, COMMANDS)
+    }
+
+    template<Command Q>
+    void executePrepared(const ExecuteIn& args) {
+        using Res = typename Signature<Q>::result;
+        auto id = requestId();
+        auto callback = [this, id](const Res& result) {
+            respond(std::make_shared<ResultWriter<Res>>(id, result), false);
+        };
+        typename Signature<Q>::arguments in;
+        Res error;
+        error.success = false;
+        if (args.plan >= mPrepared.size() || mPrepared[args.plan].query != Q) {
+            error.error = "Unknown plan";
+            callback(error);
             return;
-        } else if (bytes_read >= 8 && reqSize > mBufSize) {
-            std::unique_ptr<uint8_t[]> newBuf(new uint8_t[reqSize]);
-            memcpy(newBuf.get(), mBuffer.get(), mBufSize);
-            mBuffer.swap(newBuf);
-            mBufSize = reqSize;
         }
-        mSocket.async_read_some(boost::asio::buffer(mBuffer.get() + bytes_read, mBufSize - bytes_read),
-                [this, bytes_read](const error_code& ec, size_t br){
+        if (!bindParameters(args.parameters, mPrepared[args.plan].sample_permille, in)) {
+            error.error = "Wrong number of parameters";
+            callback(error);
+            return;
+        }
+        mImpl.template execute<Q>(in, callback);
+    }
+
+    /*
+     * Queues a response, may be called from any thread.
+     */
+    void respond(std::shared_ptr<ChunkWriter> writer, bool resumeRead) {
+        std::unique_lock<std::mutex> lock(mMutex);
+        if (mClosed) {
+            --mInFlight;
+            closeIfIdle(lock);
+            return;
+        }
+        mResponses.push_back(Response{std::move(writer), resumeRead});
+        if (mResponses.size() == 1) {
+            writeChunk();
+        }
+    }
+
+    /*
+     * Writes the next chunk of the front response, mMutex has to be held.
+     * Unfinished responses go to the back of the queue, such that the
+     * responses in flight take turns chunk by chunk.
+     */
+    void writeChunk() {
+        bool last;
+        auto length = mResponses.front().writer->next(mWriteBuffer, mWriteBufSize, last);
+        boost::asio::async_write(mSocket,
+                boost::asio::buffer(mWriteBuffer.get(), length),
+                [this, last](const error_code& ec, size_t bytes_written) {
+                    std::unique_lock<std::mutex> lock(mMutex);
                     if (ec) {
                         std::cerr << ec.message() << std::endl;
+                        mInFlight -= mResponses.size();
+                        mResponses.clear();
+                        mClosed = true;
+                        // cancels the outstanding read
                         mSocket.close();
-                        mImpl.close();
+                        closeIfIdle(lock);
+                        return;
+                    }
+                    auto response = std::move(mResponses.front());
+                    mResponses.pop_front();
+                    if (!last) {
+                        mResponses.push_back(std::move(response));
+                    } else {
+                        --mInFlight;
+                    }
+                    if (!mResponses.empty()) {
+                        writeChunk();
+                    } else if (mRejected) {
+                        closeIfIdle(lock);
                         return;
                     }
-                    read(bytes_read + br);
+                    if (last && response.resumeRead) {
+                        lock.unlock();
+                        read();
+                    }
+                }
+        );
+    }
+
+    void read() {
+        if (doQuit) {
+            mSocket.get_io_service().stop();
+        }
+        {
+            std::unique_lock<std::mutex> lock(mMutex);
+            if (mClosed || mRejected) {
+                mReading = false;
+                closeIfIdle(lock);
+                return;
+            }
+            mReading = true;
+        }
+        boost::asio::async_read(mSocket, boost::asio::buffer(mBuffer.get(), sizeof(size_t)),
+                [this](const error_code& ec, size_t) {
+                    if (ec) {
+                        readFailed(ec);
+                        return;
+                    }
+                    auto reqSize = *reinterpret_cast<size_t*>(mBuffer.get());
+                    if (reqSize > mBufSize) {
+                        std::unique_ptr<uint8_t[]> newBuf(new uint8_t[reqSize]);
+                        memcpy(newBuf.get(), mBuffer.get(), sizeof(size_t));
+                        mBuffer.swap(newBuf);
+                        mBufSize = reqSize;
+                    }
+                    boost::asio::async_read(mSocket,
+                            boost::asio::buffer(mBuffer.get() + sizeof(size_t), reqSize - sizeof(size_t)),
+                            [this](const error_code& ec, size_t) {
+                                if (ec) {
+                                    readFailed(ec);
+                                    return;
+                                }
+                                dispatch();
+                            });
                 });
     }
+
+    void dispatch() {
+        auto cmd = *reinterpret_cast<Command*>(mBuffer.get() + sizeof(size_t) + sizeof(uint64_t));
+        auto alone = exclusive(cmd);
+        {
+            std::lock_guard<std::mutex> _(mMutex);
+            ++mInFlight;
+            if (alone) {
+                mReading = false;
+            }
+        }
+        SWITCH_CASE(Command, cmd, COMMANDS)
+        if (!alone) {
+            read();
+        }
+    }
+
+    void readFailed(const error_code& ec) {
+        std::unique_lock<std::mutex> lock(mMutex);
+        if (!mClosed) {
+            std::cerr << ec.message() << std::endl;
+        }
+        mReading = false;
+        mClosed = true;
+        closeIfIdle(lock);
+    }
+
+    /*
+     * Closes the connection once it failed and no operation refers to it
+     * anymore, mImpl.close() destroys this server.
+     */
+    void closeIfIdle(std::unique_lock<std::mutex>& lock) {
+        if ((!mClosed && !mRejected) || mReading || mInFlight != 0 || !mResponses.empty()) {
+            return;
+        }
+        lock.unlock();
+        mSocket.close();
+        mImpl.close();
+    }
 };
 
 } // namespace server
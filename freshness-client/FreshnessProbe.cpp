@@ -0,0 +1,156 @@
+/*
+ * (C) Copyright 2015 ETH Zurich Systems Group (http://www.systems.ethz.ch/) and others.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Contributors:
+ *     Markus Pilman <mpilman@inf.ethz.ch>
+ *     Simon Loesing <sloesing@inf.ethz.ch>
+ *     Thomas Etter <etterth@gmail.com>
+ *     Kevin Bocksrocker <kevin.bocksrocker@gmail.com>
+ *     Lucas Braun <braunl@inf.ethz.ch>
+ */
+#include "FreshnessProbe.hpp"
+#include <crossbow/logger.hpp>
+
+#include <algorithm>
+#include <vector>
+
+using err_code = boost::system::error_code;
+
+namespace aim {
+
+constexpr std::chrono::seconds FreshnessProbe::MARKER_TIMEOUT;
+constexpr uint64_t FreshnessProbe::MARKER_CALL_ID;
+
+struct FreshnessProbe::Marker {
+    uint64_t subscriber;
+    int64_t timestamp;
+    std::chrono::steady_clock::time_point sent;
+    boost::asio::steady_timer timer;
+
+    Marker(boost::asio::io_service& service, uint64_t subscriber, int64_t timestamp)
+        : subscriber(subscriber)
+        , timestamp(timestamp)
+        , sent(std::chrono::steady_clock::now())
+        , timer(service)
+    {}
+};
+
+FreshnessProbe::FreshnessProbe(boost::asio::io_service& service,
+        uint64_t subscriberNum,
+        uint64_t lowest,
+        uint64_t highest,
+        decltype(Clock::now()) endTime,
+        HistogramSet& histograms)
+    : mSocket(service)
+    , mEventSocket(service)
+    , mCmds(mSocket)
+    , mTimer(service)
+    , mHistograms(&histograms)
+    , rnd(subscriberNum)
+    , mLowest(lowest)
+    , mHighest(highest)
+    , mEndTime(endTime)
+    , mNextSubscriber(lowest)
+    , mNextCallId(0)
+    , mLastTimestamp(0)
+    , mPollInterval(0)
+    , mDatagram(new uint8_t[MAX_EVENT_DATAGRAM_SIZE])
+    , mSent(0)
+    , mVisible(0)
+    , mLost(0)
+{}
+
+FreshnessProbe::~FreshnessProbe() = default;
+
+void FreshnessProbe::run(double markerRate, std::chrono::microseconds pollInterval) {
+    std::chrono::duration<double> interval(1.0 / markerRate);
+    mMarkerInterval = std::chrono::duration_cast<std::chrono::steady_clock::duration>(interval);
+    mPollInterval = pollInterval;
+    mNextMarker = std::chrono::steady_clock::now();
+    sendMarker();
+}
+
+void FreshnessProbe::scheduleMarker() {
+    // absolute deadlines, such that the handler latency does not add up
+    mNextMarker += mMarkerInterval;
+    mTimer.expires_at(mNextMarker);
+    mTimer.async_wait([this](const err_code& ec) {
+        if (ec) {
+            LOG_ERROR("Error: " + ec.message());
+            return;
+        }
+        sendMarker();
+    });
+}
+
+void FreshnessProbe::sendMarker() {
+    if (Clock::now() > mEndTime) return;
+    std::vector<Event> events(1);
+    auto& e = events.front();
+    rnd.randomEvent(e);
+    e.caller_id = mNextSubscriber;
+    e.call_id = MARKER_CALL_ID | mNextCallId++;
+    // only markers touch the subscriber, a larger timestamp identifies this one
+    mLastTimestamp = std::max(e.timestamp, mLastTimestamp + 1);
+    e.timestamp = mLastTimestamp;
+    mNextSubscriber = mNextSubscriber == mHighest ? mLowest : mNextSubscriber + 1;
+
+    auto marker = std::make_shared<Marker>(mSocket.get_io_service(), e.caller_id, e.timestamp);
+    auto size = serializeEvents(events, mDatagram.get());
+    err_code ec;
+    mEventSocket.send(boost::asio::buffer(mDatagram.get(), size), 0, ec);
+    if (ec) {
+        LOG_ERROR("ERROR while sending marker: %1%", ec.message());
+    } else {
+        mSent.fetch_add(1, std::memory_order_relaxed);
+        poll(std::move(marker));
+    }
+    scheduleMarker();
+}
+
+void FreshnessProbe::poll(std::shared_ptr<Marker> marker) {
+    mCmds.execute<Command::LOOKUP>([this, marker](const err_code& ec, const LookupOut& result) {
+        if (ec) {
+            LOG_ERROR("Error: " + ec.message());
+            return;
+        }
+        auto now = std::chrono::steady_clock::now();
+        if (!result.success) {
+            LOG_ERROR("Lookup failed: %1%", result.error);
+            mLost.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        if (result.timestamp >= marker->timestamp) {
+            auto freshness = std::chrono::duration_cast<std::chrono::microseconds>(now - marker->sent);
+            mHistograms->record("freshness", freshness.count());
+            mVisible.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        if (now - marker->sent > MARKER_TIMEOUT) {
+            mLost.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        marker->timer.expires_from_now(mPollInterval);
+        marker->timer.async_wait([this, marker](const err_code& ec) {
+            if (ec) {
+                LOG_ERROR("Error: " + ec.message());
+                return;
+            }
+            poll(marker);
+        });
+    }, marker->subscriber);
+}
+
+} // aim
@@ -0,0 +1,125 @@
+/*
+ * (C) Copyright 2015 ETH Zurich Systems Group (http://www.systems.ethz.ch/) and others.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Contributors:
+ *     Markus Pilman <mpilman@inf.ethz.ch>
+ *     Simon Loesing <sloesing@inf.ethz.ch>
+ *     Thomas Etter <etterth@gmail.com>
+ *     Kevin Bocksrocker <kevin.bocksrocker@gmail.com>
+ *     Lucas Braun <braunl@inf.ethz.ch>
+ */
+#pragma once
+#include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <common/Histogram.hpp>
+#include <common/Protocol.hpp>
+#include <common/Util.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+
+namespace aim {
+
+using Clock = std::chrono::system_clock;
+
+/*
+ * Measures the freshness of the data the queries see: marker events are
+ * sent for subscribers that receive no other events, and the record of the
+ * caller is polled with LOOKUP until it holds the timestamp of the marker.
+ * The time from sending a marker until a lookup sees it is recorded into
+ * histograms as "freshness", it overestimates the actual delay by at most
+ * the poll interval plus the lookup round trip.
+ */
+class FreshnessProbe {
+    using Socket = boost::asio::ip::tcp::socket;
+    using EventSocket = boost::asio::ip::udp::socket;
+    struct Marker;
+
+    Socket mSocket;
+    EventSocket mEventSocket;
+    client::CommandsImpl mCmds;
+    boost::asio::steady_timer mTimer;
+    HistogramSet* mHistograms;
+    Random_t rnd;
+    uint64_t mLowest;
+    uint64_t mHighest;
+    decltype(Clock::now()) mEndTime;
+
+    uint64_t mNextSubscriber;
+    uint64_t mNextCallId;
+    int64_t mLastTimestamp;
+    std::chrono::steady_clock::duration mMarkerInterval;
+    std::chrono::steady_clock::time_point mNextMarker;
+    std::chrono::microseconds mPollInterval;
+    std::unique_ptr<uint8_t[]> mDatagram;
+
+    std::atomic<uint64_t> mSent;
+    std::atomic<uint64_t> mVisible;
+    std::atomic<uint64_t> mLost;
+public:
+    /*
+     * Markers go to the subscribers lowest to highest, the event stream must
+     * not touch them.
+     */
+    FreshnessProbe(boost::asio::io_service& service,
+                   uint64_t subscriberNum,
+                   uint64_t lowest,
+                   uint64_t highest,
+                   decltype(Clock::now()) endTime,
+                   HistogramSet& histograms);
+    ~FreshnessProbe();
+
+    Socket& socket() {
+        return mSocket;
+    }
+    EventSocket& eventSocket() {
+        return mEventSocket;
+    }
+
+    /*
+     * Sends markerRate markers per second until the end time, a marker is
+     * polled every pollInterval until it is visible.
+     */
+    void run(double markerRate, std::chrono::microseconds pollInterval);
+
+    /*
+     * Counters of the markers, may be called from any thread. A marker that
+     * is not visible after MARKER_TIMEOUT (e.g. its datagram was dropped)
+     * counts as lost.
+     */
+    uint64_t sent() const {
+        return mSent.load(std::memory_order_relaxed);
+    }
+    uint64_t visible() const {
+        return mVisible.load(std::memory_order_relaxed);
+    }
+    uint64_t lost() const {
+        return mLost.load(std::memory_order_relaxed);
+    }
+
+    static constexpr std::chrono::seconds MARKER_TIMEOUT{10};
+
+    /*
+     * The call ids of markers have the highest bit set.
+     */
+    static constexpr uint64_t MARKER_CALL_ID = uint64_t(1) << 63;
+private:
+    void scheduleMarker();
+    void sendMarker();
+    void poll(std::shared_ptr<Marker> marker);
+};
+
+}
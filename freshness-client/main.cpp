@@ -0,0 +1,321 @@
+/*
+ * (C) Copyright 2015 ETH Zurich Systems Group (http://www.systems.ethz.ch/) and others.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Contributors:
+ *     Markus Pilman <mpilman@inf.ethz.ch>
+ *     Simon Loesing <sloesing@inf.ethz.ch>
+ *     Thomas Etter <etterth@gmail.com>
+ *     Kevin Bocksrocker <kevin.bocksrocker@gmail.com>
+ *     Lucas Braun <braunl@inf.ethz.ch>
+ */
+#include <crossbow/program_options.hpp>
+#include <crossbow/logger.hpp>
+
+#include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/system/error_code.hpp>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <iostream>
+#include <cassert>
+#include <fstream>
+#include <map>
+#include <thread>
+
+#include <rta-client/RTAClient.hpp>
+#include <sep-client/SEPClient.hpp>
+#include "FreshnessProbe.hpp"
+
+using namespace crossbow::program_options;
+using namespace boost::asio;
+using err_code = boost::system::error_code;
+
+std::vector<std::string> split(const std::string str, const char delim) {
+    std::stringstream ss(str);
+    std::string item;
+    std::vector<std::string> result;
+    while (std::getline(ss, item, delim)) {
+        if (item.empty()) continue;
+        result.push_back(std::move(item));
+    }
+    return result;
+}
+
+using Histograms = std::map<std::string, aim::Histogram>;
+
+/*
+ * A host is given as host[:port[:udp-port]].
+ */
+struct Host {
+    std::string host;
+    std::string port;
+    std::string udpPort;
+};
+
+/*
+ * Everything the driver reports on, the clients run on the same io_service.
+ */
+struct Driver {
+    std::vector<aim::SEPClient> sepClients;
+    std::vector<aim::RTAClient> rtaClients;
+    std::vector<std::unique_ptr<aim::FreshnessProbe>> probes;
+    aim::HistogramSet histograms;
+
+    explicit Driver(unsigned precision)
+        : histograms(precision)
+    {}
+
+    size_t events() const {
+        size_t count = 0;
+        for (auto& c : sepClients) {
+            count += c.count();
+        }
+        return count;
+    }
+};
+
+bool isQuery(const std::string& name) {
+    return name.size() == 2 && name[0] == 'Q';
+}
+
+/*
+ * Logs the event and query throughput and the freshness of the last second
+ * and appends them to out until the benchmark ends.
+ */
+void report(boost::asio::steady_timer& timer,
+            Driver& driver,
+            std::ofstream& out,
+            size_t lastEvents,
+            std::chrono::steady_clock::time_point lastReport,
+            decltype(aim::Clock::now()) startTime,
+            decltype(aim::Clock::now()) endTime)
+{
+    timer.expires_from_now(std::chrono::seconds(1));
+    timer.async_wait([&timer, &driver, &out, lastEvents, lastReport, startTime, endTime](const err_code& ec) {
+        if (ec) {
+            return;
+        }
+        auto now = std::chrono::steady_clock::now();
+        std::chrono::duration<double> elapsed = now - lastReport;
+        auto events = driver.events();
+        auto interval = driver.histograms.interval();
+        uint64_t queries = 0;
+        for (auto& h : interval) {
+            if (isQuery(h.first)) {
+                queries += h.second.count();
+            }
+        }
+        auto& freshness = interval["freshness"];
+        auto eventRate = static_cast<uint64_t>((events - lastEvents) / elapsed.count());
+        auto queryRate = static_cast<uint64_t>(queries / elapsed.count());
+        LOG_INFO("%1% events/s, %2% queries/s, freshness p50 %3%ms, p99 %4%ms, max %5%ms", eventRate, queryRate,
+                freshness.percentile(50.0) / 1000.0, freshness.percentile(99.0) / 1000.0, freshness.max() / 1000.0);
+        auto second = std::chrono::duration_cast<std::chrono::seconds>(aim::Clock::now() - startTime).count();
+        out << second << ',' << eventRate << ',' << queryRate << ',' << freshness.count()
+            << ',' << freshness.percentile(50.0) << ',' << freshness.percentile(99.0)
+            << ',' << freshness.percentile(99.9) << ',' << freshness.max() << std::endl;
+        if (aim::Clock::now() < endTime) {
+            report(timer, driver, out, events, now, startTime, endTime);
+        }
+    });
+}
+
+void logSummary(const Driver& driver, const Histograms& totals, double seconds) {
+    auto events = driver.events();
+    LOG_INFO("Sent %1% events (%2% events/s)", events, static_cast<uint64_t>(events / seconds));
+    for (auto& h : totals) {
+        auto& histogram = h.second;
+        if (!isQuery(h.first)) {
+            continue;
+        }
+        LOG_INFO("%1%: %2% queries (%3% queries/s), p50 %4%ms, p99 %5%ms, max %6%ms", h.first,
+                histogram.count(), static_cast<uint64_t>(histogram.count() / seconds),
+                histogram.percentile(50.0) / 1000.0, histogram.percentile(99.0) / 1000.0, histogram.max() / 1000.0);
+    }
+    uint64_t sent = 0;
+    uint64_t visible = 0;
+    uint64_t lost = 0;
+    for (auto& probe : driver.probes) {
+        sent += probe->sent();
+        visible += probe->visible();
+        lost += probe->lost();
+    }
+    LOG_INFO("%1% markers sent, %2% visible, %3% lost", sent, visible, lost);
+    auto iter = totals.find("freshness");
+    if (iter != totals.end()) {
+        auto& freshness = iter->second;
+        LOG_INFO("Freshness mean %1%ms, p50 %2%ms, p99 %3%ms, p99.9 %4%ms, max %5%ms", freshness.mean() / 1000.0,
+                freshness.percentile(50.0) / 1000.0, freshness.percentile(99.0) / 1000.0,
+                freshness.percentile(99.9) / 1000.0, freshness.max() / 1000.0);
+    }
+}
+
+int main(int argc, const char** argv) {
+    bool help = false;
+    uint64_t numSubscribers = 10 * 1024 * 1024;
+    std::string workloadList = "1,2,3,4,5,6,7";
+    std::string hostList;
+    std::string port("8713");
+    std::string udpPort("8714");
+    std::string logLevel("DEBUG");
+    std::string outFile("freshness.csv");
+    std::string histogramFile;
+    size_t numSepClients = 1;
+    size_t numRtaClients = 1;
+    unsigned time = 5*60;
+    unsigned networkThreads = 1u;
+    unsigned messageRate = 10000;
+    double markerRate = 100.0;
+    uint64_t markerSubscribers = 1000;
+    unsigned pollInterval = 1000;
+    unsigned precision = 3;
+    auto opts = create_options("freshness_client",
+            value<'h'>("help", &help, tag::description{"print help"})
+            , value<'H'>("hosts", &hostList,
+                tag::description{"Comma-separated list of hosts (host[:port[:udp-port]])"})
+            , value<'l'>("log-level", &logLevel, tag::description{"The log level"})
+            , value<'n'>("num-subscribers", &numSubscribers, tag::description{"Number of subscribers (data size)"})
+            , value<'t'>("time", &time, tag::description{"Duration of the benchmark in seconds"})
+            , value<'N'>("network-threads", &networkThreads, tag::description{"Number of networking threads"})
+            , value<'s'>("sep-clients", &numSepClients, tag::description{"Number of event streams per host"})
+            , value<'r'>("message-rate", &messageRate,
+                tag::description{"Event rate in events/second per event stream"})
+            , value<'c'>("rta-clients", &numRtaClients, tag::description{"Number of query clients per host"})
+            , value<'w'>("workload", &workloadList, tag::description{"Comma-separated list of query numbers (1 to 7)"})
+            , value<'m'>("marker-rate", &markerRate, tag::description{"Marker events per second per host"})
+            , value<'k'>("marker-subscribers", &markerSubscribers,
+                tag::description{"Number of subscribers (the ones with the highest ids) reserved for markers"})
+            , value<'i'>("poll-interval", &pollInterval,
+                tag::description{"Microseconds between two lookups of a marker that is not visible yet"})
+            , value<'p'>("precision", &precision,
+                tag::description{"Significant decimal digits of the histograms (1 to 5)"})
+            , value<'o'>("out", &outFile,
+                tag::description{"Path to the output file with the throughput and freshness (in us) of every second"})
+            , value<'g'>("histogram-out", &histogramFile,
+                tag::description{"Path to the binary histograms, files of several clients can be merged with rta_client --merge"})
+            );
+    try {
+        parse(opts, argc, argv);
+    } catch (argument_not_found& e) {
+        std::cerr << e.what() << std::endl << std::endl;
+        print_help(std::cout, opts);
+        return 1;
+    }
+    if (help) {
+        print_help(std::cout, opts);
+        return 0;
+    }
+    if (hostList.empty()) {
+        std::cerr << "No host\n";
+        return 1;
+    }
+    if (workloadList.empty()) {
+        std::cerr << "No workload\n";
+        return 1;
+    }
+    if (markerRate <= 0.0 || markerSubscribers == 0 || markerSubscribers >= numSubscribers) {
+        std::cerr << "Markers need a positive rate and 1 to num-subscribers - 1 subscribers\n";
+        return 1;
+    }
+
+    auto startTime = aim::Clock::now();
+    auto endTime = startTime + std::chrono::seconds(time);
+    crossbow::logger::logger->config.level = crossbow::logger::logLevelFromString(logLevel);
+    try {
+        std::vector<Host> hosts;
+        for (auto& h : split(hostList, ',')) {
+            auto addr = split(h, ':');
+            assert(addr.size() <= 3);
+            hosts.push_back(Host{addr[0], addr.size() >= 2 ? addr[1] : port, addr.size() == 3 ? addr[2] : udpPort});
+        }
+        auto workloadStrings = split(workloadList, ',');
+        std::vector<uint8_t> workload(workloadStrings.size());
+        for (uint i = 0; i < workloadStrings.size(); ++i)
+            workload[i] = std::stoi(workloadStrings[i]);
+
+        io_service service;
+        Driver driver(precision);
+        boost::asio::steady_timer reportTimer(service);
+
+        // the event streams get the lower subscribers, the markers the rest
+        auto eventSubscribers = numSubscribers - markerSubscribers;
+        auto sumSepClients = numSepClients * hosts.size();
+        auto subscribersPerClient = eventSubscribers / sumSepClients;
+        auto sumProbes = hosts.size();
+        auto markersPerProbe = std::max<uint64_t>(markerSubscribers / sumProbes, 1);
+        driver.sepClients.reserve(sumSepClients);
+        driver.rtaClients.reserve(numRtaClients * hosts.size());
+        for (size_t i = 0; i < hosts.size(); ++i) {
+            auto& host = hosts[i];
+            ip::tcp::resolver tcpResolver(service);
+            auto tcpIter = tcpResolver.resolve(ip::tcp::resolver::query(host.host, host.port));
+            ip::udp::resolver udpResolver(service);
+            auto udpIter = udpResolver.resolve(ip::udp::resolver::query(host.host, host.udpPort));
+
+            for (size_t j = 0; j < numSepClients; ++j) {
+                auto c = i * numSepClients + j;
+                auto lastSub = c == sumSepClients - 1 ? eventSubscribers : subscribersPerClient * (c + 1);
+                driver.sepClients.emplace_back(service, numSubscribers, subscribersPerClient * c + 1, lastSub, endTime);
+                boost::asio::connect(driver.sepClients.back().socket(), udpIter);
+            }
+            for (size_t j = 0; j < numRtaClients; ++j) {
+                driver.rtaClients.emplace_back(service, workload, numSubscribers, endTime, driver.histograms, false);
+                boost::asio::connect(driver.rtaClients.back().socket(), tcpIter);
+            }
+            auto lowest = eventSubscribers + 1 + markersPerProbe * i;
+            auto highest = i == sumProbes - 1 ? numSubscribers : std::min(lowest + markersPerProbe - 1, numSubscribers);
+            driver.probes.emplace_back(new aim::FreshnessProbe(service, numSubscribers, lowest, highest, endTime,
+                    driver.histograms));
+            boost::asio::connect(driver.probes.back()->socket(), tcpIter);
+            boost::asio::connect(driver.probes.back()->eventSocket(), udpIter);
+            LOG_INFO("Connected to host " + host.host);
+        }
+
+        size_t batchSize = std::min<size_t>(aim::maxEventsPerDatagram(), messageRate / 1000);
+        batchSize = std::max<size_t>(batchSize, 1);
+        for (auto& client : driver.sepClients) {
+            client.run(messageRate, batchSize, driver.histograms);
+        }
+        for (auto& client : driver.rtaClients) {
+            client.start();
+        }
+        for (auto& probe : driver.probes) {
+            probe->run(markerRate, std::chrono::microseconds(pollInterval));
+        }
+        std::ofstream out(outFile.c_str());
+        out << "second,events,queries,freshness_count,freshness_p50,freshness_p99,freshness_p999,freshness_max\n";
+        report(reportTimer, driver, out, 0, std::chrono::steady_clock::now(), startTime, endTime);
+
+        std::vector<std::thread> threads;
+        threads.reserve(networkThreads-1);
+        for (unsigned i = 0; i < networkThreads-1; ++i)
+            threads.emplace_back([&service]{service.run();});
+        service.run();
+        for (auto &thread: threads)
+            thread.join();
+
+        std::chrono::duration<double> runTime = aim::Clock::now() - startTime;
+        auto totals = driver.histograms.totals();
+        logSummary(driver, totals, runTime.count());
+        if (!histogramFile.empty()) {
+            std::ofstream histogramOut(histogramFile.c_str(), std::ios::binary);
+            aim::writeHistograms(histogramOut, totals);
+        }
+        std::cout << '\a';
+    } catch (std::exception& e) {
+        std::cerr << e.what() << std::endl;
+    }
+}
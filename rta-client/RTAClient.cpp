@@ -24,10 +24,308 @@
 #include <common/Protocol.hpp>
 #include <crossbow/logger.hpp>
 
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <stdexcept>
+#include <tuple>
+
 using err_code = boost::system::error_code;
 
 namespace aim {
 
+namespace {
+
+double relative(double difference, double value) {
+    return value != 0.0 ? std::abs(difference / value) : 0.0;
+}
+
+double errorBound(const Q1Out& result) {
+    return relative(result.avg_error, result.avg);
+}
+
+double errorBound(const Q3Out& result) {
+    double bound = 0.0;
+    for (auto& tuple : result.results) {
+        bound = std::max(bound, relative(tuple.cost_ratio_error, tuple.cost_ratio));
+    }
+    return bound;
+}
+
+double errorBound(const Q4Out& result) {
+    double bound = 0.0;
+    for (auto& tuple : result.results) {
+        bound = std::max(bound, relative(tuple.avg_num_local_calls_week_error, tuple.avg_num_local_calls_week));
+        bound = std::max(bound, relative(tuple.sum_duration_local_calls_week_error,
+                tuple.sum_duration_local_calls_week));
+    }
+    return bound;
+}
+
+double errorBound(const Q5Out& result) {
+    double bound = 0.0;
+    for (auto& tuple : result.results) {
+        bound = std::max(bound, relative(tuple.sum_cost_local_calls_week_error, tuple.sum_cost_local_calls_week));
+        bound = std::max(bound, relative(tuple.sum_cost_longdistance_calls_week_error,
+                tuple.sum_cost_longdistance_calls_week));
+    }
+    return bound;
+}
+
+double deviation(const Q1Out& approximate, const Q1Out& exact) {
+    return relative(approximate.avg - exact.avg, exact.avg);
+}
+
+/*
+ * Largest relative deviation of the tuples of the approximate result from
+ * the exact tuples with the same key, a group the sample missed counts as
+ * 100%.
+ */
+template<class Tuple, class Key, class Deviation>
+double deviation(const std::vector<Tuple>& approximate, const std::vector<Tuple>& exact,
+        Key key, Deviation tupleDeviation) {
+    std::map<decltype(key(exact.front())), const Tuple*> tuples;
+    for (auto& tuple : approximate) {
+        tuples.emplace(key(tuple), &tuple);
+    }
+    double result = 0.0;
+    for (auto& tuple : exact) {
+        auto iter = tuples.find(key(tuple));
+        result = std::max(result, iter == tuples.end() ? 1.0 : tupleDeviation(*iter->second, tuple));
+    }
+    return result;
+}
+
+double deviation(const Q3Out& approximate, const Q3Out& exact) {
+    using Tuple = Q3Out::Q3Tuple;
+    return deviation(approximate.results, exact.results, [](const Tuple& tuple) {
+        return tuple.number_of_calls_this_week;
+    }, [](const Tuple& lhs, const Tuple& rhs) {
+        return relative(lhs.cost_ratio - rhs.cost_ratio, rhs.cost_ratio);
+    });
+}
+
+double deviation(const Q4Out& approximate, const Q4Out& exact) {
+    using Tuple = Q4Out::Q4Tuple;
+    return deviation(approximate.results, exact.results, [](const Tuple& tuple) {
+        return tuple.city_name;
+    }, [](const Tuple& lhs, const Tuple& rhs) {
+        double sumDifference = static_cast<double>(lhs.sum_duration_local_calls_week)
+                - static_cast<double>(rhs.sum_duration_local_calls_week);
+        return std::max(relative(lhs.avg_num_local_calls_week - rhs.avg_num_local_calls_week,
+                        rhs.avg_num_local_calls_week),
+                relative(sumDifference, rhs.sum_duration_local_calls_week));
+    });
+}
+
+double deviation(const Q5Out& approximate, const Q5Out& exact) {
+    using Tuple = Q5Out::Q5Tuple;
+    return deviation(approximate.results, exact.results, [](const Tuple& tuple) {
+        return tuple.region_name;
+    }, [](const Tuple& lhs, const Tuple& rhs) {
+        return std::max(relative(lhs.sum_cost_local_calls_week - rhs.sum_cost_local_calls_week,
+                        rhs.sum_cost_local_calls_week),
+                relative(lhs.sum_cost_longdistance_calls_week - rhs.sum_cost_longdistance_calls_week,
+                        rhs.sum_cost_longdistance_calls_week));
+    });
+}
+
+} // anonymous namespace
+
+ArrivalProcess arrivalProcessFromString(const std::string& str) {
+    if (str == "poisson") {
+        return ArrivalProcess::POISSON;
+    }
+    if (str == "fixed") {
+        return ArrivalProcess::FIXED;
+    }
+    throw std::invalid_argument("Unknown arrival process " + str + " (poisson or fixed)");
+}
+
+const char* queryName(Command command) {
+    switch (command) {
+    case Command::Q1:
+        return "Q1";
+    case Command::Q2:
+        return "Q2";
+    case Command::Q3:
+        return "Q3";
+    case Command::Q4:
+        return "Q4";
+    case Command::Q5:
+        return "Q5";
+    case Command::Q6:
+        return "Q6";
+    case Command::Q7:
+        return "Q7";
+    default:
+        return "Unknown Transaction which should not happen in rta-client";
+    }
+}
+
+struct RTAClient::Arrivals {
+    boost::asio::system_timer timer;
+    ArrivalProcess process;
+    double rate;    // queries per second
+    std::mt19937_64 engine;
+    std::exponential_distribution<double> interArrival;
+    decltype(Clock::now()) next;
+
+    // run() is called with mutex held, queries in flight may finish concurrently
+    std::mutex mutex;
+    unsigned maxInFlight;
+    unsigned inFlight;
+    std::deque<decltype(Clock::now())> backlog;
+
+    Arrivals(boost::asio::io_service& service, double rate, ArrivalProcess process, unsigned maxInFlight)
+        : timer(service)
+        , process(process)
+        , rate(rate)
+        , engine(std::random_device()())
+        , interArrival(rate)
+        , maxInFlight(std::max(maxInFlight, 1u))
+        , inFlight(0)
+    {}
+
+    Clock::duration nextInterArrival() {
+        std::chrono::duration<double> seconds(process == ArrivalProcess::POISSON
+                ? interArrival(engine) : 1.0 / rate);
+        return std::chrono::duration_cast<Clock::duration>(seconds);
+    }
+};
+
+RTAClient::RTAClient(boost::asio::io_service& service, std::vector<uint8_t> workload, uint64_t subscriberNum,
+        decltype(Clock::now()) endTime, HistogramSet& histograms, bool keepLog, uint16_t samplePermille, bool compare)
+    : mSocket(service)
+    , mCmds(mSocket)
+    , mWorkload(workload)
+    , rnd(subscriberNum, workload.size())
+    , mCurrentQueryIdx(rnd.randomWithin<int>(0, workload.size() - 1))
+    , mHistograms(&histograms)
+    , mKeepLog(keepLog)
+    , mEndTime(endTime)
+    , mSamplePermille(samplePermille)
+    , mCompare(compare)
+{}
+
+RTAClient::RTAClient(RTAClient&&) = default;
+
+RTAClient::~RTAClient() = default;
+
+void RTAClient::setOpenLoop(double arrivalRate, ArrivalProcess process, unsigned maxInFlight) {
+    mArrivals.reset(new Arrivals(mSocket.get_io_service(), arrivalRate, process, maxInFlight));
+}
+
+void RTAClient::start() {
+    std::vector<Command> queries;
+    for (auto query : mWorkload) {
+        queries.push_back(static_cast<Command>(static_cast<int>(Command::Q1) + query - 1));
+    }
+    std::sort(queries.begin(), queries.end());
+    queries.erase(std::unique(queries.begin(), queries.end()), queries.end());
+    // (query, sample_permille, plan handle)
+    std::vector<std::tuple<Command, uint16_t, uint32_t*>> plans;
+    for (auto query : queries) {
+        if (!isApproximate(mSamplePermille) || !takesSample(query)) {
+            plans.emplace_back(query, 0, &mPlans[query]);
+            continue;
+        }
+        plans.emplace_back(query, mSamplePermille, &mPlans[query]);
+        if (mCompare) {
+            plans.emplace_back(query, 0, &mExactPlans[query]);
+        }
+    }
+    auto remaining = std::make_shared<size_t>(plans.size());
+    for (auto& plan : plans) {
+        prepare(std::get<0>(plan), std::get<1>(plan), std::get<2>(plan), remaining);
+    }
+}
+
+void RTAClient::prepare(Command query, uint16_t samplePermille, uint32_t* plan, std::shared_ptr<size_t> remaining) {
+    PrepareIn args;
+    args.query = query;
+    args.sample_permille = samplePermille;
+    mCmds.execute<Command::PREPARE>([this, query, plan, remaining](const err_code& ec, PrepareOut result) {
+        if (ec) {
+            LOG_ERROR("Error: " + ec.message());
+            return;
+        }
+        if (!result.success) {
+            LOG_ERROR("Could not prepare %1%: %2%", queryName(query), result.error);
+            return;
+        }
+        *plan = result.plan;
+        // the callbacks of a connection run one at a time
+        if (--*remaining == 0) {
+            begin();
+        }
+    }, args);
+}
+
+void RTAClient::begin() {
+    if (!mArrivals) {
+        run();
+        return;
+    }
+    mArrivals->next = Clock::now();
+    scheduleArrival();
+}
+
+void RTAClient::scheduleArrival() {
+    auto& arrivals = *mArrivals;
+    // arrivals are scheduled on absolute times, handler latency does not shift them
+    arrivals.next += arrivals.nextInterArrival();
+    if (arrivals.next > mEndTime) {
+        return;
+    }
+    arrivals.timer.expires_at(arrivals.next);
+    arrivals.timer.async_wait([this](const err_code& ec) {
+        if (ec) {
+            LOG_ERROR("Error: " + ec.message());
+            return;
+        }
+        arrive(mArrivals->next);
+        scheduleArrival();
+    });
+}
+
+void RTAClient::arrive(decltype(Clock::now()) intended) {
+    std::lock_guard<std::mutex> _(mArrivals->mutex);
+    if (mArrivals->inFlight == mArrivals->maxInFlight) {
+        mArrivals->backlog.push_back(intended);
+        return;
+    }
+    ++mArrivals->inFlight;
+    mIntended = intended;
+    run();
+}
+
+void RTAClient::finished() {
+    if (!mArrivals) {
+        run();
+        return;
+    }
+    std::lock_guard<std::mutex> _(mArrivals->mutex);
+    if (mArrivals->backlog.empty()) {
+        --mArrivals->inFlight;
+        return;
+    }
+    mIntended = mArrivals->backlog.front();
+    mArrivals->backlog.pop_front();
+    run();
+}
+
+void RTAClient::log(const LogEntry& entry) {
+    if (entry.success) {
+        // measured from the intended arrival, which is the start in closed-loop mode
+        auto latency = std::chrono::duration_cast<std::chrono::microseconds>(entry.end - entry.intended);
+        mHistograms->record(queryName(entry.transaction), std::max<int64_t>(latency.count(), 0));
+    }
+    if (mKeepLog) {
+        mLog.push_back(entry);
+    }
+}
+
 template<Command C, class... Args>
 void RTAClient::execute(const Args&... args) {
     auto now = Clock::now();
@@ -36,15 +334,58 @@ void RTAClient::execute(const Args&... args) {
         // benchmarking finished
         return;
     }
-    mCmds.execute<C>([this, now](const err_code& ec, typename Signature<C>::result result){
+    auto intended = mArrivals ? mIntended : now;
+    mCmds.executePrepared<C>([this, now, intended](const err_code& ec, typename Signature<C>::result result){
         if (ec) {
             LOG_ERROR("Error: " + ec.message());
             return;
         }
         auto end = Clock::now();
-        mLog.push_back(LogEntry{result.success, result.error, C, now, end});
-        run();
-    }, args...);
+        log(LogEntry{result.success, result.error, C, now, end, 0, 0.0, -1.0, end, intended});
+        finished();
+    }, mPlans.at(C), args...);
+}
+
+template<Command C, class In>
+void RTAClient::executeSampled(const In& args) {
+    // the sample_permille is the one the plan was prepared with
+    if (!isApproximate(mSamplePermille)) {
+        execute<C>(args);
+        return;
+    }
+    auto now = Clock::now();
+    if (now > mEndTime) {
+        return;
+    }
+    auto intended = mArrivals ? mIntended : now;
+    mCmds.executePrepared<C>([this, now, intended, args](const err_code& ec, typename Signature<C>::result result) {
+        if (ec) {
+            LOG_ERROR("Error: " + ec.message());
+            return;
+        }
+        auto end = Clock::now();
+        LogEntry entry{result.success, result.error, C, now, end, mSamplePermille,
+                errorBound(result), -1.0, end, intended};
+        if (!mCompare || !result.success) {
+            log(entry);
+            finished();
+            return;
+        }
+        // rerun the query exactly, right after the approximate one
+        mCmds.executePrepared<C>([this, entry, result](const err_code& ec, typename Signature<C>::result exactResult) {
+            if (ec) {
+                LOG_ERROR("Error: " + ec.message());
+                return;
+            }
+            auto compared = entry;
+            compared.exactEnd = Clock::now();
+            if (exactResult.success) {
+                compared.observedError = deviation(result, exactResult);
+            }
+            log(compared);
+            finished();
+        }, mExactPlans.at(C), args);
+    }, mPlans.at(C), args);
 }
 
 void RTAClient::run() {
@@ -56,7 +397,7 @@ void RTAClient::run() {
         LOG_DEBUG("Start Query 1");
         Q1In args;
         rnd.randomQ1(args);
-        execute<Command::Q1>(args);
+        executeSampled<Command::Q1>(args);
         break;
     }
     case 2:
@@ -70,7 +411,7 @@ void RTAClient::run() {
     case 3:
     {
         LOG_DEBUG("Start Query 3");
-        execute<Command::Q3>();
+        executeSampled<Command::Q3>(Q3In());
         break;
     }
     case 4:
@@ -78,7 +419,7 @@ void RTAClient::run() {
         LOG_DEBUG("Start Query 4");
         Q4In args;
         rnd.randomQ4(args);
-        execute<Command::Q4>(args);
+        executeSampled<Command::Q4>(args);
         break;
     }
     case 5:
@@ -86,7 +427,7 @@ void RTAClient::run() {
         LOG_DEBUG("Start Query 5");
         Q5In args;
         rnd.randomQ5(args);
-        execute<Command::Q5>(args);
+        executeSampled<Command::Q5>(args);
         break;
     }
     case 6:
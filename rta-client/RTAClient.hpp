@@ -22,11 +22,16 @@
  */
 #pragma once
 #include <boost/asio.hpp>
+#include <boost/asio/system_timer.hpp>
 #include <common/Protocol.hpp>
 #include <random>
 #include <chrono>
 #include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
 
+#include <common/Histogram.hpp>
 #include <common/Util.hpp>
 
 namespace aim {
@@ -39,8 +44,28 @@ struct LogEntry {
     Command transaction;
     decltype(Clock::now()) start;
     decltype(start) end;
+    uint16_t samplePermille;
+    double errorBound;      // largest confidence interval relative to its estimate
+    double observedError;   // largest deviation from the exact result, -1 if not compared
+    decltype(start) exactEnd;   // end of the exact rerun, end if not compared
+    decltype(start) intended;   // scheduled arrival in open-loop mode, start otherwise
 };
 
+/*
+ * How an open-loop client schedules the arrivals of its queries.
+ */
+enum class ArrivalProcess {
+    POISSON,    // exponentially distributed inter-arrival times
+    FIXED       // one query every 1 / rate seconds
+};
+
+ArrivalProcess arrivalProcessFromString(const std::string& str);
+
+/*
+ * Name of a query in the results, "Q1" to "Q7".
+ */
+const char* queryName(Command command);
+
 class RTAClient {
     using Socket = boost::asio::ip::tcp::socket;
     Socket mSocket;
@@ -48,17 +73,31 @@ class RTAClient {
     std::vector<uint8_t> mWorkload;
     Random_t rnd;
     uint8_t mCurrentQueryIdx;
+    HistogramSet* mHistograms;
+    bool mKeepLog;
     std::deque<LogEntry> mLog;
     decltype(Clock::now()) mEndTime;
+    uint16_t mSamplePermille;
+    bool mCompare;
+    std::map<Command, uint32_t> mPlans;         // prepared queries of the workload
+    std::map<Command, uint32_t> mExactPlans;    // exact reruns of the sampled ones
+
+    struct Arrivals;
+    std::unique_ptr<Arrivals> mArrivals;    // nullptr in closed-loop mode
+    decltype(Clock::now()) mIntended;       // arrival of the running query
 public:
-    RTAClient(boost::asio::io_service& service, std::vector<uint8_t> workload, uint64_t subscriberNum, decltype(Clock::now()) endTime)
-        : mSocket(service)
-        , mCmds(mSocket)
-        , mWorkload(workload)
-        , rnd(subscriberNum, workload.size())
-        , mCurrentQueryIdx(rnd.randomWithin<int>(0, workload.size() - 1))
-        , mEndTime(endTime)
-    {}
+    /*
+     * The latency of every successful query is recorded into histograms
+     * under its queryName, the per-query LogEntry is only kept with keepLog
+     * (it grows with the duration of the run).
+     *
+     * With a samplePermille Q1, Q3, Q4 and Q5 run approximately, compare
+     * reruns every approximate query exactly to measure its actual error.
+     */
+    RTAClient(boost::asio::io_service& service, std::vector<uint8_t> workload, uint64_t subscriberNum, decltype(Clock::now()) endTime,
+            HistogramSet& histograms, bool keepLog, uint16_t samplePermille = 0, bool compare = false);
+    RTAClient(RTAClient&&);
+    ~RTAClient();
     Socket& socket() {
         return mSocket;
     }
@@ -68,11 +107,36 @@ public:
     client::CommandsImpl& commands() {
         return mCmds;
     }
+    /*
+     * Closed loop (the default) issues the next query from the callback of
+     * the previous one. Open loop issues queries at arrivalRate per second
+     * independent of the response times: up to maxInFlight queries are
+     * pipelined on the connection, arrivals beyond that wait in a backlog.
+     * Their latency is measured from the intended arrival, which corrects
+     * for coordinated omission.
+     */
+    void setOpenLoop(double arrivalRate, ArrivalProcess process, unsigned maxInFlight = 1);
+
+    /*
+     * Prepares every query of the workload once, the queries are then
+     * executed through their plan handles.
+     */
+    void start();
     void run();
     const std::deque<LogEntry>& log() const { return mLog; }
 private:
+    void prepare(Command query, uint16_t samplePermille, uint32_t* plan, std::shared_ptr<size_t> remaining);
+    void begin();
+    void scheduleArrival();
+    void arrive(decltype(Clock::now()) intended);
+    void finished();
+    void log(const LogEntry& entry);
+
     template<Command C, class... Args>
     void execute(const Args&...);
+
+    template<Command C, class In>
+    void executeSampled(const In& args);
 };
 
 }
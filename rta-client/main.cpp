@@ -24,7 +24,9 @@
 #include <crossbow/logger.hpp>
 
 #include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
 #include <boost/system/error_code.hpp>
+#include <map>
 #include <string>
 #include <iostream>
 #include <cassert>
@@ -48,6 +50,94 @@ std::vector<std::string> split(const std::string str, const char delim) {
     return result;
 }
 
+using Histograms = std::map<std::string, aim::Histogram>;
+
+/*
+ * Latencies are recorded in microseconds and reported in milliseconds.
+ */
+double millis(uint64_t micros) {
+    return micros / 1000.0;
+}
+
+void logHistograms(const Histograms& histograms) {
+    for (auto& h : histograms) {
+        auto& histogram = h.second;
+        LOG_INFO("%1%: %2% queries, mean %3%ms, p50 %4%ms, p99 %5%ms, p99.9 %6%ms, max %7%ms", h.first,
+                histogram.count(), histogram.mean() / 1000.0, millis(histogram.percentile(50.0)),
+                millis(histogram.percentile(99.0)), millis(histogram.percentile(99.9)), millis(histogram.max()));
+    }
+}
+
+void writeHistogramFile(const std::string& path, const Histograms& histograms) {
+    std::ofstream out(path.c_str(), std::ios::binary);
+    aim::writeHistograms(out, histograms);
+    if (!out) {
+        throw std::runtime_error("Could not write " + path);
+    }
+}
+
+/*
+ * Logs the latencies of the queries that finished during the last second and
+ * appends them to intervalOut (if open) until the benchmark ends.
+ */
+void reportIntervals(boost::asio::steady_timer& timer,
+                     aim::HistogramSet& histograms,
+                     std::ofstream& intervalOut,
+                     decltype(aim::Clock::now()) startTime,
+                     decltype(aim::Clock::now()) endTime)
+{
+    timer.expires_from_now(std::chrono::seconds(1));
+    timer.async_wait([&timer, &histograms, &intervalOut, startTime, endTime](const err_code& ec) {
+        if (ec) {
+            return;
+        }
+        auto now = aim::Clock::now();
+        auto second = std::chrono::duration_cast<std::chrono::seconds>(now - startTime).count();
+        auto interval = histograms.interval();
+        for (auto& h : interval) {
+            auto& histogram = h.second;
+            if (histogram.count() == 0) {
+                continue;
+            }
+            LOG_INFO("%1%s %2%: %3% queries, p50 %4%ms, p99 %5%ms, p99.9 %6%ms, max %7%ms", second, h.first,
+                    histogram.count(), millis(histogram.percentile(50.0)), millis(histogram.percentile(99.0)),
+                    millis(histogram.percentile(99.9)), millis(histogram.max()));
+            if (intervalOut.is_open()) {
+                intervalOut << second << ',' << h.first << ',' << histogram.count()
+                    << ',' << histogram.percentile(50.0) << ',' << histogram.percentile(99.0)
+                    << ',' << histogram.percentile(99.9) << ',' << histogram.max() << '\n';
+            }
+        }
+        if (intervalOut.is_open()) {
+            intervalOut.flush();
+        }
+        if (now < endTime) {
+            reportIntervals(timer, histograms, intervalOut, startTime, endTime);
+        }
+    });
+}
+
+/*
+ * Combines the histogram files written by several clients (e.g. one per
+ * host) and reports the merged latencies.
+ */
+int mergeHistogramFiles(const std::string& fileList, const std::string& histogramOut) {
+    Histograms merged;
+    for (auto& path : split(fileList, ',')) {
+        std::ifstream in(path.c_str(), std::ios::binary);
+        if (!in) {
+            std::cerr << "Could not open " << path << std::endl;
+            return 1;
+        }
+        aim::readHistograms(in, merged);
+    }
+    logHistograms(merged);
+    if (!histogramOut.empty()) {
+        writeHistogramFile(histogramOut, merged);
+    }
+    return 0;
+}
+
 int main(int argc, const char** argv) {
     bool help = false;
     uint64_t numSubscribers = 10 * 1024 * 1024;
@@ -59,6 +149,15 @@ int main(int argc, const char** argv) {
     size_t numClients = 1;
     unsigned time = 5*60;
     unsigned networkThreads = 1u;
+    uint16_t samplePermille = 0;
+    bool compare = false;
+    double arrivalRate = 0.0;
+    std::string arrivalProcess("poisson");
+    unsigned maxInFlight = 1;
+    unsigned precision = 3;
+    std::string intervalFile;
+    std::string histogramFile;
+    std::string mergeList;
     auto opts = create_options("rta_client",
             value<'h'>("help", &help, tag::description{"print help"})
             , value<'H'>("hosts", &hostList, tag::description{"Comma-separated list of hosts"})
@@ -67,8 +166,27 @@ int main(int argc, const char** argv) {
             , value<'n'>("num-subscribers", &numSubscribers, tag::description{"Number of subscribers (data size)"})
             , value<'w'>("workload", &workloadList, tag::description{"Comma-separated list of query numbers (1 to 7)"})
             , value<'t'>("time", &time, tag::description{"Duration of the benchmark in seconds"})
-            , value<'o'>("out", &outFile, tag::description{"Path to the output file"})
+            , value<'o'>("out", &outFile,
+                tag::description{"Path to the output file with one line per query (empty keeps no per-query log)"})
             , value<'N'>("network-threads", &networkThreads, tag::description{"number of (TCP) networking threads"})
+            , value<'s'>("sample-permille", &samplePermille,
+                tag::description{"Run Q1, Q3, Q4 and Q5 approximately on this sample (1 to 999 permille)"})
+            , value<'C'>("compare", &compare,
+                tag::description{"Rerun every approximate query exactly to measure speedup and error"})
+            , value<'r'>("arrival-rate", &arrivalRate,
+                tag::description{"Open loop: queries per second per client, independent of the response times (0 runs closed-loop)"})
+            , value<'A'>("arrival-process", &arrivalProcess,
+                tag::description{"Arrivals of the open loop: poisson or fixed"})
+            , value<'q'>("max-in-flight", &maxInFlight,
+                tag::description{"Open loop: queries a client pipelines on its connection before arrivals queue up"})
+            , value<'p'>("precision", &precision,
+                tag::description{"Significant decimal digits of the latency histograms (1 to 5)"})
+            , value<'i'>("interval-out", &intervalFile,
+                tag::description{"Path to a CSV with the latency percentiles (in us) of every second"})
+            , value<'g'>("histogram-out", &histogramFile,
+                tag::description{"Path to the binary latency histograms, files of several clients can be merged"})
+            , value<'m'>("merge", &mergeList,
+                tag::description{"Comma-separated list of histogram files to merge and report instead of running"})
             );
     try {
         parse(opts, argc, argv);
@@ -81,6 +199,15 @@ int main(int argc, const char** argv) {
         print_help(std::cout, opts);
         return 0;
     }
+    crossbow::logger::logger->config.level = crossbow::logger::logLevelFromString(logLevel);
+    if (!mergeList.empty()) {
+        try {
+            return mergeHistogramFiles(mergeList, histogramFile);
+        } catch (std::exception& e) {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+    }
     if (hostList.empty()) {
         std::cerr << "No host\n";
         return 1;
@@ -89,10 +216,17 @@ int main(int argc, const char** argv) {
         std::cerr << "No workload\n";
         return 1;
     }
+    aim::ArrivalProcess process;
+    try {
+        process = aim::arrivalProcessFromString(arrivalProcess);
+    } catch (std::invalid_argument& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
     auto startTime = aim::Clock::now();
     auto endTime = startTime + std::chrono::seconds(time);
-    crossbow::logger::logger->config.level = crossbow::logger::logLevelFromString(logLevel);
     try {
+        aim::HistogramSet histograms(precision);
         auto hosts = split(hostList, ',');
         auto workloadStrings = split(workloadList, ',');
         std::vector<uint8_t> workload (workloadStrings.size());
@@ -100,11 +234,21 @@ int main(int argc, const char** argv) {
             workload[i] = std::stoi(workloadStrings[i]);
 
         io_service service;
+        boost::asio::steady_timer intervalTimer(service);
+        std::ofstream intervalOut;
+        if (!intervalFile.empty()) {
+            intervalOut.open(intervalFile.c_str());
+            intervalOut << "second,transaction,count,p50,p99,p999,max\n";
+        }
         auto sumClients = hosts.size() * numClients;
         std::vector<aim::RTAClient> clients;
         clients.reserve(sumClients);
         for (decltype(sumClients) i = 0; i < sumClients; ++i) {
-            clients.emplace_back(service, workload, numSubscribers, endTime);
+            clients.emplace_back(service, workload, numSubscribers, endTime, histograms, !outFile.empty(),
+                    samplePermille, compare);
+            if (arrivalRate > 0.0) {
+                clients.back().setOpenLoop(arrivalRate, process, maxInFlight);
+            }
         }
 
         for (size_t i = 0; i < hosts.size(); ++i) {
@@ -127,8 +271,9 @@ int main(int argc, const char** argv) {
 
         for (decltype(clients.size()) i = 0; i < clients.size(); ++i) {
             auto& client = clients[i];
-            client.run();
+            client.start();
         }
+        reportIntervals(intervalTimer, histograms, intervalOut, startTime, endTime);
 
         std::vector<std::thread> threads;
         threads.reserve(networkThreads-1);
@@ -139,50 +284,57 @@ int main(int argc, const char** argv) {
             thread.join();
 
         LOG_INFO("Done, writing results");
+        auto totals = histograms.totals();
+        logHistograms(totals);
+        if (!histogramFile.empty()) {
+            writeHistogramFile(histogramFile, totals);
+        }
+        if (outFile.empty()) {
+            std::cout << '\a';
+            return 0;
+        }
         std::ofstream out(outFile.c_str());
-        out << "start,end,transaction,success,error\n";
+        out << "start,end,transaction,success,error,sample_permille,error_bound,observed_error,exact_end,intended\n";
         for (const auto& client : clients) {
             const auto& queue = client.log();
             for (const auto& e : queue) {
-                crossbow::string tName;
-                switch (e.transaction) {
-                case aim::Command::Q1:
-                    tName = "Q1";
-                    break;
-                case aim::Command::Q2:
-                    tName = "Q2";
-                    break;
-                case aim::Command::Q3:
-                    tName = "Q3";
-                    break;
-                case aim::Command::Q4:
-                    tName = "Q4";
-                    break;
-                case aim::Command::Q5:
-                    tName = "Q5";
-                    break;
-                case aim::Command::Q6:
-                    tName = "Q6";
-                    break;
-                case aim::Command::Q7:
-                    tName = "Q7";
-                    break;
-                default:
-                    tName = "Unknown Transaction which should not happen in rta-client";
-                    break;
-                }
                 out << std::chrono::duration_cast<std::chrono::milliseconds>(e.start - startTime).count()
                     << ','
                     << std::chrono::duration_cast<std::chrono::milliseconds>(e.end - startTime).count()
                     << ','
-                    << tName
+                    << aim::queryName(e.transaction)
                     << ','
                     << (e.success ? "true" : "false")
                     << ','
                     << e.error
+                    << ','
+                    << e.samplePermille
+                    << ','
+                    << e.errorBound
+                    << ','
+                    << e.observedError
+                    << ','
+                    << std::chrono::duration_cast<std::chrono::milliseconds>(e.exactEnd - startTime).count()
+                    << ','
+                    << std::chrono::duration_cast<std::chrono::milliseconds>(e.intended - startTime).count()
                     << std::endl;
             }
         }
+        // the corrected latency includes the time a query waited for its client
+        size_t queries = 0;
+        double latencySum = 0.0;
+        double correctedSum = 0.0;
+        for (const auto& client : clients) {
+            for (const auto& e : client.log()) {
+                std::chrono::duration<double, std::milli> latency = e.end - e.start;
+                std::chrono::duration<double, std::milli> corrected = e.end - e.intended;
+                latencySum += latency.count();
+                correctedSum += corrected.count();
+                ++queries;
+            }
+        }
+        LOG_INFO("%1% queries, avg latency %2%ms, avg corrected latency %3%ms", queries,
+                queries ? latencySum / queries : 0.0, queries ? correctedSum / queries : 0.0);
         std::cout << '\a';
     } catch (std::exception& e) {
         std::cerr << e.what() << std::endl;
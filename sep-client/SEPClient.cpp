@@ -24,6 +24,14 @@
 #include <common/Protocol.hpp>
 #include <crossbow/logger.hpp>
 
+#include <sys/socket.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+
 using err_code = boost::system::error_code;
 
 namespace aim {
@@ -55,39 +63,237 @@ void PopulationClient::populate(uint64_t lowest, uint64_t highest) {
             std::make_tuple(start, end));
 }
 
+namespace {
+
+/*
+ * Period of the pacer, the bucket holds at most BUCKET_TICKS periods worth of
+ * events such that a late timer does not cause a long burst.
+ */
+constexpr std::chrono::microseconds PACER_TICK(1000);
+constexpr unsigned BUCKET_TICKS = 4;
+
+/*
+ * Number of datagrams handed to one sendmmsg call.
+ */
+constexpr size_t DATAGRAMS_PER_SEND = 64;
+
+} // anonymous namespace
+
+struct SEPClient::Pacer {
+    boost::asio::steady_timer timer;
+    double rate;        // events per second
+    size_t eventsPerDatagram;
+    double tokens;      // events that are due
+    double capacity;
+    std::chrono::steady_clock::time_point lastRefill;
+    std::chrono::steady_clock::time_point nextTick;
+    std::vector<Event> events;
+    std::unique_ptr<uint8_t[]> buffers;
+    std::array<iovec, DATAGRAMS_PER_SEND> iovecs;
+    std::array<mmsghdr, DATAGRAMS_PER_SEND> msgs;
+    std::atomic<uint64_t> sent;
+    HistogramSet* histograms;
+    bool streaming;
+    std::vector<uint8_t> pending;   // rest of a frame the stream only took partly
+
+    explicit Pacer(boost::asio::io_service& service)
+        : timer(service)
+        , rate(0.0)
+        , eventsPerDatagram(1)
+        , tokens(0.0)
+        , capacity(0.0)
+        , buffers(new uint8_t[DATAGRAMS_PER_SEND * MAX_EVENT_DATAGRAM_SIZE])
+        , sent(0)
+        , histograms(nullptr)
+        , streaming(false)
+    {
+        memset(msgs.data(), 0, sizeof(mmsghdr) * msgs.size());
+        for (size_t i = 0; i < DATAGRAMS_PER_SEND; ++i) {
+            iovecs[i].iov_base = buffers.get() + i * MAX_EVENT_DATAGRAM_SIZE;
+            iovecs[i].iov_len = 0;
+            msgs[i].msg_hdr.msg_iov = &iovecs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+    }
+};
+
+SEPClient::SEPClient(boost::asio::io_service& service,
+        uint64_t subscriberNum,
+        uint64_t lowest,
+        uint64_t highest,
+        decltype(Clock::now()) endTime)
+    : mSocket(service)
+    , mStream(service)
+    , mPacer(new Pacer(service))
+    , mLowest(lowest)
+    , mHighest(highest)
+    , rnd(subscriberNum)
+    , mEndTime(endTime)
+{}
+
 SEPClient::SEPClient(SEPClient&&) = default;
 
-void SEPClient::run(unsigned messageRate) {
+SEPClient::~SEPClient() = default;
+
+size_t SEPClient::count() const {
+    return mPacer->sent.load(std::memory_order_relaxed);
+}
+
+void SEPClient::run(unsigned messageRate, size_t eventsPerDatagram, HistogramSet& histograms) {
+    auto& pacer = *mPacer;
+    pacer.histograms = &histograms;
+    pacer.rate = messageRate;
+    pacer.eventsPerDatagram = eventsPerDatagram;
+    pacer.events.resize(eventsPerDatagram);
+    pacer.capacity = std::max(pacer.rate * BUCKET_TICKS * PACER_TICK.count() / 1000000.0,
+            static_cast<double>(eventsPerDatagram));
+    pacer.lastRefill = std::chrono::steady_clock::now();
+    pacer.nextTick = pacer.lastRefill;
+    pacer.streaming = mStream.is_open();
+    // a full socket buffer must not stall the io_service, we retry on the next tick
+    if (pacer.streaming) {
+        mStream.non_blocking(true);
+    } else {
+        mSocket.non_blocking(true);
+    }
+    tick();
+}
+
+void SEPClient::tick() {
     if (Clock::now() > mEndTime) return;
-    Event e;
-    e.caller_id = rnd.randomWithin<int32_t>(mLowest, mHighest);
-    rnd.randomEvent(e);
-    crossbow::sizer sz;
-    sz & sz.size;
-    sz & Command::PROCESS_EVENT;
-    sz & e;
-    auto buf = new uint8_t[sz.size];
-    crossbow::serializer ser(buf);
-    ser & sz.size;
-    ser & Command::PROCESS_EVENT;
-    ser & e;
-    ser.buffer.release();
-    mSocket.async_send(boost::asio::buffer(buf, sz.size), [this, buf](const boost::system::error_code& ec, size_t bt) {
-        if (ec) {
-            LOG_ERROR("ERROR while sending event: %1%: %2%", ec.value(), ec.message());
+    auto& pacer = *mPacer;
+    if (pacer.streaming && !mStream.is_open()) return;
+    auto now = std::chrono::steady_clock::now();
+    auto lateness = std::chrono::duration_cast<std::chrono::microseconds>(now - pacer.nextTick);
+    pacer.histograms->record("send-lateness", std::max<int64_t>(lateness.count(), 0));
+    std::chrono::duration<double> elapsed = now - pacer.lastRefill;
+    pacer.lastRefill = now;
+    pacer.tokens = std::min(pacer.tokens + elapsed.count() * pacer.rate, pacer.capacity);
+
+    auto due = static_cast<size_t>(pacer.tokens / pacer.eventsPerDatagram);
+    while (due > 0) {
+        auto burst = std::min(due, DATAGRAMS_PER_SEND);
+        auto sent = sendBurst(burst);
+        pacer.tokens -= static_cast<double>(sent * pacer.eventsPerDatagram);
+        if (sent < burst) {
+            break;
         }
-        delete[] buf;
-    });
-    mTimer->expires_from_now(std::chrono::microseconds(1000000/messageRate));
-    mTimer->async_wait([this, messageRate](const boost::system::error_code& ec) {
+        due -= burst;
+    }
+
+    // absolute deadlines, such that the handler latency does not add up
+    pacer.nextTick += PACER_TICK;
+    if (pacer.nextTick < now) {
+        pacer.nextTick = now + PACER_TICK;
+    }
+    pacer.timer.expires_at(pacer.nextTick);
+    pacer.timer.async_wait([this](const boost::system::error_code& ec) {
         if (ec) {
             LOG_ERROR("FATAL: ABORT IN TIMER");
             std::terminate();
         }
-        run(messageRate);
+        tick();
     });
-    //execute<Command::PROCESS_EVENT>(e);
-    ++mNumEvents;
+}
+
+size_t SEPClient::sendBurst(size_t datagrams) {
+    auto& pacer = *mPacer;
+    if (pacer.streaming && !flushPending()) {
+        return 0;
+    }
+    for (size_t i = 0; i < datagrams; ++i) {
+        for (auto& e : pacer.events) {
+            e.caller_id = rnd.randomWithin<int32_t>(mLowest, mHighest);
+            rnd.randomEvent(e);
+        }
+        auto buffer = reinterpret_cast<uint8_t*>(pacer.iovecs[i].iov_base);
+        pacer.iovecs[i].iov_len = serializeEvents(pacer.events, buffer);
+    }
+    auto sent = pacer.streaming ? writeFrames(datagrams) : sendDatagrams(datagrams);
+    pacer.sent.fetch_add(sent * pacer.eventsPerDatagram, std::memory_order_relaxed);
+    return sent;
+}
+
+size_t SEPClient::sendDatagrams(size_t datagrams) {
+    auto& pacer = *mPacer;
+    auto fd = mSocket.native_handle();
+    size_t sent = 0;
+    while (sent < datagrams) {
+        auto num = sendmmsg(fd, pacer.msgs.data() + sent, datagrams - sent, 0);
+        if (num < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                LOG_ERROR("ERROR while sending events: %1%", strerror(errno));
+            }
+            break;
+        }
+        sent += num;
+    }
+    return sent;
+}
+
+/*
+ * A frame must not be cut off on a stream: if the socket buffer only takes
+ * part of a frame, its rest is kept in pending and written before any other
+ * frame. The frames after it are not sent, like datagrams the kernel did
+ * not take.
+ */
+size_t SEPClient::writeFrames(size_t frames) {
+    auto& pacer = *mPacer;
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = pacer.iovecs.data();
+    msg.msg_iovlen = frames;
+    ssize_t written;
+    do {
+        written = sendmsg(mStream.native_handle(), &msg, MSG_NOSIGNAL);
+    } while (written < 0 && errno == EINTR);
+    if (written < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            closeStream();
+        }
+        return 0;
+    }
+    size_t sent = 0;
+    auto remaining = static_cast<size_t>(written);
+    for (; sent < frames && remaining >= pacer.iovecs[sent].iov_len; ++sent) {
+        remaining -= pacer.iovecs[sent].iov_len;
+    }
+    if (remaining > 0) {
+        auto frame = reinterpret_cast<const uint8_t*>(pacer.iovecs[sent].iov_base);
+        pacer.pending.assign(frame + remaining, frame + pacer.iovecs[sent].iov_len);
+        ++sent;
+    }
+    return sent;
+}
+
+/*
+ * Returns true once the rest of the last partly written frame is written.
+ */
+bool SEPClient::flushPending() {
+    auto& pending = mPacer->pending;
+    while (!pending.empty()) {
+        auto written = send(mStream.native_handle(), pending.data(), pending.size(), MSG_NOSIGNAL);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                closeStream();
+            }
+            return false;
+        }
+        pending.erase(pending.begin(), pending.begin() + written);
+    }
+    return true;
+}
+
+void SEPClient::closeStream() {
+    LOG_ERROR("ERROR on the event stream, stop sending: %1%", strerror(errno));
+    boost::system::error_code ec;
+    mStream.close(ec);
 }
 
 } // aim
@@ -27,21 +27,15 @@
 #include <random>
 #include <chrono>
 #include <deque>
+#include <memory>
 
+#include <common/Histogram.hpp>
 #include <common/Util.hpp>
 
 namespace aim {
 
 using Clock = std::chrono::system_clock;
 
-struct LogEntry {
-    bool success;
-    crossbow::string error;
-    Command transaction;
-    decltype(Clock::now()) start;
-    decltype(start) end;
-};
-
 class PopulationClient {
     using Socket = boost::asio::ip::tcp::socket;
     Socket mSocket;
@@ -74,41 +68,69 @@ public:
 
 class SEPClient {
     using Socket = boost::asio::ip::udp::socket;
+public:
+    using StreamSocket = boost::asio::generic::stream_protocol::socket;
+private:
+    struct Pacer;
     Socket mSocket;
-    std::unique_ptr<boost::asio::steady_timer> mTimer;
+    StreamSocket mStream;
+    std::unique_ptr<Pacer> mPacer;
     uint64_t mLowest;
     uint64_t mHighest;
     Random_t rnd;
     decltype(Clock::now()) mEndTime;
-    size_t mNumEvents;
 public:
     SEPClient(boost::asio::io_service& service,
               uint64_t subscriberNum,
               uint64_t lowest,
               uint64_t highest,
-              decltype(Clock::now()) endTime)
-        : mSocket(service)
-        , mTimer(new boost::asio::steady_timer(service))
-        , mLowest(lowest)
-        , mHighest(highest)
-        , rnd(subscriberNum)
-        , mEndTime(endTime)
-        , mNumEvents(0)
-    {}
+              decltype(Clock::now()) endTime);
     SEPClient(SEPClient&&);
+    ~SEPClient();
     Socket& socket() {
         return mSocket;
     }
     const Socket& socket() const {
         return mSocket;
     }
+    /*
+     * Connect this socket (to the event stream of the server, over TCP or a
+     * unix domain socket) instead of the UDP socket to send the events as
+     * frames on the stream.
+     */
+    StreamSocket& stream() {
+        return mStream;
+    }
     //client::CommandsImpl& commands() {
     //    return mCmds;
     //}
-    void run(unsigned messageRate);
-    size_t count() const {
-        return mNumEvents;
-    }
+    /*
+     * Sends messageRate events per second, packed into datagrams of
+     * eventsPerDatagram events each (1 uses the single-event format).
+     *
+     * A token bucket is refilled every millisecond and the datagrams that
+     * are due are sent as one burst: they are serialized into preallocated
+     * buffers and handed to the kernel with a single sendmmsg call, such
+     * that the rate does not depend on timer granularity or allocations.
+     * How late every tick fires after its deadline is recorded into
+     * histograms as "send-lateness".
+     *
+     * On a stream the datagrams are written as frames with a single
+     * sendmsg call instead.
+     */
+    void run(unsigned messageRate, size_t eventsPerDatagram, HistogramSet& histograms);
+
+    /*
+     * Number of events sent so far, may be called from any thread.
+     */
+    size_t count() const;
+private:
+    void tick();
+    size_t sendBurst(size_t datagrams);
+    size_t sendDatagrams(size_t datagrams);
+    size_t writeFrames(size_t frames);
+    bool flushPending();
+    void closeStream();
 };
 
 }
@@ -24,7 +24,10 @@
 #include <crossbow/logger.hpp>
 
 #include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
 #include <boost/system/error_code.hpp>
+#include <algorithm>
+#include <chrono>
 #include <string>
 #include <iostream>
 #include <cassert>
@@ -48,18 +51,13 @@ std::vector<std::string> split(const std::string str, const char delim) {
     return result;
 }
 
-template<class Resolver, class Client>
-void connectClients(std::vector<Client>& clients,
-        const std::vector<std::string>& hosts,
-        const std::string& port,
+template<class Client>
+void createClients(std::vector<Client>& clients,
+        size_t sumClients,
         boost::asio::io_service& service,
-        size_t numClients,
         uint64_t numSubscribers,
-        decltype(aim::Clock::now()) endTime,
-        bool isUdp = false)
+        decltype(aim::Clock::now()) endTime)
 {
-    using query = typename Resolver::query;
-    auto sumClients = numClients * hosts.size();
     auto subscribersPerClient = numSubscribers / sumClients;
     for (decltype(sumClients) i = 0; i < sumClients; ++i) {
         if (i >= numSubscribers) break;
@@ -70,6 +68,20 @@ void connectClients(std::vector<Client>& clients,
         clients.emplace_back(service, numSubscribers, subscribersPerClient * i + 1,
                 lastSub, endTime);
     }
+}
+
+template<class Resolver, class Client>
+void connectClients(std::vector<Client>& clients,
+        const std::vector<std::string>& hosts,
+        const std::string& port,
+        boost::asio::io_service& service,
+        size_t numClients,
+        uint64_t numSubscribers,
+        decltype(aim::Clock::now()) endTime,
+        bool isUdp = false)
+{
+    using query = typename Resolver::query;
+    createClients(clients, numClients * hosts.size(), service, numSubscribers, endTime);
     for (size_t i = 0; i < hosts.size(); ++i) {
         auto h = hosts[i];
         auto addr = split(h, ':');
@@ -92,6 +104,79 @@ void connectClients(std::vector<Client>& clients,
     }
 }
 
+/*
+ * Connects the SEP clients to the event streams of the servers instead of
+ * their UDP ports: over TCP to eventPort of every host or, with the unix
+ * transport, to the local socket at eventSocket.
+ */
+void connectEventStreams(std::vector<aim::SEPClient>& clients,
+        const std::vector<std::string>& hosts,
+        const std::string& transport,
+        const std::string& eventPort,
+        const std::string& eventSocket,
+        boost::asio::io_service& service,
+        size_t numClients,
+        uint64_t numSubscribers,
+        decltype(aim::Clock::now()) endTime)
+{
+    createClients(clients, numClients * hosts.size(), service, numSubscribers, endTime);
+    for (size_t i = 0; i < hosts.size(); ++i) {
+        aim::SEPClient::StreamSocket::endpoint_type endpoint;
+        if (transport == "unix") {
+            endpoint = local::stream_protocol::endpoint(eventSocket);
+        } else {
+            auto addr = split(hosts[i], ':');
+            ip::tcp::resolver resolver(service);
+            endpoint = resolver.resolve(ip::tcp::resolver::query(addr[0], eventPort))->endpoint();
+        }
+        for (unsigned j = 0; j < numClients && i*numClients + j < clients.size(); ++j) {
+            LOG_INFO("Connected to client " + crossbow::to_string(i*numClients + j));
+            clients[i*numClients + j].stream().connect(endpoint);
+        }
+    }
+}
+
+/*
+ * Logs the event rate achieved since the last report against the target
+ * rate and how late the events were sent every second until the benchmark
+ * ends, and appends both to out.
+ */
+void reportRate(boost::asio::steady_timer& timer,
+                const std::vector<aim::SEPClient>& clients,
+                aim::HistogramSet& histograms,
+                std::ofstream& out,
+                uint64_t targetRate,
+                size_t lastCount,
+                std::chrono::steady_clock::time_point lastReport,
+                decltype(aim::Clock::now()) startTime,
+                decltype(aim::Clock::now()) endTime)
+{
+    timer.expires_from_now(std::chrono::seconds(1));
+    timer.async_wait([&timer, &clients, &histograms, &out, targetRate, lastCount, lastReport, startTime, endTime](
+                const err_code& ec) {
+        if (ec) {
+            return;
+        }
+        auto now = std::chrono::steady_clock::now();
+        size_t count = 0;
+        for (auto& c : clients) {
+            count += c.count();
+        }
+        std::chrono::duration<double> elapsed = now - lastReport;
+        auto rate = static_cast<uint64_t>((count - lastCount) / elapsed.count());
+        auto lateness = histograms.interval()["send-lateness"];
+        LOG_INFO("Sent %1% events/s, target %2% events/s (%3% percent), lateness p50 %4%us, p99 %5%us, max %6%us",
+                rate, targetRate, targetRate ? 100 * rate / targetRate : 0, lateness.percentile(50.0),
+                lateness.percentile(99.0), lateness.max());
+        auto second = std::chrono::duration_cast<std::chrono::seconds>(aim::Clock::now() - startTime).count();
+        out << second << ',' << rate << ',' << targetRate << ',' << lateness.percentile(50.0)
+            << ',' << lateness.percentile(99.0) << ',' << lateness.percentile(99.9) << ',' << lateness.max() << std::endl;
+        if (aim::Clock::now() < endTime) {
+            reportRate(timer, clients, histograms, out, targetRate, count, now, startTime, endTime);
+        }
+    });
+}
+
 void runPopulation(std::vector<aim::PopulationClient>& clients,
                    const std::vector<std::string>& hosts,
                    boost::asio::io_service& service,
@@ -124,12 +209,18 @@ int main(int argc, const char** argv) {
     std::string hostList;
     std::string port("8713");
     std::string udpPort("8714");
+    std::string eventTransport("udp");
+    std::string eventPort("8715");
+    std::string eventSocket("");
     std::string logLevel("DEBUG");
     std::string outFile("out.csv");
     size_t numClients = 1;
     unsigned time = 5*60;
     unsigned networkThreads = 1u;
     unsigned messageRate = 10000;
+    unsigned eventsPerDatagram = 0;
+    unsigned precision = 3;
+    std::string histogramFile;
     auto opts = create_options("SEP_client",
             value<'h'>("help", &help, tag::description{"print help"})
             , value<'H'>("hosts", &hostList, tag::description{"Comma-separated list of hosts"})
@@ -138,10 +229,23 @@ int main(int argc, const char** argv) {
             , value<'P'>("populate", &populate, tag::description{"Populate the database"})
             , value<'n'>("num-subscribers", &numSubscribers, tag::description{"Number of subscribers (data size)"})
             , value<'t'>("time", &time, tag::description{"Duration of the benchmark in seconds"})
-            , value<'o'>("out", &outFile, tag::description{"Path to the output file"})
+            , value<'o'>("out", &outFile,
+                tag::description{"Path to the output file with the event rate and send lateness (in us) of every second"})
             , value<'N'>("network-threads", &networkThreads, tag::description{"Number of (TCP) networking threads"})
             , value<'r'>("message-rate", &messageRate,
                 tag::description{"Message rate in events/second (per client connection), total rate is message-rate * number of hosts * num-clients"})
+            , value<'e'>("events-per-datagram", &eventsPerDatagram,
+                tag::description{"Number of events packed into one datagram, 1 sends single events, 0 (default) packs as many as fit while sending at least 1000 datagrams/second"})
+            , value<'p'>("precision", &precision,
+                tag::description{"Significant decimal digits of the lateness histogram (1 to 5)"})
+            , value<'g'>("histogram-out", &histogramFile,
+                tag::description{"Path to the binary lateness histogram, files of several clients can be merged with rta_client --merge"})
+            , value<'T'>("event-transport", &eventTransport,
+                tag::description{"How events are sent: udp, tcp (to --event-port) or unix (to --event-socket)"})
+            , value<'E'>("event-port", &eventPort,
+                tag::description{"TCP port of the event stream of the servers (server --event-port)"})
+            , value<'U'>("event-socket", &eventSocket,
+                tag::description{"Unix socket path of the event stream of a local server (server --event-socket)"})
             );
     try {
         parse(opts, argc, argv);
@@ -158,6 +262,14 @@ int main(int argc, const char** argv) {
         std::cerr << "No host\n";
         return 1;
     }
+    if (eventTransport != "udp" && eventTransport != "tcp" && eventTransport != "unix") {
+        std::cerr << "Unknown event transport " << eventTransport << std::endl;
+        return 1;
+    }
+    if (eventTransport == "unix" && eventSocket.empty()) {
+        std::cerr << "No event socket\n";
+        return 1;
+    }
 
 
     auto startTime = aim::Clock::now();
@@ -165,16 +277,37 @@ int main(int argc, const char** argv) {
     crossbow::logger::logger->config.level = crossbow::logger::logLevelFromString(logLevel);
     try {
         auto hosts = split(hostList, ',');
+        aim::HistogramSet histograms(precision);
         io_service service;
+        boost::asio::steady_timer reportTimer(service);
+        std::ofstream out;
         std::vector<aim::SEPClient> clients;
         std::vector<aim::PopulationClient> populationClients;
         if (populate) {
             runPopulation(populationClients, hosts, service, port, numClients, numSubscribers);
         } else {
-            connectClients<boost::asio::ip::udp::resolver>(clients, hosts, udpPort, service, numClients, numSubscribers, endTime, true);
+            if (eventTransport == "udp") {
+                connectClients<boost::asio::ip::udp::resolver>(clients, hosts, udpPort, service, numClients, numSubscribers, endTime, true);
+            } else {
+                connectEventStreams(clients, hosts, eventTransport, eventPort, eventSocket, service, numClients,
+                        numSubscribers, endTime);
+            }
+            size_t batchSize = aim::maxEventsPerDatagram();
+            if (eventsPerDatagram == 0) {
+                // do not hold back events for longer than a millisecond
+                batchSize = std::min<size_t>(batchSize, messageRate / 1000);
+            } else {
+                batchSize = std::min<size_t>(batchSize, eventsPerDatagram);
+            }
+            batchSize = std::max<size_t>(batchSize, 1);
+            LOG_INFO("Sending %1% events per datagram", batchSize);
             for (auto& client : clients) {
-                client.run(messageRate);
+                client.run(messageRate, batchSize, histograms);
             }
+            out.open(outFile.c_str());
+            out << "second,events,target,lateness_p50,lateness_p99,lateness_p999,lateness_max\n";
+            reportRate(reportTimer, clients, histograms, out, static_cast<uint64_t>(messageRate) * clients.size(), 0,
+                    std::chrono::steady_clock::now(), startTime, endTime);
         }
 
         std::vector<std::thread> threads;
@@ -192,6 +325,16 @@ int main(int argc, const char** argv) {
         }
 
         LOG_INFO("Done, did send %1% events in %2% seconds", numEvents, runTime);
+        auto totals = histograms.totals();
+        if (!totals.empty()) {
+            auto& lateness = totals.begin()->second;
+            LOG_INFO("Send lateness p50 %1%us, p99 %2%us, p99.9 %3%us, max %4%us", lateness.percentile(50.0),
+                    lateness.percentile(99.0), lateness.percentile(99.9), lateness.max());
+        }
+        if (!histogramFile.empty()) {
+            std::ofstream histogramOut(histogramFile.c_str(), std::ios::binary);
+            aim::writeHistograms(histogramOut, totals);
+        }
         std::cout << '\a';
     } catch (std::exception& e) {
         std::cerr << e.what() << std::endl;
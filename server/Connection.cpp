@@ -26,15 +26,25 @@
 #include "Transactions.hpp"
 
 #include <telldb/Transaction.hpp>
+
+#include <crossbow/enum_underlying.hpp>
+
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <array>
+#include <cerrno>
+#include <cstring>
+#include <functional>
 #include <memory>
 
 using namespace boost::asio;
 
 namespace aim {
 
-    inline void initializeContextIfNecessary(tell::db::Transaction &tx, Context &context,
-            const AIMSchema &aimSchema,
-            tell::store::ScanMemoryManager *scanMemoryManager)
+void initializeContextIfNecessary(tell::db::Transaction &tx, Context &context,
+        const AIMSchema &aimSchema,
+        tell::store::ScanMemoryManager *scanMemoryManager)
 {
     if (!context.isInitialized) {
         auto wFuture = tx.openTable("wt");
@@ -52,12 +62,31 @@ namespace aim {
         }
         for (auto &pair: tmpMap)
             context.tellIDToAIMSchemaEntry.emplace_back(std::move(pair));
+        for (unsigned i = 0; i < aimSchema.numOfEntries(); ++i) {
+            context.aimSchemaKernel.addEntry(tellSchema.idOf(aimSchema[i].name()),
+                    aimSchema.OffsetAt(i), aimSchema[i],
+                    tellSchema.idOf(AIMSchema::getEpochName(
+                            aimSchema[i].filterType(), aimSchema[i].winLength())));
+        }
 
         context.scanMemoryMananger = scanMemoryManager;
 
         context.subscriberId = tellSchema.idOf("subscriber_id");
         context.timeStampId = tellSchema.idOf("last_updated");
 
+        context.epochDayAll = tellSchema.idOf(AIMSchema::getEpochName(
+                FilterType::NO, WindowLength::DAY));
+        context.epochDayLocal = tellSchema.idOf(AIMSchema::getEpochName(
+                FilterType::LOCAL, WindowLength::DAY));
+        context.epochDayDistant = tellSchema.idOf(AIMSchema::getEpochName(
+                FilterType::NONLOCAL, WindowLength::DAY));
+        context.epochWeekAll = tellSchema.idOf(AIMSchema::getEpochName(
+                FilterType::NO, WindowLength::WEEK));
+        context.epochWeekLocal = tellSchema.idOf(AIMSchema::getEpochName(
+                FilterType::LOCAL, WindowLength::WEEK));
+        context.epochWeekDistant = tellSchema.idOf(AIMSchema::getEpochName(
+                FilterType::NONLOCAL, WindowLength::WEEK));
+
         context.callsSumLocalWeek = tellSchema.idOf(aimSchema.getName(
                 Metric::CALL, AggrFun::SUM, FilterType::LOCAL, WindowLength::WEEK));
         context.callsSumAllWeek = tellSchema.idOf(aimSchema.getName(
@@ -102,6 +131,8 @@ namespace aim {
         context.categoryId = tellSchema.idOf("category_id");
         context.valueTypeId = tellSchema.idOf("value_type_id");
 
+        context.sampleBucket = tellSchema.idOf("sample_bucket");
+
         context.isInitialized = true;
     }
 }
@@ -112,27 +143,39 @@ private:
     boost::asio::io_service& mService;
     Transactions& mTransactions;
     tell::db::TransactionFiber<Context>* mFiber;
-    std::atomic<bool>& mIsFree;
     tell::db::ClientManager<Context>& mClientManager;
+    std::function<void(const std::vector<Event>&, bool)> mFinished;
+    std::function<void()> mDone;
 public:
     std::vector<Event> events;
+    /*
+     * finished is called from the processing thread right after the commit
+     * (or the rollback, with false), done from the io_service once the
+     * transaction fiber is gone.
+     */
     EventProcessor(boost::asio::io_service& service, Transactions&
-            transactions, std::atomic<bool>& isFree,
-            tell::db::ClientManager<Context>& clientManager)
+            transactions,
+            tell::db::ClientManager<Context>& clientManager,
+            std::function<void(const std::vector<Event>&, bool)> finished,
+            std::function<void()> done)
         : mService(service)
         , mTransactions(transactions)
-        , mIsFree(isFree)
         , mClientManager(clientManager)
+        , mFinished(std::move(finished))
+        , mDone(std::move(done))
     {}
     void runTransaction(tell::db::Transaction& tx, Context& context) {
         initializeContextIfNecessary(tx, context, mTransactions.getAimSchema(), mClientManager.getScanMemoryManager());
-        mTransactions.processEvents(tx, context, events);
+        auto committed = mTransactions.processEvents(tx, context, events);
+        // free the pipeline slot right away, a blocked receiver may start
+        // the next transaction without waiting for the io_service
+        mFinished(events, committed);
         auto fiber = mFiber;
-        auto isFree = &mIsFree;
-        mService.post([fiber, isFree]() {
-            isFree->store(true);
+        auto done = mDone;
+        mService.post([fiber, done]() {
             fiber->wait();
             delete fiber;
+            done();
         });
     }
     void start(tell::db::ClientManager<Context>& clientManager,
@@ -144,10 +187,34 @@ public:
     }
 };
 
-void UdpServer::bind(const std::string& host, const std::string& port) {
+namespace {
+
+using reuse_port = boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+
+/*
+ * Number of datagrams a receive thread asks for in one recvmmsg call.
+ */
+constexpr unsigned DATAGRAMS_PER_RECEIVE = 64;
+
+/*
+ * Granularity of the batch deadline: the flush timer fires four times per
+ * maximal batch delay, but not more often than every 100us.
+ */
+constexpr unsigned FLUSH_TICKS_PER_DELAY = 4;
+constexpr unsigned MIN_FLUSH_TICK = 100;
+
+int64_t steadyNanos(std::chrono::steady_clock::time_point time) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(time.time_since_epoch()).count();
+}
+
+void bindUdpSocket(boost::asio::ip::udp::socket& socket, const std::string& host,
+        const std::string& port, bool reusePort) {
     using namespace boost::asio;
-    mSocket.open(ip::udp::v4());
-    ip::udp::resolver res(mSocket.get_io_service());
+    socket.open(ip::udp::v4());
+    if (reusePort) {
+        socket.set_option(reuse_port(true));
+    }
+    ip::udp::resolver res(socket.get_io_service());
     ip::udp::resolver::iterator iter;
     if (host == "") {
         iter = res.resolve(ip::udp::resolver::query(port));
@@ -158,52 +225,456 @@ void UdpServer::bind(const std::string& host, const std::string& port) {
     for (; iter != end; ++iter) {
         boost::system::error_code err;
         auto endpoint = iter->endpoint();
-        mSocket.bind(endpoint, err);
+        socket.bind(endpoint, err);
         if (err) {
             LOG_WARN("Bind attempt failed " + err.message());
             continue;
         }
         break;
     }
-    if (!mSocket.is_open()) {
+    if (!socket.is_open()) {
         LOG_ERROR("Could not bind");
         std::terminate();
     }
 }
 
+} // anonymous namespace
+
+UdpServer::~UdpServer() {
+    mStopped.store(true);
+    for (auto& receiver : mReceivers) {
+        receiver.join();
+    }
+    logStats();
+}
+
+void UdpServer::bind(const std::string& host, const std::string& port) {
+    if (mReceiveSockets.empty()) {
+        bindUdpSocket(mSocket, host, port, false);
+        return;
+    }
+    for (auto& socket : mReceiveSockets) {
+        bindUdpSocket(socket, host, port, true);
+    }
+}
+
 void UdpServer::run() {
+    LOG_INFO("Event queues hold %1% events per partition, overload policy %2%",
+            mQueueConfig.capacity, overloadPolicyToString(mQueueConfig.policy));
+    scheduleStats();
+    scheduleFlush();
+    if (mReceiveSockets.empty()) {
+        receive();
+        return;
+    }
+    mReceivers.reserve(mReceiveSockets.size());
+    for (auto& socket : mReceiveSockets) {
+        mReceivers.emplace_back([this, &socket]() {
+            receive(socket);
+        });
+    }
+}
+
+void UdpServer::receive() {
     using err_code = boost::system::error_code;
     mSocket.async_receive(boost::asio::buffer(mBuffer.get(), mBufferSize), [this](const err_code& ec, size_t bt){
         if (ec) {
             LOG_ERROR(ec.message());
-            run();
+            receive();
             return;
         }
 #ifndef NDEBUG
         size_t reqSize = *reinterpret_cast<size_t*>(mBuffer.get());
         assert(reqSize == bt);
         auto cmd = *reinterpret_cast<Command*>(mBuffer.get() + sizeof(size_t));
-        assert (cmd == Command::PROCESS_EVENT);
+        assert (cmd == Command::PROCESS_EVENT || cmd == Command::PROCESS_EVENT_BATCH);
 #endif
-        crossbow::deserializer des(reinterpret_cast<uint8_t*>(mBuffer.get() + sizeof(size_t) + sizeof(Command)));
-        Event ev;
-        des & ev;
-        size_t processingThread =
-                ev.caller_id % mEventBatches.size();
-        auto &eventBatch = mEventBatches[processingThread];
-        auto isFree = mProcessingThreadFree[processingThread];
-        if (eventBatch.size() >= mEventBatchSize && isFree->load()) {
-            isFree->store(false);
-            auto processor = std::make_shared<EventProcessor>(mSocket.get_io_service(), mTransactions, *isFree, mClientManager);
-            processor->events.swap(eventBatch);
-            eventBatch.reserve(mEventBatchSize);
-            processor->start(mClientManager, processingThread);
+        deserializeEvents(reinterpret_cast<uint8_t*>(mBuffer.get()), mReceivedEvents,
+                [this](const Event& ev) {
+            enqueue(ev);
+        });
+        receive();
+    });
+}
+
+void UdpServer::receive(boost::asio::ip::udp::socket& socket) {
+    auto fd = socket.native_handle();
+    // wake up regularly to check whether we have to stop
+    timeval timeout;
+    timeout.tv_sec = 0;
+    timeout.tv_usec = 100000;
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) != 0) {
+        LOG_WARN("Could not set receive timeout: %1%", strerror(errno));
+    }
+
+    std::unique_ptr<char[]> buffer(new char[DATAGRAMS_PER_RECEIVE * mBufferSize]);
+    std::array<iovec, DATAGRAMS_PER_RECEIVE> iovecs;
+    std::array<mmsghdr, DATAGRAMS_PER_RECEIVE> msgs;
+    memset(msgs.data(), 0, sizeof(mmsghdr) * msgs.size());
+    for (unsigned i = 0; i < DATAGRAMS_PER_RECEIVE; ++i) {
+        iovecs[i].iov_base = buffer.get() + i * mBufferSize;
+        iovecs[i].iov_len = mBufferSize;
+        msgs[i].msg_hdr.msg_iov = &iovecs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    std::vector<Event> received;
+    while (!mStopped.load()) {
+        auto num = recvmmsg(fd, msgs.data(), DATAGRAMS_PER_RECEIVE, MSG_WAITFORONE, nullptr);
+        if (num < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                LOG_ERROR("recvmmsg failed: %1%", strerror(errno));
+            }
+            continue;
+        }
+        for (int i = 0; i < num; ++i) {
+            auto datagram = reinterpret_cast<uint8_t*>(iovecs[i].iov_base);
+            if (msgs[i].msg_len < sizeof(size_t) + sizeof(Command)
+                    || *reinterpret_cast<size_t*>(datagram) != msgs[i].msg_len) {
+                LOG_ERROR("Dropping malformed event datagram of size %1%", msgs[i].msg_len);
+                continue;
+            }
+            deserializeEvents(datagram, received, [this](const Event& ev) {
+                enqueue(ev);
+            });
+        }
+    }
+}
+
+void UdpServer::enqueue(const Event& ev) {
+    size_t partition = ev.caller_id % mPartitions.size();
+    auto& part = *mPartitions[partition];
+    QueuedEvent queued;
+    queued.event = ev;
+    queued.enqueued = std::chrono::steady_clock::now();
+    while (!part.queue.tryPush(queued)) {
+        switch (mQueueConfig.policy) {
+        case OverloadPolicy::DROP_NEWEST:
+            part.stats.dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        case OverloadPolicy::DROP_OLDEST: {
+            QueuedEvent oldest;
+            if (part.queue.tryPop(oldest)) {
+                part.stats.dropped.fetch_add(1, std::memory_order_relaxed);
+            }
+            break;
+        }
+        case OverloadPolicy::BLOCK:
+            process(partition);
+            std::this_thread::yield();
+            break;
         }
-        eventBatch.push_back(ev);
-        run();
+    }
+    enqueued(partition, queued);
+}
+
+bool UdpServer::tryEnqueue(const Event& ev) {
+    size_t partition = ev.caller_id % mPartitions.size();
+    QueuedEvent queued;
+    queued.event = ev;
+    queued.enqueued = std::chrono::steady_clock::now();
+    if (!mPartitions[partition]->queue.tryPush(queued)) {
+        // make sure somebody drains the queue
+        process(partition);
+        return false;
+    }
+    enqueued(partition, queued);
+    return true;
+}
+
+void UdpServer::enqueued(size_t partition, const QueuedEvent& queued) {
+    auto& part = *mPartitions[partition];
+    part.stats.pushed.fetch_add(1, std::memory_order_relaxed);
+    int64_t empty = 0;
+    part.oldestSince.compare_exchange_strong(empty, steadyNanos(queued.enqueued));
+    if (part.queue.size() >= mEventBatchSize) {
+        process(partition);
+    }
+}
+
+bool UdpServer::isReady(EventPartition& part, int64_t now) const {
+    if (part.queue.size() + part.numDeferred.load() >= mEventBatchSize) {
+        return true;
+    }
+    if (mQueueConfig.maxBatchDelay == 0) {
+        return false;
+    }
+    auto since = part.oldestSince.load();
+    return since != 0 && now - since >= int64_t(mQueueConfig.maxBatchDelay) * 1000;
+}
+
+void UdpServer::process(size_t partition) {
+    auto& part = *mPartitions[partition];
+    auto now = std::chrono::steady_clock::now();
+    if (!isReady(part, steadyNanos(now))) {
+        return;
+    }
+    auto inFlight = part.inFlight.load();
+    do {
+        if (inFlight >= mQueueConfig.pipelineDepth) {
+            // a running transaction picks up the queued events when done
+            return;
+        }
+    } while (!part.inFlight.compare_exchange_weak(inFlight, inFlight + 1));
+
+    bool full = part.queue.size() + part.numDeferred.load() >= mEventBatchSize;
+    auto processor = std::make_shared<EventProcessor>(mSocket.get_io_service(), mTransactions,
+            mClientManager, [this, partition](const std::vector<Event>& events, bool committed) {
+        finish(partition, events, committed);
+    }, [this, partition]() {
+        process(partition);
+    });
+    auto& events = processor->events;
+    uint64_t waitTime = 0;
+    uint64_t maxWait = 0;
+    // only other batches may be running if we pipeline
+    bool disjoint = mQueueConfig.pipelineDepth > 1;
+    auto take = [&](const QueuedEvent& queued) {
+        if (disjoint && part.busy.count(queued.event.caller_id) != 0) {
+            part.deferred.push_back(queued);
+            return;
+        }
+        events.push_back(queued.event);
+        uint64_t wait = queued.enqueued < now ? std::chrono::duration_cast<std::chrono::microseconds>(
+                now - queued.enqueued).count() : 0;
+        waitTime += wait;
+        maxWait = std::max(maxWait, wait);
+    };
+    {
+        std::lock_guard<std::mutex> lock(part.mutex);
+        // events pushed from here on start a new deadline
+        part.oldestSince.store(0);
+        // deferred events are older than everything in the queue
+        std::vector<QueuedEvent> deferred;
+        deferred.swap(part.deferred);
+        events.reserve(deferred.size() + std::min(part.queue.size(), part.queue.capacity()));
+        for (auto& queued : deferred) {
+            take(queued);
+        }
+        // never hold more than one queue worth of events, receivers keep
+        // pushing: deferred events count against the capacity, such that a
+        // hot caller leaves new events in the queue and the overload policy
+        // applies instead of deferred growing without bound
+        QueuedEvent queued;
+        while (events.size() + part.deferred.size() < part.queue.capacity() && part.queue.tryPop(queued)) {
+            take(queued);
+        }
+        if (disjoint) {
+            for (auto& ev : events) {
+                part.busy.insert(ev.caller_id);
+            }
+        }
+        part.numDeferred.store(part.deferred.size());
+        if (part.queue.size() > 0 || !part.deferred.empty()) {
+            // what we left behind waits since now at the latest
+            int64_t empty = 0;
+            part.oldestSince.compare_exchange_strong(empty, steadyNanos(now));
+        }
+    }
+    if (events.empty()) {
+        part.inFlight.fetch_sub(1);
+        return;
+    }
+    part.stats.addBatch(events.size(), waitTime, maxWait);
+    if (!full) {
+        part.stats.flushes.fetch_add(1, std::memory_order_relaxed);
+    }
+    processor->start(mClientManager, partition);
+}
+
+void UdpServer::finish(size_t partition, const std::vector<Event>& events, bool committed) {
+    auto& part = *mPartitions[partition];
+    if (!committed) {
+        // the partition keeps going, the events of the batch are lost
+        part.stats.dropped.fetch_add(events.size(), std::memory_order_relaxed);
+    }
+    if (mQueueConfig.pipelineDepth > 1) {
+        std::lock_guard<std::mutex> lock(part.mutex);
+        for (auto& ev : events) {
+            part.busy.erase(ev.caller_id);
+        }
+    }
+    part.inFlight.fetch_sub(1);
+}
+
+void UdpServer::scheduleFlush() {
+    if (mQueueConfig.maxBatchDelay == 0) {
+        return;
+    }
+    auto tick = std::max(mQueueConfig.maxBatchDelay / FLUSH_TICKS_PER_DELAY, MIN_FLUSH_TICK);
+    mFlushTimer.expires_from_now(std::chrono::microseconds(tick));
+    mFlushTimer.async_wait([this](const boost::system::error_code& ec) {
+        if (ec) {
+            return;
+        }
+        for (size_t i = 0; i < mPartitions.size(); ++i) {
+            process(i);
+        }
+        scheduleFlush();
     });
 }
 
+void UdpServer::scheduleStats() {
+    if (mQueueConfig.statsInterval == 0) {
+        return;
+    }
+    mStatsTimer.expires_from_now(std::chrono::seconds(mQueueConfig.statsInterval));
+    mStatsTimer.async_wait([this](const boost::system::error_code& ec) {
+        if (ec) {
+            return;
+        }
+        logStats();
+        scheduleStats();
+    });
+}
+
+void UdpServer::logStats() {
+    for (size_t i = 0; i < mPartitions.size(); ++i) {
+        auto& stats = mPartitions[i]->stats;
+        auto batches = stats.batches.load(std::memory_order_relaxed);
+        auto batchedEvents = stats.batchedEvents.load(std::memory_order_relaxed);
+        auto waitTime = stats.waitTimeSum.load(std::memory_order_relaxed);
+        LOG_INFO("Event partition %1%: depth %2%, pushed %3%, dropped %4%, batches %5% (%6% by deadline), "
+                "avg batch %7%, max batch %8%, avg wait %9%us, max wait %10%us",
+                i, mPartitions[i]->queue.size(),
+                stats.pushed.load(std::memory_order_relaxed),
+                stats.dropped.load(std::memory_order_relaxed),
+                batches, stats.flushes.load(std::memory_order_relaxed),
+                batches ? batchedEvents / batches : 0,
+                stats.maxBatchSize.load(std::memory_order_relaxed),
+                batchedEvents ? waitTime / batchedEvents : 0,
+                stats.maxWaitTime.load(std::memory_order_relaxed));
+    }
+}
+
+namespace {
+
+/*
+ * Time a stream connection waits before it retries to queue an event into a
+ * full partition.
+ */
+constexpr unsigned STREAM_RETRY_DELAY = 100; // microseconds
+
+template<class Protocol>
+class EventStreamConnection : public std::enable_shared_from_this<EventStreamConnection<Protocol>> {
+    typename Protocol::socket mSocket;
+    UdpServer& mEventServer;
+    boost::asio::steady_timer mRetryTimer;
+    size_t mFrameSize;
+    std::vector<uint8_t> mFrame;
+    std::vector<Event> mBatch;
+    std::vector<Event> mReceived;
+    size_t mNext;   // first event of mReceived not yet queued
+public:
+    EventStreamConnection(boost::asio::io_service& service, UdpServer& eventServer)
+        : mSocket(service)
+        , mEventServer(eventServer)
+        , mRetryTimer(service)
+        , mFrameSize(0)
+        , mNext(0)
+    {}
+
+    typename Protocol::socket& socket() { return mSocket; }
+
+    void readHeader() {
+        auto self = this->shared_from_this();
+        boost::asio::async_read(mSocket, boost::asio::buffer(&mFrameSize, sizeof(mFrameSize)),
+                [self](const boost::system::error_code& ec, size_t) {
+            if (ec) {
+                if (ec != boost::asio::error::eof) {
+                    LOG_ERROR("Event stream failed: %1%", ec.message());
+                }
+                return;
+            }
+            if (self->mFrameSize < sizeof(size_t) + sizeof(Command)
+                    || self->mFrameSize > MAX_EVENT_FRAME_SIZE) {
+                LOG_ERROR("Closing event stream after malformed frame of size %1%", self->mFrameSize);
+                return;
+            }
+            self->readFrame();
+        });
+    }
+
+private:
+    void readFrame() {
+        mFrame.resize(mFrameSize);
+        memcpy(mFrame.data(), &mFrameSize, sizeof(mFrameSize));
+        auto self = this->shared_from_this();
+        boost::asio::async_read(mSocket,
+                boost::asio::buffer(mFrame.data() + sizeof(size_t), mFrameSize - sizeof(size_t)),
+                [self](const boost::system::error_code& ec, size_t) {
+            if (ec) {
+                LOG_ERROR("Event stream failed: %1%", ec.message());
+                return;
+            }
+            auto cmd = *reinterpret_cast<const Command*>(self->mFrame.data() + sizeof(size_t));
+            if (cmd != Command::PROCESS_EVENT && cmd != Command::PROCESS_EVENT_BATCH) {
+                LOG_ERROR("Closing event stream after unexpected command %1%",
+                        crossbow::to_underlying(cmd));
+                return;
+            }
+            self->mReceived.clear();
+            self->mNext = 0;
+            deserializeEvents(self->mFrame.data(), self->mBatch, [self](const Event& ev) {
+                self->mReceived.push_back(ev);
+            });
+            self->dispatch();
+        });
+    }
+
+    /*
+     * Queues the received events and only reads the next frame once all of
+     * them are queued.
+     */
+    void dispatch() {
+        for (; mNext < mReceived.size(); ++mNext) {
+            if (!mEventServer.tryEnqueue(mReceived[mNext])) {
+                auto self = this->shared_from_this();
+                mRetryTimer.expires_from_now(std::chrono::microseconds(STREAM_RETRY_DELAY));
+                mRetryTimer.async_wait([self](const boost::system::error_code& ec) {
+                    if (ec) {
+                        return;
+                    }
+                    self->dispatch();
+                });
+                return;
+            }
+        }
+        readHeader();
+    }
+};
+
+} // anonymous namespace
+
+template<class Protocol>
+void EventStreamServer<Protocol>::bind(const typename Protocol::endpoint& endpoint) {
+    mAcceptor.open(endpoint.protocol());
+    mAcceptor.set_option(typename Protocol::acceptor::reuse_address(true));
+    mAcceptor.bind(endpoint);
+    mAcceptor.listen();
+}
+
+template<class Protocol>
+void EventStreamServer<Protocol>::run() {
+    accept();
+}
+
+template<class Protocol>
+void EventStreamServer<Protocol>::accept() {
+    auto conn = std::make_shared<EventStreamConnection<Protocol>>(mAcceptor.get_io_service(), mEventServer);
+    mAcceptor.async_accept(conn->socket(), [this, conn](const boost::system::error_code& ec) {
+        if (ec) {
+            LOG_ERROR(ec.message());
+            return;
+        }
+        conn->readHeader();
+        accept();
+    });
+}
+
+template class EventStreamServer<boost::asio::ip::tcp>;
+template class EventStreamServer<boost::asio::local::stream_protocol>;
+
 class CommandImpl {
     Connection* mConnection;
     server::Server<CommandImpl> mServer;
@@ -212,18 +683,27 @@ class CommandImpl {
     std::unique_ptr<tell::db::TransactionFiber<Context>> mFiber;
     const AIMSchema &mAIMSchema;
     Transactions mTransactions;
+    SharedScanScheduler& mScheduler;
+    MaterializedViews* mViews;  // nullptr if disabled
+    ResultCache* mCache;        // nullptr if disabled
 public:
     CommandImpl(Connection* connection,
             boost::asio::ip::tcp::socket& socket,
             boost::asio::io_service& service,
             tell::db::ClientManager<Context>& clientManager,
-            const AIMSchema &aimSchema)
+            const AIMSchema &aimSchema,
+            SharedScanScheduler& scheduler,
+            MaterializedViews* views,
+            ResultCache* cache)
         : mConnection(connection)
         , mServer(*this, socket)
         , mService(service)
         , mClientManager(clientManager)
         , mAIMSchema(aimSchema)
-        , mTransactions(aimSchema)
+        , mTransactions(aimSchema, views)
+        , mScheduler(scheduler)
+        , mViews(views)
+        , mCache(cache)
     {
     }
 
@@ -243,10 +723,10 @@ public:
     }
 
     template<Command C, class Callback>
-    typename std::enable_if<C == Command::PROCESS_EVENT, void>::type
+    typename std::enable_if<C == Command::PROCESS_EVENT || C == Command::PROCESS_EVENT_BATCH, void>::type
     execute(const typename Signature<C>::arguments& args, const Callback& callback) {
-        LOG_ERROR("PROCESS_EVENT must be called over udp");
-        std::terminate();
+        LOG_ERROR("Closing connection: events have to be sent over udp or an event stream");
+        mServer.reject();
     }
 
     template<Command C, class Callback>
@@ -302,143 +782,141 @@ public:
     template<Command C, class Callback>
     typename std::enable_if<C == Command::Q1, void>::type
     execute(const typename Signature<C>::arguments& args, const Callback& callback) {
-        auto transaction = [this, args, callback](tell::db::Transaction& tx, Context& context) {
-            initializeContextIfNecessary(tx, context,
-                    mAIMSchema, mClientManager.getScanMemoryManager());
-            typename Signature<C>::result res = mTransactions.q1Transaction(
-                    tx, context, args);
-            mService.post([this, res, callback]() {
-                mFiber->wait();
-                mFiber.reset(nullptr);
-                callback(res);
-            });
-        };
-        mFiber.reset(new tell::db::TransactionFiber<Context>(
-                mClientManager.startTransaction(transaction,
-                        tell::store::TransactionType::ANALYTICAL)));
+        Q1Out result;
+        if (mViews && mViews->q1(args, result)) {
+            callback(result);
+            return;
+        }
+        submit<C>(args, [this, args](tell::db::Transaction& tx, Context& context) {
+            return mTransactions.q1Query(tx, context, args);
+        }, callback);
     }
 
     template<Command C, class Callback>
     typename std::enable_if<C == Command::Q2, void>::type
     execute(const typename Signature<C>::arguments& args, const Callback& callback) {
-        auto transaction = [this, args, callback](tell::db::Transaction& tx, Context& context) {
-            initializeContextIfNecessary(tx, context,
-                    mAIMSchema, mClientManager.getScanMemoryManager());
-            typename Signature<C>::result res = mTransactions.q2Transaction(
-                    tx, context, args);
-            mService.post([this, res, callback]() {
-                mFiber->wait();
-                mFiber.reset(nullptr);
-                callback(res);
-            });
-        };
-        mFiber.reset(new tell::db::TransactionFiber<Context>(
-                mClientManager.startTransaction(transaction,
-                        tell::store::TransactionType::ANALYTICAL)));
+        Q2Out result;
+        if (mViews && mViews->q2(args, result)) {
+            callback(result);
+            return;
+        }
+        submit<C>(args, [this, args](tell::db::Transaction& tx, Context& context) {
+            return mTransactions.q2Query(tx, context, args);
+        }, callback);
     }
 
     template<Command C, class Callback>
     typename std::enable_if<C == Command::Q3, void>::type
-    execute(const Callback& callback) {
-        auto transaction = [this, callback](tell::db::Transaction& tx, Context& context) {
-            initializeContextIfNecessary(tx, context,
-                    mAIMSchema, mClientManager.getScanMemoryManager());
-            typename Signature<C>::result res = mTransactions.q3Transaction(
-                    tx, context);
-            mService.post([this, res, callback]() {
-                mFiber->wait();
-                mFiber.reset(nullptr);
-                callback(res);
-            });
-        };
-        mFiber.reset(new tell::db::TransactionFiber<Context>(
-                mClientManager.startTransaction(transaction,
-                        tell::store::TransactionType::ANALYTICAL)));
+    execute(const typename Signature<C>::arguments& args, const Callback& callback) {
+        submit<C>(args, [this, args](tell::db::Transaction& tx, Context& context) {
+            return mTransactions.q3Query(tx, context, args);
+        }, callback);
     }
 
     template<Command C, class Callback>
     typename std::enable_if<C == Command::Q4, void>::type
     execute(const typename Signature<C>::arguments& args, const Callback& callback) {
-        auto transaction = [this, args, callback](tell::db::Transaction& tx, Context& context) {
-            initializeContextIfNecessary(tx, context,
-                    mAIMSchema, mClientManager.getScanMemoryManager());
-            typename Signature<C>::result res = mTransactions.q4Transaction(
-                    tx, context, args);
-            mService.post([this, res, callback]() {
-                mFiber->wait();
-                mFiber.reset(nullptr);
-                callback(res);
-            });
-        };
-        mFiber.reset(new tell::db::TransactionFiber<Context>(
-                mClientManager.startTransaction(transaction,
-                        tell::store::TransactionType::ANALYTICAL)));
+        submit<C>(args, [this, args](tell::db::Transaction& tx, Context& context) {
+            return mTransactions.q4Query(tx, context, args);
+        }, callback);
     }
 
     template<Command C, class Callback>
     typename std::enable_if<C == Command::Q5, void>::type
     execute(const typename Signature<C>::arguments& args, const Callback& callback) {
-        auto transaction = [this, args, callback](tell::db::Transaction& tx, Context& context) {
-            initializeContextIfNecessary(tx, context,
-                    mAIMSchema, mClientManager.getScanMemoryManager());
-            typename Signature<C>::result res = mTransactions.q5Transaction(
-                    tx, context, args);
-            mService.post([this, res, callback]() {
-                mFiber->wait();
-                mFiber.reset(nullptr);
-                callback(res);
-            });
-        };
-        mFiber.reset(new tell::db::TransactionFiber<Context>(
-                mClientManager.startTransaction(transaction,
-                        tell::store::TransactionType::ANALYTICAL)));
+        submit<C>(args, [this, args](tell::db::Transaction& tx, Context& context) {
+            return mTransactions.q5Query(tx, context, args);
+        }, callback);
     }
 
     template<Command C, class Callback>
     typename std::enable_if<C == Command::Q6, void>::type
     execute(const typename Signature<C>::arguments& args, const Callback& callback) {
-        auto transaction = [this, args, callback](tell::db::Transaction& tx, Context& context) {
-            initializeContextIfNecessary(tx, context,
-                    mAIMSchema, mClientManager.getScanMemoryManager());
-            typename Signature<C>::result res = mTransactions.q6Transaction(
-                    tx, context, args);
-            mService.post([this, res, callback]() {
-                mFiber->wait();
-                mFiber.reset(nullptr);
-                callback(res);
-            });
-        };
-        mFiber.reset(new tell::db::TransactionFiber<Context>(
-                mClientManager.startTransaction(transaction,
-                        tell::store::TransactionType::ANALYTICAL)));
+        submit<C>(args, [this, args](tell::db::Transaction& tx, Context& context) {
+            return mTransactions.q6Query(tx, context, args);
+        }, callback);
     }
 
     template<Command C, class Callback>
     typename std::enable_if<C == Command::Q7, void>::type
     execute(const typename Signature<C>::arguments& args, const Callback& callback) {
-        auto transaction = [this, args, callback](tell::db::Transaction& tx, Context& context) {
-            initializeContextIfNecessary(tx, context,
-                    mAIMSchema, mClientManager.getScanMemoryManager());
-            typename Signature<C>::result res = mTransactions.q7Transaction(
-                    tx, context, args);
-            mService.post([this, res, callback]() {
-                mFiber->wait();
-                mFiber.reset(nullptr);
-                callback(res);
+        submit<C>(args, [this, args](tell::db::Transaction& tx, Context& context) {
+            return mTransactions.q7Query(tx, context, args);
+        }, callback);
+    }
+
+    /*
+     * Point lookups run in their own transaction, several of them may be in
+     * flight on a connection.
+     */
+    template<Command C, class Callback>
+    typename std::enable_if<C == Command::LOOKUP, void>::type
+    execute(const typename Signature<C>::arguments& args, const Callback& callback) {
+        using Fiber = tell::db::TransactionFiber<Context>;
+        auto fiber = std::make_shared<std::unique_ptr<Fiber>>();
+        auto transaction = [this, args, callback, fiber](tell::db::Transaction& tx, Context& context) {
+            initializeContextIfNecessary(tx, context, mAIMSchema, mClientManager.getScanMemoryManager());
+            auto result = mTransactions.lookup(tx, context, args);
+            mService.post([fiber, callback, result]() {
+                (*fiber)->wait();
+                // the fiber owns this transaction and with it fiber, release both
+                fiber->reset(nullptr);
+                callback(result);
             });
         };
-        mFiber.reset(new tell::db::TransactionFiber<Context>(
-                mClientManager.startTransaction(transaction,
-                        tell::store::TransactionType::ANALYTICAL)));
+        fiber->reset(new Fiber(mClientManager.startTransaction(transaction, tell::store::TransactionType::READ_ONLY)));
+    }
+
+private:
+    /*
+     * Answers the query from the result cache if it holds a fresh result for
+     * these arguments, otherwise runs it and caches the result.
+     */
+    template<Command C, class Build, class Callback>
+    void submit(const typename Signature<C>::arguments& args, Build build, const Callback& callback) {
+        using Result = typename Signature<C>::result;
+        if (!mCache) {
+            schedule<C>(build, callback);
+            return;
+        }
+        ResultCache::Key key(C, cacheKey(args));
+        Result cached;
+        if (mCache->get(key, cached)) {
+            callback(cached);
+            return;
+        }
+        auto cache = mCache;
+        auto ticket = mCache->ticket(std::move(key));
+        schedule<C>(build, [cache, ticket, callback](const Result& result) {
+            cache->put(ticket, result);
+            callback(result);
+        });
     }
 
+    /*
+     * Hands the query to the shared scan scheduler, the result is sent from
+     * the io_service.
+     */
+    template<Command C, class Build, class Callback>
+    void schedule(Build build, const Callback& callback) {
+        using Result = typename Signature<C>::result;
+        auto& service = mService;
+        mScheduler.submit<Result>(build, [&service, callback](const Result& result) {
+            service.post([callback, result]() {
+                callback(result);
+            });
+        });
+    }
 };
 
 Connection::Connection(boost::asio::io_service& service,
                 tell::db::ClientManager<Context>& clientManager,
-                const AIMSchema &aimSchema)
+                const AIMSchema &aimSchema,
+                SharedScanScheduler& scheduler,
+                MaterializedViews* views,
+                ResultCache* cache)
     : mSocket(service)
-    , mImpl(new CommandImpl(this, mSocket, service, clientManager, aimSchema))
+    , mImpl(new CommandImpl(this, mSocket, service, clientManager, aimSchema, scheduler, views, cache))
 {}
 
 Connection::~Connection() = default;
@@ -21,14 +21,25 @@
  *     Lucas Braun <braunl@inf.ethz.ch>
  */
 #pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <unordered_set>
 #include <vector>
 #include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
 
 #include <common/Protocol.hpp>
 
 #include <telldb/TellDB.hpp>
 
 #include "server/sep/aim_schema.h"
+#include "server/sep/aim_schema_kernel.h"
+#include "EventQueue.hpp"
+#include "QueryPlan.hpp"
+#include "SharedScan.hpp"
 #include "Transactions.hpp"
 
 namespace aim {
@@ -39,10 +50,18 @@ struct Context {
     tell::store::ScanMemoryManager *scanMemoryMananger;
 
     std::vector<std::pair<id_t, AIMSchemaEntry>> tellIDToAIMSchemaEntry;
+    AIMSchemaKernel aimSchemaKernel;
 
     id_t subscriberId;
     id_t timeStampId;
 
+    id_t epochDayAll;
+    id_t epochDayLocal;
+    id_t epochDayDistant;
+    id_t epochWeekAll;
+    id_t epochWeekLocal;
+    id_t epochWeekDistant;
+
     id_t callsSumLocalWeek;
     id_t callsSumAllWeek;
     id_t callsSumAllDay;
@@ -72,10 +91,21 @@ struct Context {
     id_t categoryId;
     id_t valueTypeId;
 
+    id_t sampleBucket;
+
     tell::db::table_t wideTable;
 
+    QueryPlanCache plans;
 };
 
+/*
+ * Resolves the column ids of the wide table and the AIM schema kernel on the
+ * first transaction running with this context.
+ */
+void initializeContextIfNecessary(tell::db::Transaction &tx, Context &context,
+        const AIMSchema &aimSchema,
+        tell::store::ScanMemoryManager *scanMemoryManager);
+
 class CommandImpl;
 
 class Connection {
@@ -83,12 +113,58 @@ class Connection {
     std::unique_ptr<CommandImpl> mImpl;
 public:
     Connection(boost::asio::io_service& service, tell::db::ClientManager<Context>& clientManager,
-               const AIMSchema &aimSchema);
+               const AIMSchema &aimSchema, SharedScanScheduler& scheduler,
+               MaterializedViews* views, ResultCache* cache);
     ~Connection();
     decltype(mSocket)& socket() { return mSocket; }
     void run();
 };
 
+struct QueuedEvent {
+    Event event;
+    std::chrono::steady_clock::time_point enqueued;
+};
+
+/*
+ * Events of one partition (caller_id % processingThreads) are processed by
+ * one processing thread. Receivers push events into the bounded queue of
+ * the partition; whoever gets one of the pipeline slots (inFlight below
+ * the pipeline depth) drains the queue into one transaction. oldestSince
+ * holds the steady_clock time (in ns) at which the queue became non-empty,
+ * 0 if it is empty.
+ *
+ * With more than one batch in flight the batches of a partition have to be
+ * subscriber-disjoint: busy holds the callers of all running batches, events
+ * of busy callers wait in deferred for the next batch. Both are protected by
+ * mutex, which is only taken when a batch starts or finishes.
+ */
+struct EventPartition {
+    BoundedQueue<QueuedEvent> queue;
+    EventQueueStats stats;
+    std::atomic<unsigned> inFlight;
+    std::atomic<int64_t> oldestSince;
+    std::atomic<size_t> numDeferred;
+
+    std::mutex mutex;
+    std::unordered_set<uint64_t> busy;
+    std::vector<QueuedEvent> deferred;  // at most one queue capacity, see UdpServer::process
+
+    explicit EventPartition(size_t capacity)
+        : queue(capacity)
+        , inFlight(0)
+        , oldestSince(0)
+        , numDeferred(0)
+    {}
+};
+
+struct EventQueueConfig {
+    size_t capacity = 0x10000;
+    OverloadPolicy policy = OverloadPolicy::BLOCK;
+    unsigned statsInterval = 10;    // seconds, 0 disables periodic reports
+    unsigned maxBatchDelay = 10000; // microseconds, 0 only hands off full batches
+    unsigned pipelineDepth = 1;     // transactions in flight per partition
+};
+
 class UdpServer {
     boost::asio::ip::udp::socket mSocket;
     tell::db::ClientManager<Context>& mClientManager;
@@ -96,38 +172,100 @@ class UdpServer {
     std::unique_ptr<char[]> mBuffer;
     Transactions mTransactions;
     unsigned mEventBatchSize;
-    std::vector<std::vector<Event>> mEventBatches;
-    std::vector<std::atomic<bool>*> mProcessingThreadFree;
+    EventQueueConfig mQueueConfig;
+    std::vector<std::unique_ptr<EventPartition>> mPartitions;
+    std::vector<Event> mReceivedEvents;
+    std::vector<boost::asio::ip::udp::socket> mReceiveSockets;
+    std::vector<std::thread> mReceivers;
+    std::atomic<bool> mStopped;
+    boost::asio::steady_timer mStatsTimer;
+    boost::asio::steady_timer mFlushTimer;
 public:
+    /*
+     * With receiveThreads = 0 all events are received on a single socket
+     * through the io_service. Otherwise we bind receiveThreads sockets with
+     * SO_REUSEPORT to the same port and drain each of them with recvmmsg
+     * from a dedicated thread.
+     */
     UdpServer(boost::asio::io_service& service,
               tell::db::ClientManager<Context>& clientManager,
               size_t processingThreads,
               unsigned eventBatchSize,
-              const AIMSchema &aimSchema)
+              const AIMSchema &aimSchema,
+              size_t receiveThreads = 0,
+              const EventQueueConfig& queueConfig = EventQueueConfig(),
+              MaterializedViews* views = nullptr,
+              ResultCache* cache = nullptr)
         : mSocket(service)
         , mClientManager(clientManager)
-        , mBufferSize(1024)
+        , mBufferSize(MAX_EVENT_DATAGRAM_SIZE)
         , mBuffer(new char[mBufferSize])
-        , mTransactions(aimSchema)
+        , mTransactions(aimSchema, views, cache)
         , mEventBatchSize(eventBatchSize)
-        , mEventBatches(processingThreads, std::vector<Event>())
-        , mProcessingThreadFree(processingThreads, nullptr)
+        , mQueueConfig(queueConfig)
+        , mStopped(false)
+        , mStatsTimer(service)
+        , mFlushTimer(service)
     {
-        for (auto& a : mProcessingThreadFree) {
-            a = new std::atomic<bool>(true);
+        // a queue smaller than a batch would never trigger processing
+        mQueueConfig.capacity = std::max<size_t>(mQueueConfig.capacity, 2 * mEventBatchSize);
+        mPartitions.reserve(processingThreads);
+        for (size_t i = 0; i < processingThreads; ++i) {
+            mPartitions.emplace_back(new EventPartition(mQueueConfig.capacity));
         }
-        for (auto& v : mEventBatches) {
-            v.reserve(mEventBatchSize);
-        }
-    }
-    ~UdpServer() {
-        for (auto& a : mProcessingThreadFree) {
-            delete a;
+        mReceiveSockets.reserve(receiveThreads);
+        for (size_t i = 0; i < receiveThreads; ++i) {
+            mReceiveSockets.emplace_back(service);
         }
     }
+    ~UdpServer();
     void run();
     void bind(const std::string& addr, const std::string& port);
+
+    /*
+     * Queues an event without applying the overload policy. Returns false
+     * if the queue of its partition is full, the caller has to retry later.
+     */
+    bool tryEnqueue(const Event& ev);
+private:
+    void receive();
+    void receive(boost::asio::ip::udp::socket& socket);
+    void enqueue(const Event& ev);
+    void enqueued(size_t partition, const QueuedEvent& queued);
+    void process(size_t partition);
+    void finish(size_t partition, const std::vector<Event>& events, bool committed);
+    bool isReady(EventPartition& part, int64_t now) const;
+    void scheduleFlush();
+    void scheduleStats();
+    void logStats();
 };
 
+/*
+ * Streaming event ingest over TCP or a unix domain socket. Producers send the
+ * same frames as over UDP (total size, PROCESS_EVENT or PROCESS_EVENT_BATCH,
+ * events) back to back on a long-lived connection; a frame may carry up to
+ * MAX_EVENT_FRAME_SIZE bytes. The events are fed into the partitions of the
+ * UdpServer. Instead of dropping events a connection stops reading while the
+ * queue of a partition is full, such that the socket buffers fill up and the
+ * producer gets blocked.
+ */
+template<class Protocol>
+class EventStreamServer {
+    typename Protocol::acceptor mAcceptor;
+    UdpServer& mEventServer;
+public:
+    EventStreamServer(boost::asio::io_service& service, UdpServer& eventServer)
+        : mAcceptor(service)
+        , mEventServer(eventServer)
+    {}
+    void bind(const typename Protocol::endpoint& endpoint);
+    void run();
+private:
+    void accept();
+};
+
+extern template class EventStreamServer<boost::asio::ip::tcp>;
+extern template class EventStreamServer<boost::asio::local::stream_protocol>;
+
 } // namespace aim
 
@@ -37,6 +37,12 @@ void createSchema(tell::db::Transaction& transaction, const AIMSchema &aimSchema
     for (unsigned i = 0; i < aimSchema.numOfEntries(); ++i)
         schema.addField(aimSchema[i].type(), aimSchema[i].name(), true);
 
+    // window epochs of the wide table columns, one per window and filter
+    for (auto window : {WindowLength::DAY, WindowLength::WEEK}) {
+        for (auto filter : {FilterType::NO, FilterType::LOCAL, FilterType::NONLOCAL})
+            schema.addField(store::FieldType::INT, AIMSchema::getEpochName(filter, window), true);
+    }
+
     // dimension columns
     schema.addField(store::FieldType::SMALLINT, "subscription_type_id", true);
     schema.addField(store::FieldType::SMALLINT, "subscription_cost_id", true);
@@ -53,6 +59,9 @@ void createSchema(tell::db::Transaction& transaction, const AIMSchema &aimSchema
     schema.addField(store::FieldType::SMALLINT, "value_type_id", true);
     schema.addField(store::FieldType::SMALLINT, "value_type_threshold_id", true);
 
+    // hash bucket of the subscriber id for approximate queries
+    schema.addField(store::FieldType::SMALLINT, "sample_bucket", true);
+
     transaction.createTable("wt", schema);
 }
 
@@ -0,0 +1,212 @@
+/*
+ * (C) Copyright 2015 ETH Zurich Systems Group (http://www.systems.ethz.ch/) and others.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Contributors:
+ *     Markus Pilman <mpilman@inf.ethz.ch>
+ *     Simon Loesing <sloesing@inf.ethz.ch>
+ *     Thomas Etter <etterth@gmail.com>
+ *     Kevin Bocksrocker <kevin.bocksrocker@gmail.com>
+ *     Lucas Braun <braunl@inf.ethz.ch>
+ */
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+namespace aim {
+
+/*
+ * What a receiver does with an event when the queue of its partition is
+ * full: drop the new event, drop the oldest queued event to make room, or
+ * wait until the processing thread has drained the queue.
+ */
+enum class OverloadPolicy {
+    DROP_NEWEST,
+    DROP_OLDEST,
+    BLOCK
+};
+
+inline OverloadPolicy overloadPolicyFromString(const std::string& s) {
+    if (s == "drop-newest") {
+        return OverloadPolicy::DROP_NEWEST;
+    } else if (s == "drop-oldest") {
+        return OverloadPolicy::DROP_OLDEST;
+    } else if (s == "block") {
+        return OverloadPolicy::BLOCK;
+    }
+    throw std::invalid_argument("Unknown overload policy " + s);
+}
+
+inline const char* overloadPolicyToString(OverloadPolicy policy) {
+    switch (policy) {
+    case OverloadPolicy::DROP_NEWEST:
+        return "drop-newest";
+    case OverloadPolicy::DROP_OLDEST:
+        return "drop-oldest";
+    case OverloadPolicy::BLOCK:
+        return "block";
+    }
+    return "unknown";
+}
+
+/*
+ * Bounded lock-free multi-producer/multi-consumer ring buffer (Vyukov).
+ * Every cell carries a sequence number telling producers and consumers
+ * whether it is free for the current lap. The capacity is rounded up to
+ * the next power of two.
+ */
+template<class T>
+class BoundedQueue {
+    struct Cell {
+        std::atomic<size_t> sequence;
+        T data;
+    };
+    static constexpr size_t CACHE_LINE_SIZE = 64;
+
+    // keep producer and consumer positions on separate cache lines
+    size_t mMask;
+    std::unique_ptr<Cell[]> mCells;
+    char mPad0[CACHE_LINE_SIZE];
+    std::atomic<size_t> mEnqueuePos;
+    char mPad1[CACHE_LINE_SIZE - sizeof(std::atomic<size_t>)];
+    std::atomic<size_t> mDequeuePos;
+public:
+    explicit BoundedQueue(size_t capacity)
+        : mMask(roundUp(capacity) - 1)
+        , mCells(new Cell[mMask + 1])
+        , mEnqueuePos(0)
+        , mDequeuePos(0)
+    {
+        for (size_t i = 0; i <= mMask; ++i) {
+            mCells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    BoundedQueue(const BoundedQueue&) = delete;
+    BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+    size_t capacity() const {
+        return mMask + 1;
+    }
+
+    /*
+     * Approximate number of queued elements, exact if no push or pop is
+     * running concurrently.
+     */
+    size_t size() const {
+        auto enqueuePos = mEnqueuePos.load(std::memory_order_relaxed);
+        auto dequeuePos = mDequeuePos.load(std::memory_order_relaxed);
+        return enqueuePos > dequeuePos ? enqueuePos - dequeuePos : 0;
+    }
+
+    bool tryPush(const T& value) {
+        auto pos = mEnqueuePos.load(std::memory_order_relaxed);
+        while (true) {
+            auto& cell = mCells[pos & mMask];
+            auto seq = cell.sequence.load(std::memory_order_acquire);
+            auto diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+            if (diff == 0) {
+                if (mEnqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    cell.data = value;
+                    cell.sequence.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = mEnqueuePos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    bool tryPop(T& value) {
+        auto pos = mDequeuePos.load(std::memory_order_relaxed);
+        while (true) {
+            auto& cell = mCells[pos & mMask];
+            auto seq = cell.sequence.load(std::memory_order_acquire);
+            auto diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+            if (diff == 0) {
+                if (mDequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    value = cell.data;
+                    cell.sequence.store(pos + mMask + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = mDequeuePos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+private:
+    static size_t roundUp(size_t capacity) {
+        size_t result = 2;
+        while (result < capacity) {
+            result <<= 1;
+        }
+        return result;
+    }
+};
+
+/*
+ * Counters of one event partition, updated with relaxed atomics by the
+ * receivers (pushed, dropped) and by the thread starting the transactions
+ * (batches). dropped also counts the events of failed transactions.
+ */
+struct EventQueueStats {
+    std::atomic<uint64_t> pushed;
+    std::atomic<uint64_t> dropped;
+    std::atomic<uint64_t> batches;
+    std::atomic<uint64_t> batchedEvents;
+    std::atomic<uint64_t> maxBatchSize;
+    std::atomic<uint64_t> flushes;          // batches handed off by the deadline
+    std::atomic<uint64_t> waitTimeSum;      // microseconds
+    std::atomic<uint64_t> maxWaitTime;      // microseconds
+
+    EventQueueStats()
+        : pushed(0)
+        , dropped(0)
+        , batches(0)
+        , batchedEvents(0)
+        , maxBatchSize(0)
+        , flushes(0)
+        , waitTimeSum(0)
+        , maxWaitTime(0)
+    {}
+
+    /*
+     * waitTime is the sum over all events of the batch, maxWait the longest
+     * any of them spent in the queue.
+     */
+    void addBatch(uint64_t size, uint64_t waitTime, uint64_t maxWait) {
+        batches.fetch_add(1, std::memory_order_relaxed);
+        batchedEvents.fetch_add(size, std::memory_order_relaxed);
+        waitTimeSum.fetch_add(waitTime, std::memory_order_relaxed);
+        updateMax(maxBatchSize, size);
+        updateMax(maxWaitTime, maxWait);
+    }
+
+private:
+    static void updateMax(std::atomic<uint64_t>& max, uint64_t value) {
+        auto current = max.load(std::memory_order_relaxed);
+        while (value > current && !max.compare_exchange_weak(current, value, std::memory_order_relaxed)) {}
+    }
+};
+
+} // namespace aim
@@ -0,0 +1,214 @@
+/*
+ * (C) Copyright 2015 ETH Zurich Systems Group (http://www.systems.ethz.ch/) and others.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Contributors:
+ *     Markus Pilman <mpilman@inf.ethz.ch>
+ *     Simon Loesing <sloesing@inf.ethz.ch>
+ *     Thomas Etter <etterth@gmail.com>
+ *     Kevin Bocksrocker <kevin.bocksrocker@gmail.com>
+ *     Lucas Braun <braunl@inf.ethz.ch>
+ */
+#include "GroupBy.hpp"
+
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+
+#include "Connection.hpp"
+
+namespace aim {
+
+using namespace tell::db;
+using namespace tell::store;
+
+namespace {
+
+bool isReal(FieldType type) {
+    return type == FieldType::FLOAT || type == FieldType::DOUBLE;
+}
+
+int64_t readInteger(const char* tuple, uint32_t offset, FieldType type) {
+    switch (type) {
+    case FieldType::SMALLINT:
+        return *reinterpret_cast<const int16_t*>(tuple + offset);
+    case FieldType::INT:
+        return *reinterpret_cast<const int32_t*>(tuple + offset);
+    case FieldType::BIGINT:
+        return *reinterpret_cast<const int64_t*>(tuple + offset);
+    default:
+        throw std::invalid_argument("Group by on non integer column");
+    }
+}
+
+double readReal(const char* tuple, uint32_t offset, FieldType type) {
+    if (type == FieldType::FLOAT) {
+        return *reinterpret_cast<const float*>(tuple + offset);
+    } else if (type == FieldType::DOUBLE) {
+        return *reinterpret_cast<const double*>(tuple + offset);
+    }
+    return readInteger(tuple, offset, type);
+}
+
+crossbow::string columnName(id_t id) {
+    return "column_" + crossbow::to_string(id);
+}
+
+} // anonymous namespace
+
+GroupByScan::GroupByScan(id_t groupColumn, FieldType groupType)
+    : mGroupColumn(addColumn(groupColumn, groupType))
+{
+    if (isReal(groupType)) {
+        throw std::invalid_argument("Group by on non integer column");
+    }
+}
+
+size_t GroupByScan::addColumn(id_t id, FieldType type) {
+    for (size_t i = 0; i < mColumns.size(); ++i) {
+        if (mColumns[i].id == id) {
+            return i;
+        }
+    }
+    mColumns.push_back(Column{id, type, 0});
+    return mColumns.size() - 1;
+}
+
+size_t GroupByScan::add(AggregationType type, id_t column, FieldType columnType) {
+    Aggregate aggregate;
+    aggregate.type = type;
+    // CNT only needs the group column
+    aggregate.column = type == AggregationType::CNT ? mGroupColumn : addColumn(column, columnType);
+    mAggregates.push_back(aggregate);
+    return mAggregates.size() - 1;
+}
+
+std::vector<size_t> GroupByScan::sortedColumns() const {
+    std::vector<size_t> sorted(mColumns.size());
+    for (size_t i = 0; i < sorted.size(); ++i) {
+        sorted[i] = i;
+    }
+    std::sort(sorted.begin(), sorted.end(), [this](size_t lhs, size_t rhs) {
+        return mColumns[lhs].id < mColumns[rhs].id;
+    });
+    return sorted;
+}
+
+void GroupByScan::prepare(Transaction& tx, Context& context, ScanPlan& plan) {
+    auto schema = tx.getSchema(context.wideTable);
+
+    // the projection has to be sorted by column id
+    crossbow::buffer_writer projectionWriter(plan.query(), plan.queryLength());
+    for (auto i : sortedColumns()) {
+        projectionWriter.write<uint16_t>(mColumns[i].id);
+    }
+
+    auto resultTable = std::make_shared<Table>(context.wideTable.value, resultSchema(schema.type()));
+    setResultRecord(resultTable->record());
+    plan.setResultTable(std::move(resultTable));
+}
+
+Schema GroupByScan::resultSchema(TableType type) const {
+    Schema schema(type);
+    for (auto i : sortedColumns()) {
+        schema.addField(mColumns[i].type, columnName(mColumns[i].id), true);
+    }
+    return schema;
+}
+
+void GroupByScan::setResultRecord(const Record& record) {
+    for (auto& column : mColumns) {
+        Record::id_t field;
+        if (!record.idOf(columnName(column.id), field)) {
+            throw std::runtime_error("group by field not found");
+        }
+        column.offset = record.getFieldMeta(field).offset;
+    }
+}
+
+uint32_t GroupByScan::offset(id_t column) const {
+    for (auto& entry : mColumns) {
+        if (entry.id == column) {
+            return entry.offset;
+        }
+    }
+    throw std::invalid_argument("Column is not part of the group by");
+}
+
+ScanRequest GroupByScan::request(const ScanPlan& plan, const std::vector<int64_t>& values) {
+    return plan.bind(values, [this](const char* tuple) {
+        consume(tuple);
+    });
+}
+
+void GroupByScan::initialize(Group& group) const {
+    group.resize(mAggregates.size());
+    for (size_t i = 0; i < mAggregates.size(); ++i) {
+        if (mAggregates[i].type == AggregationType::MIN) {
+            group[i].integer = std::numeric_limits<int64_t>::max();
+            group[i].real = std::numeric_limits<double>::max();
+        } else if (mAggregates[i].type == AggregationType::MAX) {
+            group[i].integer = std::numeric_limits<int64_t>::min();
+            group[i].real = std::numeric_limits<double>::lowest();
+        }
+    }
+}
+
+GroupByScan::Group& GroupByScan::group(int64_t key) {
+    auto iter = mGroups.find(key);
+    if (iter != mGroups.end()) {
+        return iter->second;
+    }
+    Group group;
+    initialize(group);
+    return mGroups.emplace(key, std::move(group)).first->second;
+}
+
+void GroupByScan::consume(const char* tuple) {
+    auto& groupColumn = mColumns[mGroupColumn];
+    auto& values = group(readInteger(tuple, groupColumn.offset, groupColumn.type));
+    for (size_t i = 0; i < mAggregates.size(); ++i) {
+        auto& aggregate = mAggregates[i];
+        auto& column = mColumns[aggregate.column];
+        auto& value = values[i];
+        switch (aggregate.type) {
+        case AggregationType::CNT:
+            ++value.integer;
+            break;
+        case AggregationType::SUM:
+            if (isReal(column.type)) {
+                value.real += readReal(tuple, column.offset, column.type);
+            } else {
+                value.integer += readInteger(tuple, column.offset, column.type);
+            }
+            break;
+        case AggregationType::MIN:
+            if (isReal(column.type)) {
+                value.real = std::min(value.real, readReal(tuple, column.offset, column.type));
+            } else {
+                value.integer = std::min(value.integer, readInteger(tuple, column.offset, column.type));
+            }
+            break;
+        case AggregationType::MAX:
+            if (isReal(column.type)) {
+                value.real = std::max(value.real, readReal(tuple, column.offset, column.type));
+            } else {
+                value.integer = std::max(value.integer, readInteger(tuple, column.offset, column.type));
+            }
+            break;
+        }
+    }
+}
+
+} // namespace aim
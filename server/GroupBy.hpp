@@ -0,0 +1,178 @@
+/*
+ * (C) Copyright 2015 ETH Zurich Systems Group (http://www.systems.ethz.ch/) and others.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Contributors:
+ *     Markus Pilman <mpilman@inf.ethz.ch>
+ *     Simon Loesing <sloesing@inf.ethz.ch>
+ *     Thomas Etter <etterth@gmail.com>
+ *     Kevin Bocksrocker <kevin.bocksrocker@gmail.com>
+ *     Lucas Braun <braunl@inf.ethz.ch>
+ */
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <unordered_map>
+#include <vector>
+
+#include <telldb/Transaction.hpp>
+
+#include "QueryPlan.hpp"
+#include "SharedScan.hpp"
+
+namespace aim {
+
+struct Context;
+
+/*
+ * Hash GROUP BY on an integer column. TellStore only offers aggregations over
+ * the whole selection, so instead of one aggregation scan per group value we
+ * run a single projection scan on the group column and the aggregated columns
+ * and fold every tuple into a hash table keyed by the group value. This ships
+ * every selected tuple to the server: it only pays off for groups that are
+ * too many or too rare for an aggregation scan each, like the Q3 groups of
+ * ten and more calls.
+ *
+ * Usage: add the aggregates and prepare() the scan plan, which resolves the
+ * column offsets. The prepared GroupByScan is kept with the plan, every
+ * execution works on a copy: create the scan request, which feeds every
+ * tuple to consume(), the groups are complete once the scan is done. The
+ * copy has to outlive the request.
+ */
+class GroupByScan {
+public:
+    /*
+     * Integral columns (and CNT) are aggregated in integer, floating point
+     * columns in real.
+     */
+    struct Accumulator {
+        int64_t integer = 0;
+        double real = 0.0;
+    };
+    using Group = std::vector<Accumulator>;
+
+    GroupByScan(id_t groupColumn, tell::store::FieldType groupType);
+
+    /*
+     * Adds an aggregate and returns its index in Group. The column is ignored
+     * for CNT, which counts the tuples of a group.
+     */
+    size_t add(tell::store::AggregationType type, id_t column = 0,
+            tell::store::FieldType columnType = tell::store::FieldType::INT);
+
+    uint32_t projectionLength() const {
+        return sizeof(uint16_t) * mColumns.size();
+    }
+
+    /*
+     * Writes the projection into the plan (of projectionLength()) and sets
+     * its result table.
+     */
+    void prepare(tell::db::Transaction& tx, Context& context, ScanPlan& plan);
+
+    /*
+     * Schema of the projected tuples, its fields are sorted by column id.
+     */
+    tell::store::Schema resultSchema(tell::store::TableType type) const;
+
+    /*
+     * Resolves the column offsets from the record of the result schema.
+     */
+    void setResultRecord(const tell::store::Record& record);
+
+    /*
+     * Offset of a grouped or aggregated column in the projected tuples.
+     */
+    uint32_t offset(id_t column) const;
+
+    ScanRequest request(const ScanPlan& plan, const std::vector<int64_t>& values);
+
+    void consume(const char* tuple);
+
+    const std::unordered_map<int64_t, Group>& groups() const {
+        return mGroups;
+    }
+
+private:
+    struct Column {
+        id_t id;
+        tell::store::FieldType type;
+        uint32_t offset;
+    };
+    struct Aggregate {
+        tell::store::AggregationType type;
+        size_t column;  // index in mColumns
+    };
+
+    size_t addColumn(id_t id, tell::store::FieldType type);
+    std::vector<size_t> sortedColumns() const;
+    Group& group(int64_t key);
+    void initialize(Group& group) const;
+
+    std::vector<Column> mColumns;
+    size_t mGroupColumn;            // index in mColumns, initialized after mColumns
+    std::vector<Aggregate> mAggregates;
+    std::unordered_map<int64_t, Group> mGroups;
+};
+
+/*
+ * Running ARGMAX / ARGMIN over the tuples of a projection scan: remembers the
+ * key (subscriber id) with the largest (smallest) value seen so far. Ties go
+ * to the lowest key, such that the result does not depend on the order in
+ * which the scan returns the tuples.
+ */
+template<class T>
+class ArgExtreme {
+    bool mMax;
+    bool mValid;
+    uint64_t mKey;
+    T mValue;
+public:
+    explicit ArgExtreme(tell::store::AggregationType type)
+        : mMax(type == tell::store::AggregationType::MAX)
+        , mValid(false)
+        , mKey(0)
+        , mValue()
+    {
+        if (type != tell::store::AggregationType::MAX && type != tell::store::AggregationType::MIN) {
+            throw std::invalid_argument("ArgExtreme needs MIN or MAX");
+        }
+    }
+
+    void update(uint64_t key, T value) {
+        if (!mValid || (mMax ? value > mValue : value < mValue) || (value == mValue && key < mKey)) {
+            mValid = true;
+            mKey = key;
+            mValue = value;
+        }
+    }
+
+    /*
+     * False as long as update() was never called.
+     */
+    bool valid() const {
+        return mValid;
+    }
+
+    uint64_t key() const {
+        return mKey;
+    }
+
+    T value() const {
+        return mValue;
+    }
+};
+
+} // namespace aim
@@ -0,0 +1,48 @@
+/*
+ * (C) Copyright 2015 ETH Zurich Systems Group (http://www.systems.ethz.ch/) and others.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Contributors:
+ *     Markus Pilman <mpilman@inf.ethz.ch>
+ *     Simon Loesing <sloesing@inf.ethz.ch>
+ *     Thomas Etter <etterth@gmail.com>
+ *     Kevin Bocksrocker <kevin.bocksrocker@gmail.com>
+ *     Lucas Braun <braunl@inf.ethz.ch>
+ */
+#include "Transactions.hpp"
+
+#include "Connection.hpp"
+
+namespace aim {
+
+using namespace tell::db;
+
+LookupOut Transactions::lookup(Transaction& tx, Context& context, uint64_t subscriberId) {
+    LookupOut result;
+    try {
+        // open table has to be called anyway to correctly initialize the transaction cache
+        auto wFuture = tx.openTable("wt");
+        wFuture.get();
+        auto tupleFuture = tx.get(context.wideTable, tell::db::key_t{subscriberId});
+        auto& tuple = tupleFuture.get();
+        result.timestamp = tuple[context.timeStampId].value<int64_t>();
+        tx.commit();
+    } catch (std::exception& ex) {
+        result.success = false;
+        result.error = ex.what();
+    }
+    return result;
+}
+
+} // namespace aim
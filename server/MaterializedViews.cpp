@@ -0,0 +1,135 @@
+/*
+ * (C) Copyright 2015 ETH Zurich Systems Group (http://www.systems.ethz.ch/) and others.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Contributors:
+ *     Markus Pilman <mpilman@inf.ethz.ch>
+ *     Simon Loesing <sloesing@inf.ethz.ch>
+ *     Thomas Etter <etterth@gmail.com>
+ *     Kevin Bocksrocker <kevin.bocksrocker@gmail.com>
+ *     Lucas Braun <braunl@inf.ethz.ch>
+ */
+#include "MaterializedViews.hpp"
+
+#include <algorithm>
+
+#include <common/Util.hpp>
+#include "server/sep/window.h"
+
+namespace aim {
+
+template<class T>
+void MaterializedViews::View<T>::add(int32_t epoch, int32_t key, T value) {
+    if (key <= 0) {
+        return;
+    }
+    auto iter = mEpochs.find(epoch);
+    if (iter == mEpochs.end()) {
+        if (!mEpochs.empty() && epoch < mEpochs.rbegin()->first - 1) {
+            return;
+        }
+        iter = mEpochs.emplace(epoch, std::vector<Bucket<T>>(mBuckets + 1)).first;
+        // drop the epochs nobody asks for anymore
+        while (mEpochs.size() > 2) {
+            mEpochs.erase(mEpochs.begin());
+        }
+    }
+    auto& bucket = iter->second[bucketOf(key)];
+    ++bucket.count;
+    bucket.sum += value;
+    bucket.max = std::max(bucket.max, value);
+}
+
+template<class T>
+void MaterializedViews::View<T>::remove(int32_t epoch, int32_t key, T value) {
+    if (key <= 0) {
+        return;
+    }
+    auto iter = mEpochs.find(epoch);
+    if (iter == mEpochs.end()) {
+        return;
+    }
+    auto& bucket = iter->second[bucketOf(key)];
+    --bucket.count;
+    bucket.sum -= value;
+}
+
+template<class T>
+MaterializedViews::Bucket<T> MaterializedViews::View<T>::query(int32_t epoch, uint32_t alpha) const {
+    Bucket<T> result;
+    auto iter = mEpochs.find(epoch);
+    if (iter == mEpochs.end()) {
+        return result;
+    }
+    for (auto i = alpha + 1; i <= mBuckets; ++i) {
+        auto& bucket = iter->second[i];
+        if (bucket.count == 0) {
+            continue;
+        }
+        result.count += bucket.count;
+        result.sum += bucket.sum;
+        result.max = std::max(result.max, bucket.max);
+    }
+    return result;
+}
+
+MaterializedViews::MaterializedViews(uint32_t buckets)
+    : mBuckets(buckets)
+    , mQ1(buckets)
+    , mQ2(buckets)
+{}
+
+void MaterializedViews::update(const std::vector<std::pair<Record, Record>>& changes) {
+    std::lock_guard<std::mutex> _(mMutex);
+    for (auto& change : changes) {
+        auto& oldRecord = change.first;
+        auto& newRecord = change.second;
+        mQ1.remove(oldRecord.epochWeekLocal, oldRecord.callsSumLocalWeek, oldRecord.durSumAllWeek);
+        mQ1.add(newRecord.epochWeekLocal, newRecord.callsSumLocalWeek, newRecord.durSumAllWeek);
+        mQ2.remove(oldRecord.epochWeekAll, oldRecord.callsSumAllWeek, oldRecord.costMaxAllWeek);
+        mQ2.add(newRecord.epochWeekAll, newRecord.callsSumAllWeek, newRecord.costMaxAllWeek);
+    }
+}
+
+bool MaterializedViews::q1(const Q1In& in, Q1Out& result) {
+    if (in.alpha >= mBuckets) {
+        return false;
+    }
+    auto weekEpoch = Window(WindowType::TUMB, WindowLength::WEEK).epochOf(now());
+    Bucket<int64_t> aggregate;
+    {
+        std::lock_guard<std::mutex> _(mMutex);
+        aggregate = mQ1.query(weekEpoch, in.alpha);
+    }
+    result.avg = aggregate.sum;
+    if (aggregate.count != 0)   // don-t divide by zero, report 0!
+        result.avg /= aggregate.count;
+    return true;
+}
+
+bool MaterializedViews::q2(const Q2In& in, Q2Out& result) {
+    if (in.alpha >= mBuckets) {
+        return false;
+    }
+    auto weekEpoch = Window(WindowType::TUMB, WindowLength::WEEK).epochOf(now());
+    Bucket<double> aggregate;
+    {
+        std::lock_guard<std::mutex> _(mMutex);
+        aggregate = mQ2.query(weekEpoch, in.alpha);
+    }
+    result.max = aggregate.count == 0 ? 0.0 : aggregate.max;
+    return true;
+}
+
+} // namespace aim
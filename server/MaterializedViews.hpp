@@ -0,0 +1,126 @@
+/*
+ * (C) Copyright 2015 ETH Zurich Systems Group (http://www.systems.ethz.ch/) and others.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Contributors:
+ *     Markus Pilman <mpilman@inf.ethz.ch>
+ *     Simon Loesing <sloesing@inf.ethz.ch>
+ *     Thomas Etter <etterth@gmail.com>
+ *     Kevin Bocksrocker <kevin.bocksrocker@gmail.com>
+ *     Lucas Braun <braunl@inf.ethz.ch>
+ */
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include <common/Protocol.hpp>
+
+namespace aim {
+
+/*
+ * Incrementally maintained aggregates answering Q1 and Q2 without a scan.
+ *
+ * Both queries filter on a call counter (> alpha) of the current week, alpha
+ * only ranges over a small domain. The views keep partial aggregates (count,
+ * sum, max) per epoch and per value of the counter: keys 1 to buckets - 1
+ * have a bucket each, all larger keys share the last one. Subscribers with a
+ * key of 0 are never selected and not tracked at all, so the freshly
+ * populated table has empty views. processEvents hands the old and the new
+ * values of every updated record to update(), a query for alpha < buckets
+ * sums up the buckets above alpha.
+ *
+ * The views only see the events processed by this server, they are exact as
+ * long as it processes all events since the table was populated.
+ */
+class MaterializedViews {
+public:
+    /*
+     * The columns of a subscriber record the views depend on.
+     */
+    struct Record {
+        int32_t epochWeekLocal;
+        int32_t callsSumLocalWeek;  // Q1 key
+        int64_t durSumAllWeek;      // Q1 value
+        int32_t epochWeekAll;
+        int32_t callsSumAllWeek;    // Q2 key
+        double costMaxAllWeek;      // Q2 value
+    };
+
+    explicit MaterializedViews(uint32_t buckets);
+
+    /*
+     * Applies the (old, new) pairs of the updated records of one committed
+     * transaction.
+     */
+    void update(const std::vector<std::pair<Record, Record>>& changes);
+
+    /*
+     * Return false if alpha is too large for the buckets, the query has to
+     * scan the table then.
+     */
+    bool q1(const Q1In& in, Q1Out& result);
+    bool q2(const Q2In& in, Q2Out& result);
+
+private:
+    template<class T>
+    struct Bucket {
+        int64_t count = 0;
+        T sum = 0;
+        T max = std::numeric_limits<T>::lowest();
+    };
+
+    /*
+     * Buckets of one aggregate per epoch. The max of a bucket is never
+     * lowered when a record leaves it: within a window the keys and values
+     * of a subscriber only grow, so a subscriber that moved on to a larger
+     * key is still part of every suffix of buckets the old one was part of,
+     * with a value at least as large. Only the latest two epochs are kept.
+     */
+    template<class T>
+    class View {
+    public:
+        explicit View(uint32_t buckets)
+            : mBuckets(buckets)
+        {}
+
+        void add(int32_t epoch, int32_t key, T value);
+        void remove(int32_t epoch, int32_t key, T value);
+
+        /*
+         * Aggregates all keys > alpha of the epoch, alpha has to be smaller
+         * than the number of buckets.
+         */
+        Bucket<T> query(int32_t epoch, uint32_t alpha) const;
+
+    private:
+        size_t bucketOf(int32_t key) const {
+            return std::min<size_t>(key, mBuckets);
+        }
+
+        uint32_t mBuckets;
+        std::map<int32_t, std::vector<Bucket<T>>> mEpochs;
+    };
+
+    uint32_t mBuckets;
+    std::mutex mMutex;
+    View<int64_t> mQ1;
+    View<double> mQ2;
+};
+
+} // namespace aim
@@ -32,6 +32,8 @@
 #include <common/dimension-tables.h>
 #include <common/dimension-tables-mapping.h>
 
+#include "Sampling.hpp"
+
 using namespace tell::db;
 
 namespace aim {
@@ -46,6 +48,15 @@ inline void initializeWideTableColumn (std::unordered_map<crossbow::string, Fiel
     }
 }
 
+inline void initializeEpochs (std::unordered_map<crossbow::string, Field> &tuple,
+                     Timestamp ts) {
+    for (auto length : {WindowLength::DAY, WindowLength::WEEK}) {
+        auto epoch = Window(WindowType::TUMB, length).epochOf(ts);
+        for (auto filter : {FilterType::NO, FilterType::LOCAL, FilterType::NONLOCAL})
+            tuple[AIMSchema::getEpochName(filter, length)] = Field(epoch);
+    }
+}
+
 }   // anonymous namespace
 
 void Populator::populateWideTable(tell::db::Transaction &transaction,
@@ -58,7 +69,10 @@ void Populator::populateWideTable(tell::db::Transaction &transaction,
     initializeWideTableColumn(tuple, aimSchema); // these attributes are the same for each tuple
     for (uint64_t i = lowest; i <= highest; ++i) {
         tuple["subscriber_id"] = Field(static_cast<int64_t>(i));
-        tuple["last_updated"] = Field(now());
+        tuple["sample_bucket"] = Field(sampleBucket(i));
+        auto ts = now();
+        tuple["last_updated"] = Field(ts);
+        initializeEpochs(tuple, ts);
 
         // subscription type
         int16_t subscriptionId = rand.randomWithin<int16_t>(
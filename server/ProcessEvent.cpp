@@ -24,7 +24,9 @@
 
 #include <crossbow/enum_underlying.hpp>
 
-#include <map>
+#include <algorithm>
+#include <memory>
+#include <utility>
 #include <vector>
 
 #include <common/dimension-tables-unique-values.h>
@@ -34,7 +36,23 @@ namespace aim {
 
 using namespace tell::db;
 
-void Transactions::processEvents(Transaction& tx,
+namespace {
+
+template<class Tuple>
+MaterializedViews::Record viewRecord(const Context &context, Tuple& tuple) {
+    MaterializedViews::Record record;
+    record.epochWeekLocal = tuple[context.epochWeekLocal].template value<int32_t>();
+    record.callsSumLocalWeek = tuple[context.callsSumLocalWeek].template value<int32_t>();
+    record.durSumAllWeek = tuple[context.durSumAllWeek].template value<int64_t>();
+    record.epochWeekAll = tuple[context.epochWeekAll].template value<int32_t>();
+    record.callsSumAllWeek = tuple[context.callsSumAllWeek].template value<int32_t>();
+    record.costMaxAllWeek = tuple[context.costMaxAllWeek].template value<double>();
+    return record;
+}
+
+} // anonymous namespace
+
+bool Transactions::processEvents(Transaction& tx,
             Context &context, std::vector<Event> &events) {
 
     try {
@@ -42,37 +60,89 @@ void Transactions::processEvents(Transaction& tx,
         auto wFuture = tx.openTable("wt");
         wFuture.get();
 
+        // group the batch by subscriber, events of a subscriber in timestamp
+        // order, such that every record is read and written only once
+        std::vector<uint32_t> order(events.size());
+        for (uint32_t i = 0; i < order.size(); ++i) {
+            order[i] = i;
+        }
+        std::stable_sort(order.begin(), order.end(), [&events](uint32_t lhs, uint32_t rhs) {
+            auto& l = events[lhs];
+            auto& r = events[rhs];
+            return l.caller_id < r.caller_id ||
+                    (l.caller_id == r.caller_id && l.timestamp < r.timestamp);
+        });
+
+        // [begin, end) ranges in order belonging to the same subscriber
+        std::vector<std::pair<uint32_t, uint32_t>> subscribers;
+        for (uint32_t begin = 0; begin < order.size();) {
+            auto end = begin + 1;
+            while (end < order.size() &&
+                    events[order[end]].caller_id == events[order[begin]].caller_id) {
+                ++end;
+            }
+            subscribers.emplace_back(begin, end);
+            begin = end;
+        }
+
         std::vector<Future<Tuple>> tupleFutures;
-        tupleFutures.reserve(events.size());
+        tupleFutures.reserve(subscribers.size());
 
         // get futures in revers order
-        for (auto iter = events.rbegin(); iter < events.rend(); ++iter) {
-            tupleFutures.emplace_back(
-                        tx.get(context.wideTable, tell::db::key_t{iter->caller_id}));
+        for (auto iter = subscribers.rbegin(); iter < subscribers.rend(); ++iter) {
+            tupleFutures.emplace_back(tx.get(context.wideTable,
+                        tell::db::key_t{events[order[iter->first]].caller_id}));
+        }
+
+        // flat native copy of the AIM attributes of the current subscriber
+        auto& kernel = context.aimSchemaKernel;
+        std::unique_ptr<char[]> recordBuffer(new char[kernel.recordSize()]);
+        AIMRecordView record(recordBuffer.get());
+
+        std::vector<std::pair<MaterializedViews::Record, MaterializedViews::Record>> viewChanges;
+        if (mViews) {
+            viewChanges.reserve(subscribers.size());
         }
 
-        auto eventIter = events.begin();
+        auto subscriberIter = subscribers.begin();
         // get the actual values in reverse reverse = actual order
         for (auto iter = tupleFutures.rbegin();
-                    iter < tupleFutures.rend(); ++iter, ++eventIter) {
+                    iter < tupleFutures.rend(); ++iter, ++subscriberIter) {
             auto& oldTuple = iter->get();
-            Timestamp ts =  oldTuple[context.timeStampId].value<Timestamp>();
+            kernel.load(oldTuple, context.timeStampId, record);
+            for (auto i = subscriberIter->first; i < subscriberIter->second; ++i) {
+                kernel.apply(record, events[order[i]]);
+            }
+            // TellDB only updates from one Tuple to another (it needs the old
+            // one for its write set and serializes the new one itself on
+            // commit), there is no way to hand it the flat record.
             Tuple newTuple (oldTuple);
-            for (auto &pair: context.tellIDToAIMSchemaEntry) {
-                if (pair.second.filter(*eventIter))
-                    pair.second.update(newTuple[pair.first], ts, *eventIter);
-                else
-                    pair.second.maintain(newTuple[pair.first], ts, *eventIter);
+            kernel.store(record, context.timeStampId, newTuple);
+            if (mViews) {
+                viewChanges.emplace_back(viewRecord(context, oldTuple), viewRecord(context, newTuple));
             }
-            tx.update(context.wideTable, tell::db::key_t{eventIter->caller_id},
+            tx.update(context.wideTable,
+                      tell::db::key_t{events[order[subscriberIter->first]].caller_id},
                       oldTuple, newTuple);
         }
 
         tx.commit();
+        if (mViews) {
+            mViews->update(viewChanges);
+        }
+        if (mCache) {
+            mCache->committed();
+        }
     } catch (std::exception& ex) {
-        LOG_ERROR("FATAL: Connection aborted for event, this must not happen, ex = %1%", ex.what());
-        std::terminate();
+        LOG_ERROR("Event transaction of %1% events failed: %2%", events.size(), ex.what());
+        try {
+            tx.rollback();
+        } catch (std::exception& rollbackEx) {
+            LOG_ERROR("Rollback failed: %1%", rollbackEx.what());
+        }
+        return false;
     }
+    return true;
 }
 
 } // namespace aim
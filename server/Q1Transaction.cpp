@@ -24,86 +24,144 @@
 
 #include <crossbow/enum_underlying.hpp>
 
-#include <map>
-
 #include <common/dimension-tables-unique-values.h>
 #include "Connection.hpp"
+#include "Sampling.hpp"
 
 namespace aim {
 
 using namespace tell::db;
 using namespace tell::store;
 
-Q1Out Transactions::q1Transaction(Transaction& tx, Context &context, const Q1In& in)
-{
-    Q1Out result;
-
-    try {
-        auto schema = tx.getSchema(context.wideTable);
-
-        uint32_t selectionLength = 32;
-        std::unique_ptr<char[]> selection(new char[selectionLength]);
-
-        crossbow::buffer_writer selectionWriter(selection.get(), selectionLength);
-        selectionWriter.write<uint32_t>(0x1u);
-        selectionWriter.write<uint16_t>(0x1u);
-        selectionWriter.write<uint16_t>(0x0u);
-        selectionWriter.write<uint32_t>(0x0u);
-        selectionWriter.write<uint32_t>(0x0u);
-
-        selectionWriter.write<uint16_t>(context.callsSumLocalWeek);
-        selectionWriter.write<uint16_t>(0x1u);
-        selectionWriter.set(0, 4);
-
-        selectionWriter.write<uint8_t>(crossbow::to_underlying(PredicateType::GREATER));
-        selectionWriter.write<uint8_t>(0x0u);
-        selectionWriter.set(0, 2);
-        selectionWriter.write<int32_t>(in.alpha);
-
-        uint32_t aggregationLength = 8;
-        std::unique_ptr<char[]> aggregation(new char[aggregationLength]);
-
-        crossbow::buffer_writer aggregationWriter(aggregation.get(), aggregationLength);
-        aggregationWriter.write<uint16_t>(context.durSumAllWeek);
-        aggregationWriter.write<uint16_t>(crossbow::to_underlying(AggregationType::SUM));
-        aggregationWriter.write<uint16_t>(context.durSumAllWeek);
-        aggregationWriter.write<uint16_t>(crossbow::to_underlying(AggregationType::CNT));
-
-        Schema resultSchema(schema.type());
-        resultSchema.addField(FieldType::BIGINT, "sum", true);
-        resultSchema.addField(FieldType::BIGINT, "cnt", true);
-        Table resultTable(context.wideTable.value, std::move(resultSchema));
-
-        auto &snapshot = tx.snapshot();
-        auto &clientHandle = tx.getHandle();
-        auto scanIterator = clientHandle.scan(resultTable, snapshot,
-                *context.scanMemoryMananger, ScanQueryType::AGGREGATION, selectionLength,
-                selection.get(), aggregationLength, aggregation.get());
-
-        if (scanIterator->hasNext()) {
-            const char* tuple;
-            size_t tupleLength;
-            std::tie(std::ignore, tuple, tupleLength) = scanIterator->next();
-            result.avg = resultTable.field<int64_t>("sum", tuple);
-            auto cnt = resultTable.field<int64_t>("cnt", tuple);
-            if (cnt != 0)   // don-t divide by zero, report 0!
-                result.avg /= cnt;
-            result.success = true;
-        }
+namespace {
 
-        if (scanIterator->error()) {
-            result.error = crossbow::to_string(scanIterator->error().value());
-            result.success = false;
-        }
+struct Q1Plan : QueryPlan {
+    ScanPlan scan;
+    size_t alpha;
+    size_t weekEpoch;
+    size_t sample;
+    uint32_t sumOffset;
+    uint32_t cntOffset;
+
+    Q1Plan(bool sampled)
+        : scan(ScanQueryType::AGGREGATION, sampled ? 72 : 48, 8)
+        , sample(0)
+    {}
+};
 
-        tx.commit();
-    } catch (std::exception& ex) {
-        result.success = false;
-        result.error = ex.what();
+std::unique_ptr<Q1Plan> compile(Transaction& tx, Context &context, bool sampled)
+{
+    auto schema = tx.getSchema(context.wideTable);
+    std::unique_ptr<Q1Plan> plan(new Q1Plan(sampled));
+
+    crossbow::buffer_writer selectionWriter(plan->scan.selection(), plan->scan.selectionLength());
+    selectionWriter.write<uint32_t>(sampled ? 0x3u : 0x2u);
+    selectionWriter.write<uint16_t>(sampled ? 0x4u : 0x2u);
+    selectionWriter.write<uint16_t>(0x0u);
+    selectionWriter.write<uint32_t>(0x0u);
+    selectionWriter.write<uint32_t>(0x0u);
+
+    selectionWriter.write<uint16_t>(context.callsSumLocalWeek);
+    selectionWriter.write<uint16_t>(0x1u);
+    selectionWriter.set(0, 4);
+
+    selectionWriter.write<uint8_t>(crossbow::to_underlying(PredicateType::GREATER));
+    selectionWriter.write<uint8_t>(0x0u);
+    selectionWriter.set(0, 2);
+    plan->alpha = plan->scan.slot(selectionWriter, FieldType::INT);
+    selectionWriter.write<int32_t>(0);
+
+    // ignore subscribers whose values are from an older window
+    selectionWriter.write<uint16_t>(context.epochWeekLocal);
+    selectionWriter.write<uint16_t>(0x1u);
+    selectionWriter.set(0, 4);
+    selectionWriter.write<uint8_t>(crossbow::to_underlying(PredicateType::EQUAL));
+    selectionWriter.write<uint8_t>(0x1u);
+    selectionWriter.set(0, 2);
+    plan->weekEpoch = plan->scan.slot(selectionWriter, FieldType::INT);
+    selectionWriter.write<int32_t>(0);
+
+    if (sampled) {
+        plan->sample = writeSamplePredicate(selectionWriter, plan->scan, context, 0x2u);
     }
 
-    return result;
+    crossbow::buffer_writer aggregationWriter(plan->scan.query(), plan->scan.queryLength());
+    aggregationWriter.write<uint16_t>(context.durSumAllWeek);
+    aggregationWriter.write<uint16_t>(crossbow::to_underlying(AggregationType::SUM));
+    aggregationWriter.write<uint16_t>(context.durSumAllWeek);
+    aggregationWriter.write<uint16_t>(crossbow::to_underlying(AggregationType::CNT));
+
+    Schema resultSchema(schema.type());
+    resultSchema.addField(FieldType::BIGINT, "sum", true);
+    resultSchema.addField(FieldType::BIGINT, "cnt", true);
+    auto resultTable = std::make_shared<Table>(context.wideTable.value, std::move(resultSchema));
+    auto& resultRecord = resultTable->record();
+    Record::id_t field;
+    resultRecord.idOf("sum", field);
+    plan->sumOffset = resultRecord.getFieldMeta(field).offset;
+    resultRecord.idOf("cnt", field);
+    plan->cntOffset = resultRecord.getFieldMeta(field).offset;
+    plan->scan.setResultTable(std::move(resultTable));
+    return plan;
 }
 
-} // namespace aim
+/*
+ * Sum and count of one replicate of the sample (of the whole table for an
+ * exact query).
+ */
+struct Q1Sums {
+    int64_t sum = 0;
+    int64_t cnt = 0;
+};
 
+} // anonymous namespace
+
+Query<Q1Out> Transactions::q1Query(Transaction& tx, Context &context, const Q1In& in)
+{
+    bool sampled = isApproximate(in.sample_permille);
+    auto& plan = context.plans.get<Q1Plan>(Command::Q1, sampled, [&tx, &context, sampled]() {
+        return compile(tx, context, sampled);
+    });
+
+    std::vector<int64_t> values(plan.scan.slots());
+    values[plan.alpha] = in.alpha;
+    values[plan.weekEpoch] = Window(WindowType::TUMB, WindowLength::WEEK).epochOf(now());
+
+    auto replicates = sampleReplicates(in.sample_permille);
+    auto sums = std::make_shared<std::vector<Q1Sums>>(replicates);
+    auto sumOffset = plan.sumOffset;
+    auto cntOffset = plan.cntOffset;
+    Query<Q1Out> query;
+    for (unsigned i = 0; i < replicates; ++i) {
+        if (sampled) {
+            bindReplicate(values, plan.sample, in.sample_permille, i);
+        }
+        query.scans.push_back(plan.scan.bind(values, [sums, i, sumOffset, cntOffset](const char* tuple) {
+            (*sums)[i].sum = *reinterpret_cast<const int64_t*>(tuple + sumOffset);
+            (*sums)[i].cnt = *reinterpret_cast<const int64_t*>(tuple + cntOffset);
+        }));
+    }
+    auto rate = sampleRate(in.sample_permille);
+    query.finish = [sums, sampled, rate]() {
+        Q1Out result;
+        Q1Sums total;
+        std::vector<double> averages;
+        for (auto& replicate : *sums) {
+            total.sum += replicate.sum;
+            total.cnt += replicate.cnt;
+            if (replicate.cnt != 0) {
+                averages.push_back(static_cast<double>(replicate.sum) / replicate.cnt);
+            }
+        }
+        result.avg = total.sum;
+        if (total.cnt != 0)   // don-t divide by zero, report 0!
+            result.avg /= total.cnt;
+        if (sampled) {
+            result.avg_error = replicateError(result.avg, averages, rate);
+        }
+        return result;
+    };
+    return query;
+}
+
+} // namespace aim
@@ -24,8 +24,6 @@
 
 #include <crossbow/enum_underlying.hpp>
 
-#include <map>
-
 #include <common/dimension-tables-unique-values.h>
 #include "Connection.hpp"
 
@@ -34,70 +32,89 @@ namespace aim {
 using namespace tell::db;
 using namespace tell::store;
 
-Q2Out Transactions::q2Transaction(Transaction& tx, Context &context, const Q2In& in)
+namespace {
+
+struct Q2Plan : QueryPlan {
+    ScanPlan scan;
+    size_t alpha;
+    size_t weekEpoch;
+    uint32_t maxOffset;
+
+    Q2Plan()
+        : scan(ScanQueryType::AGGREGATION, 48, 4)
+    {}
+};
+
+std::unique_ptr<Q2Plan> compile(Transaction& tx, Context &context)
 {
-    Q2Out result;
-
-    try {
-        auto schema = tx.getSchema(context.wideTable);
-
-        uint32_t selectionLength = 32;
-        std::unique_ptr<char[]> selection(new char[selectionLength]);
-
-        crossbow::buffer_writer selectionWriter(selection.get(), selectionLength);
-        selectionWriter.write<uint32_t>(0x1u);
-        selectionWriter.write<uint16_t>(0x1u);
-        selectionWriter.write<uint16_t>(0x0u);
-        selectionWriter.write<uint32_t>(0x0u);
-        selectionWriter.write<uint32_t>(0x0u);
-
-        selectionWriter.write<uint16_t>(context.callsSumAllWeek);
-        selectionWriter.write<uint16_t>(0x1u);
-        selectionWriter.set(0, 4);
-
-        selectionWriter.write<uint8_t>(crossbow::to_underlying(PredicateType::GREATER));
-        selectionWriter.write<uint8_t>(0x0u);
-        selectionWriter.set(0, 2);
-        selectionWriter.write<int32_t>(in.alpha);
-
-        uint32_t aggregationLength = 4;
-        std::unique_ptr<char[]> aggregation(new char[aggregationLength]);
-
-        crossbow::buffer_writer aggregationWriter(aggregation.get(), aggregationLength);
-        aggregationWriter.write<uint16_t>(context.costMaxAllWeek);
-        aggregationWriter.write<uint16_t>(crossbow::to_underlying(AggregationType::MAX));
-
-        Schema resultSchema(schema.type());
-        resultSchema.addField(FieldType::DOUBLE, "max", true);
-        Table resultTable(context.wideTable.value, std::move(resultSchema));
-
-        auto &snapshot = tx.snapshot();
-        auto &clientHandle = tx.getHandle();
-        auto scanIterator = clientHandle.scan(resultTable, snapshot,
-                *context.scanMemoryMananger, ScanQueryType::AGGREGATION, selectionLength,
-                selection.get(), aggregationLength, aggregation.get());
-
-        if (scanIterator->hasNext()) {
-            const char* tuple;
-            size_t tupleLength;
-            std::tie(std::ignore, tuple, tupleLength) = scanIterator->next();
-            result.max = resultTable.field<double>("max", tuple);
-            result.success = true;
-        }
-
-        if (scanIterator->error()) {
-            result.error = crossbow::to_string(scanIterator->error().value());
-            result.success = false;
-        }
-
-        tx.commit();
-    } catch (std::exception& ex) {
-        result.success = false;
-        result.error = ex.what();
-    }
-
-    return result;
+    auto schema = tx.getSchema(context.wideTable);
+    std::unique_ptr<Q2Plan> plan(new Q2Plan());
+
+    crossbow::buffer_writer selectionWriter(plan->scan.selection(), plan->scan.selectionLength());
+    selectionWriter.write<uint32_t>(0x2u);
+    selectionWriter.write<uint16_t>(0x2u);
+    selectionWriter.write<uint16_t>(0x0u);
+    selectionWriter.write<uint32_t>(0x0u);
+    selectionWriter.write<uint32_t>(0x0u);
+
+    selectionWriter.write<uint16_t>(context.callsSumAllWeek);
+    selectionWriter.write<uint16_t>(0x1u);
+    selectionWriter.set(0, 4);
+
+    selectionWriter.write<uint8_t>(crossbow::to_underlying(PredicateType::GREATER));
+    selectionWriter.write<uint8_t>(0x0u);
+    selectionWriter.set(0, 2);
+    plan->alpha = plan->scan.slot(selectionWriter, FieldType::INT);
+    selectionWriter.write<int32_t>(0);
+
+    // ignore subscribers whose values are from an older window
+    selectionWriter.write<uint16_t>(context.epochWeekAll);
+    selectionWriter.write<uint16_t>(0x1u);
+    selectionWriter.set(0, 4);
+    selectionWriter.write<uint8_t>(crossbow::to_underlying(PredicateType::EQUAL));
+    selectionWriter.write<uint8_t>(0x1u);
+    selectionWriter.set(0, 2);
+    plan->weekEpoch = plan->scan.slot(selectionWriter, FieldType::INT);
+    selectionWriter.write<int32_t>(0);
+
+    crossbow::buffer_writer aggregationWriter(plan->scan.query(), plan->scan.queryLength());
+    aggregationWriter.write<uint16_t>(context.costMaxAllWeek);
+    aggregationWriter.write<uint16_t>(crossbow::to_underlying(AggregationType::MAX));
+
+    Schema resultSchema(schema.type());
+    resultSchema.addField(FieldType::DOUBLE, "max", true);
+    auto resultTable = std::make_shared<Table>(context.wideTable.value, std::move(resultSchema));
+    auto& resultRecord = resultTable->record();
+    Record::id_t field;
+    resultRecord.idOf("max", field);
+    plan->maxOffset = resultRecord.getFieldMeta(field).offset;
+    plan->scan.setResultTable(std::move(resultTable));
+    return plan;
 }
 
-} // namespace aim
+} // anonymous namespace
 
+Query<Q2Out> Transactions::q2Query(Transaction& tx, Context &context, const Q2In& in)
+{
+    auto& plan = context.plans.get<Q2Plan>(Command::Q2, 0, [&tx, &context]() {
+        return compile(tx, context);
+    });
+
+    std::vector<int64_t> values(plan.scan.slots());
+    values[plan.alpha] = in.alpha;
+    values[plan.weekEpoch] = Window(WindowType::TUMB, WindowLength::WEEK).epochOf(now());
+
+    auto result = std::make_shared<Q2Out>();
+    result->max = 0.0;
+    auto maxOffset = plan.maxOffset;
+    Query<Q2Out> query;
+    query.scans.push_back(plan.scan.bind(values, [result, maxOffset](const char* tuple) {
+        result->max = *reinterpret_cast<const double*>(tuple + maxOffset);
+    }));
+    query.finish = [result]() {
+        return *result;
+    };
+    return query;
+}
+
+} // namespace aim
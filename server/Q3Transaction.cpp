@@ -24,184 +24,228 @@
 
 #include <crossbow/enum_underlying.hpp>
 
+#include <array>
 #include <map>
 
 #include <common/dimension-tables-unique-values.h>
 #include "Connection.hpp"
+#include "GroupBy.hpp"
+#include "Sampling.hpp"
 
 namespace aim {
 
 using namespace tell::db;
 using namespace tell::store;
 
-Q3Out Transactions::q3Transaction(Transaction& tx, Context &context)
+namespace {
+
+/*
+ * Almost all values of callsSumAllWeek are in [0, 10): the groups 0 to 9 are
+ * aggregated by TellStore in one aggregation scan each, only the tuples of
+ * the rare groups >= 10 are projected and grouped on the server.
+ */
+struct Q3Plan : QueryPlan {
+    ScanPlan aggregation;
+    size_t aggregationCalls;
+    size_t aggregationEpoch;
+    size_t aggregationSample;
+    uint32_t costOffset;
+    uint32_t durOffset;
+
+    GroupByScan groupBy;
+    size_t costSumAllWeek;
+    size_t durSumAllWeek;
+    ScanPlan projection;
+    size_t projectionCalls;
+    size_t projectionEpoch;
+    size_t projectionSample;
+
+    Q3Plan(Context &context, bool sampled)
+        : aggregation(ScanQueryType::AGGREGATION, sampled ? 72 : 48, 8)
+        , aggregationSample(0)
+        , groupBy(context.callsSumAllWeek, FieldType::INT)
+        , costSumAllWeek(groupBy.add(AggregationType::SUM, context.costSumAllWeek, FieldType::DOUBLE))
+        , durSumAllWeek(groupBy.add(AggregationType::SUM, context.durSumAllWeek, FieldType::BIGINT))
+        , projection(ScanQueryType::PROJECTION, sampled ? 72 : 48, groupBy.projectionLength())
+        , projectionSample(0)
+    {}
+};
+
+/*
+ * Writes the selection callsSumAllWeek <type> calls of the current week
+ * (and the sample predicate) and returns the slot of calls.
+ */
+size_t writeSelection(ScanPlan& scan, Context& context, PredicateType type, bool sampled,
+        size_t& epoch, size_t& sample) {
+    crossbow::buffer_writer selectionWriter(scan.selection(), scan.selectionLength());
+    selectionWriter.write<uint32_t>(sampled ? 0x3u : 0x2u);
+    selectionWriter.write<uint16_t>(sampled ? 0x4u : 0x2u);
+    selectionWriter.write<uint16_t>(0x0u);
+    selectionWriter.write<uint32_t>(0x0u);
+    selectionWriter.write<uint32_t>(0x0u);
+
+    selectionWriter.write<uint16_t>(context.callsSumAllWeek);
+    selectionWriter.write<uint16_t>(0x1u);
+    selectionWriter.set(0, 4);
+    selectionWriter.write<uint8_t>(crossbow::to_underlying(type));
+    selectionWriter.write<uint8_t>(0x0u);
+    selectionWriter.set(0, 2);
+    auto calls = scan.slot(selectionWriter, FieldType::INT);
+    selectionWriter.write<int32_t>(0);
+
+    // ignore subscribers whose values are from an older window: their
+    // attributes count as 0, they belong to group 0 but add nothing to its
+    // sums and group 0 never has a duration to divide by
+    selectionWriter.write<uint16_t>(context.epochWeekAll);
+    selectionWriter.write<uint16_t>(0x1u);
+    selectionWriter.set(0, 4);
+    selectionWriter.write<uint8_t>(crossbow::to_underlying(PredicateType::EQUAL));
+    selectionWriter.write<uint8_t>(0x1u);
+    selectionWriter.set(0, 2);
+    epoch = scan.slot(selectionWriter, FieldType::INT);
+    selectionWriter.write<int32_t>(0);
+
+    if (sampled) {
+        sample = writeSamplePredicate(selectionWriter, scan, context, 0x2u);
+    }
+    return calls;
+}
+
+std::unique_ptr<Q3Plan> compile(Transaction& tx, Context &context, bool sampled)
 {
-    Q3Out result;
-
-    try {
-        auto schema = tx.getSchema(context.wideTable);
-
-        // idea: we have to group by callsSumAllWeek
-        // --> allmost all values in [0,10) --> create 10 parallel aggregations
-        // for values 0, 1, ...., 9
-        // create a projection on >= 10 and aggregate manually
-
-        uint32_t selectionLength = 32;
-        std::unique_ptr<char[]> selection(new char[selectionLength]);
-
-        crossbow::buffer_writer selectionWriter(selection.get(), selectionLength);
-        selectionWriter.write<uint32_t>(0x1u);
-        selectionWriter.write<uint16_t>(0x1u);
-        selectionWriter.write<uint16_t>(0x0u);
-        selectionWriter.write<uint32_t>(0x0u);
-        selectionWriter.write<uint32_t>(0x0u);
-
-        selectionWriter.write<uint16_t>(context.callsSumAllWeek);
-        selectionWriter.write<uint16_t>(0x1u);
-        selectionWriter.set(0, 4);
-
-        auto predicatePtr = selectionWriter.data();
-        selectionWriter.write<uint8_t>(crossbow::to_underlying(PredicateType::EQUAL));
-        selectionWriter.write<uint8_t>(0x0u);
-        selectionWriter.set(0, 2);
-        auto valuePtr = selectionWriter.data();
-        selectionWriter.write<int32_t>(0);      // we are going to vary this
-
-        // sort projection attributes
-        std::map<id_t, std::tuple<AggregationType, FieldType,
-                crossbow::string>> projectionAttributes;
-        projectionAttributes[context.costSumAllWeek] = std::make_tuple(
-                AggregationType::SUM, FieldType::DOUBLE, "cost_sum_all_week");
-        projectionAttributes[context.durSumAllWeek] = std::make_tuple(
-                AggregationType::SUM, FieldType::BIGINT, "dur_sum_all_week");
-
-        Schema resultSchema(schema.type());
-
-        uint32_t aggregationLength = 4 * projectionAttributes.size();
-        std::unique_ptr<char[]> aggregation(new char[aggregationLength]);
-
-        crossbow::buffer_writer aggregationWriter(aggregation.get(), aggregationLength);
-        for (auto &attribute : projectionAttributes) {
-            aggregationWriter.write<uint16_t>(attribute.first);
-            aggregationWriter.write<uint16_t>(
-                    crossbow::to_underlying(std::get<0>(attribute.second)));
-            resultSchema.addField(std::get<1>(attribute.second),
-                    std::get<2>(attribute.second), true);
-        }
+    auto schema = tx.getSchema(context.wideTable);
+    std::unique_ptr<Q3Plan> plan(new Q3Plan(context, sampled));
+
+    plan->aggregationCalls = writeSelection(plan->aggregation, context, PredicateType::EQUAL,
+            sampled, plan->aggregationEpoch, plan->aggregationSample);
+
+    // the aggregation program has to be sorted by column id
+    std::map<id_t, std::pair<FieldType, crossbow::string>> aggregationAttributes;
+    aggregationAttributes[context.costSumAllWeek] = std::make_pair(FieldType::DOUBLE, "cost_sum_all_week");
+    aggregationAttributes[context.durSumAllWeek] = std::make_pair(FieldType::BIGINT, "dur_sum_all_week");
+
+    Schema resultSchema(schema.type());
+    crossbow::buffer_writer aggregationWriter(plan->aggregation.query(), plan->aggregation.queryLength());
+    for (auto& attribute : aggregationAttributes) {
+        aggregationWriter.write<uint16_t>(attribute.first);
+        aggregationWriter.write<uint16_t>(crossbow::to_underlying(AggregationType::SUM));
+        resultSchema.addField(attribute.second.first, attribute.second.second, true);
+    }
+    auto resultTable = std::make_shared<Table>(context.wideTable.value, std::move(resultSchema));
+    auto& resultRecord = resultTable->record();
+    Record::id_t field;
+    resultRecord.idOf("cost_sum_all_week", field);
+    plan->costOffset = resultRecord.getFieldMeta(field).offset;
+    resultRecord.idOf("dur_sum_all_week", field);
+    plan->durOffset = resultRecord.getFieldMeta(field).offset;
+    plan->aggregation.setResultTable(std::move(resultTable));
+
+    plan->projectionCalls = writeSelection(plan->projection, context, PredicateType::GREATER_EQUAL,
+            sampled, plan->projectionEpoch, plan->projectionSample);
+    plan->groupBy.prepare(tx, context, plan->projection);
+    return plan;
+}
 
-        Table resultTable(context.wideTable.value, std::move(resultSchema));
-
-        auto &snapshot = tx.snapshot();
-        auto &clientHandle = tx.getHandle();
-        std::vector<std::shared_ptr<ScanIterator>> scanIterators;
-        scanIterators.reserve(11);
-        for (int32_t i = 0; i < 10; ++i)
-        {
-            *(reinterpret_cast<int32_t*>(valuePtr)) = i;
-            scanIterators.push_back(clientHandle.scan(resultTable, snapshot,
-                    *context.scanMemoryMananger, ScanQueryType::AGGREGATION, selectionLength,
-                    selection.get(), aggregationLength, aggregation.get()));
-        }
+struct Q3Sums {
+    double cost = 0.0;
+    int64_t dur = 0;
+};
 
-        // projection on rest
-        *(reinterpret_cast<uint8_t*>(predicatePtr)) =
-                crossbow::to_underlying(PredicateType::GREATER_EQUAL);
-        *(reinterpret_cast<int32_t*>(valuePtr)) = 10;
+/*
+ * The sums of the groups below 10 and the grouped projection of the other
+ * groups, for every replicate of the sample.
+ */
+struct Q3State {
+    std::vector<std::array<Q3Sums, 10>> aggregated;
+    std::vector<std::shared_ptr<GroupByScan>> grouped;
+};
 
-        // add one more projection attributes for the non-aggregation scan
-        projectionAttributes[context.callsSumAllWeek] = std::make_tuple(
-                AggregationType::SUM, FieldType::INT, "calls_sum_all_week");
-        uint32_t projectionLength = 2*projectionAttributes.size();
-        std::unique_ptr<char[]> projection(new char[projectionLength]);
+} // anonymous namespace
 
-        Schema projectionResultSchema(schema.type());
+Query<Q3Out> Transactions::q3Query(Transaction& tx, Context &context, const Q3In& in)
+{
+    bool sampled = isApproximate(in.sample_permille);
+    auto& plan = context.plans.get<Q3Plan>(Command::Q3, sampled, [&tx, &context, sampled]() {
+        return compile(tx, context, sampled);
+    });
+
+    auto weekEpoch = Window(WindowType::TUMB, WindowLength::WEEK).epochOf(now());
+    auto replicates = sampleReplicates(in.sample_permille);
+    auto state = std::make_shared<Q3State>();
+    state->aggregated.resize(replicates);
+    auto costOffset = plan.costOffset;
+    auto durOffset = plan.durOffset;
+    auto p = &plan;     // plans live as long as the context
+
+    Query<Q3Out> query;
+    for (unsigned r = 0; r < replicates; ++r) {
+        std::vector<int64_t> values(plan.aggregation.slots());
+        values[plan.aggregationEpoch] = weekEpoch;
+        if (sampled) {
+            bindReplicate(values, plan.aggregationSample, in.sample_permille, r);
+        }
+        for (int32_t i = 0; i < 10; ++i) {
+            values[plan.aggregationCalls] = i;
+            query.scans.push_back(plan.aggregation.bind(values,
+                    [state, r, i, costOffset, durOffset](const char* tuple) {
+                auto& sums = state->aggregated[r][i];
+                sums.cost = *reinterpret_cast<const double*>(tuple + costOffset);
+                sums.dur = *reinterpret_cast<const int64_t*>(tuple + durOffset);
+            }));
+        }
 
-        crossbow::buffer_writer projectionWriter(projection.get(), projectionLength);
-        for (auto &attribute : projectionAttributes) {
-            projectionWriter.write<uint16_t>(attribute.first);
-            projectionResultSchema.addField(std::get<1>(attribute.second),
-                    std::get<2>(attribute.second), true);
+        std::vector<int64_t> projectionValues(plan.projection.slots());
+        projectionValues[plan.projectionCalls] = 10;
+        projectionValues[plan.projectionEpoch] = weekEpoch;
+        if (sampled) {
+            bindReplicate(projectionValues, plan.projectionSample, in.sample_permille, r);
         }
+        state->grouped.push_back(std::make_shared<GroupByScan>(plan.groupBy));
+        query.scans.push_back(state->grouped.back()->request(plan.projection, projectionValues));
+    }
 
-        Table projectionResultTable(context.wideTable.value, std::move(projectionResultSchema));
-
-        // run the rest-projection scan
-        scanIterators.push_back(clientHandle.scan(projectionResultTable, snapshot,
-                *context.scanMemoryMananger, ScanQueryType::PROJECTION, selectionLength,
-                selection.get(), projectionLength, projection.get()));
-
-        // process results from aggregations
-        for (int32_t i = 0; i < 10; ++i)
-        {
-            auto &scanIterator = scanIterators[i];
-            if (scanIterator->hasNext()) {
-                const char* tuple;
-                size_t tupleLength;
-                std::tie(std::ignore, tuple, tupleLength) = scanIterator->next();
-                double costSumAllWeek = resultTable.field<double>(
-                        "cost_sum_all_week", tuple);
-                int64_t durSumAllWeek = resultTable.field<int64_t>(
-                        "dur_sum_all_week", tuple);
-                if (durSumAllWeek > 0) {
-                    Q3Out::Q3Tuple q3Tuple;
-                    q3Tuple.number_of_calls_this_week = i;
-                    q3Tuple.cost_ratio = costSumAllWeek / durSumAllWeek;
-                    result.results.push_back(std::move(q3Tuple));
-                }
+    auto rate = sampleRate(in.sample_permille);
+    query.finish = [state, replicates, sampled, rate, p]() {
+        // the sums of every group per replicate, ordered by the number of calls
+        std::map<int64_t, std::vector<Q3Sums>> groups;
+        for (unsigned r = 0; r < replicates; ++r) {
+            for (int64_t i = 0; i < 10; ++i) {
+                auto& sums = groups[i];
+                sums.resize(replicates);
+                sums[r] = state->aggregated[r][i];
+            }
+            for (auto& group : state->grouped[r]->groups()) {
+                auto& sums = groups[group.first];
+                sums.resize(replicates);
+                sums[r].cost = group.second[p->costSumAllWeek].real;
+                sums[r].dur = group.second[p->durSumAllWeek].integer;
             }
         }
 
-        // process rest query (in a proper scope)
-        {
-            auto &scanIterator = scanIterators[10];
-            std::map<uint32_t, double> costs;
-            std::map<uint32_t, int64_t> durations;
-            while (scanIterator->hasNext()) {
-                const char* tuple;
-                size_t tupleLength;
-                std::tie(std::ignore, tuple, tupleLength) = scanIterator->next();
-                double costSumAllWeek = projectionResultTable.field<double>(
-                        "cost_sum_all_week", tuple);
-                int64_t durSumAllWeek = projectionResultTable.field<int64_t>(
-                        "dur_sum_all_week", tuple);
-                int32_t callsSumAllWeek  = projectionResultTable.field<int32_t>(
-                            "calls_sum_all_week", tuple);
-                if (costs.find(callsSumAllWeek) == costs.end()) {
-                    // entry does not exists yet, create it
-                    costs[callsSumAllWeek] = 0.0;
-                    durations[callsSumAllWeek] = 0;
-                }
-                costs[callsSumAllWeek] += costSumAllWeek;
-                durations[callsSumAllWeek] += durSumAllWeek;
-
-                for (auto &costEntry : costs) {
-                    Q3Out::Q3Tuple q3Tuple;
-                    q3Tuple.number_of_calls_this_week = costEntry.first;
-                    q3Tuple.cost_ratio = costEntry.second
-                            / durations[costEntry.first];
-                    result.results.push_back(std::move(q3Tuple));
+        Q3Out result;
+        for (auto& group : groups) {
+            Q3Sums total;
+            std::vector<double> ratios;
+            for (auto& sums : group.second) {
+                total.cost += sums.cost;
+                total.dur += sums.dur;
+                if (sums.dur > 0) {
+                    ratios.push_back(sums.cost / sums.dur);
                 }
             }
-        }
-
-        result.success = true;
-        tx.commit();
-
-        for (auto &scanIterator: scanIterators) {
-            if (scanIterator->error()) {
-                result.error = crossbow::to_string(scanIterator->error().value());
-                result.success = false;
-                return result;
+            if (total.dur > 0) {
+                Q3Out::Q3Tuple q3Tuple;
+                q3Tuple.number_of_calls_this_week = group.first;
+                q3Tuple.cost_ratio = total.cost / total.dur;
+                if (sampled) {
+                    q3Tuple.cost_ratio_error = replicateError(q3Tuple.cost_ratio, ratios, rate);
+                }
+                result.results.push_back(std::move(q3Tuple));
             }
-
         }
-    } catch (std::exception& ex) {
-        result.success = false;
-        result.error = ex.what();
-    }
-
-    return result;
+        return result;
+    };
+    return query;
 }
 
 } // namespace aim
-
@@ -24,144 +24,205 @@
 
 #include <crossbow/enum_underlying.hpp>
 
-#include <map>
-
 #include <common/dimension-tables-unique-values.h>
 #include "Connection.hpp"
+#include "Sampling.hpp"
 
 namespace aim {
 
 using namespace tell::db;
 using namespace tell::store;
 
-Q4Out Transactions::q4Transaction(Transaction& tx, Context &context, const Q4In& in)
+namespace {
+
+struct Q4Plan : QueryPlan {
+    ScanPlan scan;
+    size_t city;
+    size_t alpha;
+    size_t beta;
+    size_t weekEpoch;
+    size_t sample;
+    uint32_t sumOffset;
+    uint32_t cntOffset;
+    uint32_t durOffset;
+
+    Q4Plan(bool sampled)
+        : scan(ScanQueryType::AGGREGATION, sampled ? 112 : 88, 12)
+        , sample(0)
+    {}
+};
+
+std::unique_ptr<Q4Plan> compile(Transaction& tx, Context &context, bool sampled)
 {
-    Q4Out result;
-
-    try {
-        auto schema = tx.getSchema(context.wideTable);
-
-        // idea: we have to group by cityName
-        // 5 different unique values
-        // aggregate them all in separate scans
-
-        uint32_t selectionLength = 72;
-        std::unique_ptr<char[]> selection(new char[selectionLength]);
-
-        crossbow::buffer_writer selectionWriter(selection.get(), selectionLength);
-        selectionWriter.write<uint32_t>(0x3u);
-        selectionWriter.write<uint16_t>(0x3u);
-        selectionWriter.write<uint16_t>(0x0u);
-        selectionWriter.write<uint32_t>(0x0u);
-        selectionWriter.write<uint32_t>(0x0u);
-
-        selectionWriter.write<uint16_t>(context.regionCity);
-        selectionWriter.write<uint16_t>(0x1u);
-        selectionWriter.set(0, 4);
-        selectionWriter.write<uint8_t>(crossbow::to_underlying(PredicateType::EQUAL));
-        selectionWriter.write<uint8_t>(0x0u);
-        selectionWriter.set(0, 2);
-        const auto varyPtr = reinterpret_cast<int32_t*>(selectionWriter.data());
-        selectionWriter.write<int32_t>(0);                // we are going to vary this
-
-        selectionWriter.write<uint16_t>(context.callsSumLocalWeek);
-        selectionWriter.write<uint16_t>(0x1u);
-        selectionWriter.set(0, 4);
-        selectionWriter.write<uint8_t>(crossbow::to_underlying(PredicateType::GREATER));
-        selectionWriter.write<uint8_t>(0x1u);
-        selectionWriter.set(0, 2);
-        selectionWriter.write<int32_t>(in.alpha);
-
-        selectionWriter.write<uint16_t>(context.durSumLocalWeek);
-        selectionWriter.write<uint16_t>(0x1u);
-        selectionWriter.set(0, 4);
-        selectionWriter.write<uint8_t>(crossbow::to_underlying(PredicateType::GREATER));
-        selectionWriter.write<uint8_t>(0x2u);
-        selectionWriter.set(0, 6);
-        selectionWriter.write<int64_t>(in.beta);
-
-
-        // sort aggregation attributes
-        std::array<std::tuple<id_t, AggregationType, FieldType, crossbow::string>, 3> aggregationAttributes = {{
-                std::make_tuple(context.callsSumLocalWeek, AggregationType::SUM, FieldType::BIGINT,
-                        "sum_calls_sum_local_week"),
-                std::make_tuple(context.callsSumLocalWeek, AggregationType::CNT, FieldType::BIGINT,
-                        "cnt_calls_sum_local_week"),
-                std::make_tuple(context.durSumLocalWeek, AggregationType::SUM, FieldType::BIGINT,
-                "dur_sum_local_week")
-        }};
-
-        Schema resultSchema(schema.type());
-
-        uint32_t aggregationLength = 4 * aggregationAttributes.size();
-        std::unique_ptr<char[]> aggregation(new char[aggregationLength]);
-
-        crossbow::buffer_writer aggregationWriter(aggregation.get(), aggregationLength);
-        for (auto &attribute : aggregationAttributes) {
-            aggregationWriter.write<uint16_t>(std::get<0>(attribute));
-            aggregationWriter.write<uint16_t>(crossbow::to_underlying(std::get<1>(attribute)));
-            resultSchema.addField(std::get<2>(attribute), std::get<3>(attribute), true);
-        }
+    // idea: we have to group by cityName
+    // 5 different unique values
+    // aggregate them all in separate scans, TellStore serves them in one pass
+    auto schema = tx.getSchema(context.wideTable);
+    std::unique_ptr<Q4Plan> plan(new Q4Plan(sampled));
+
+    crossbow::buffer_writer selectionWriter(plan->scan.selection(), plan->scan.selectionLength());
+    selectionWriter.write<uint32_t>(sampled ? 0x5u : 0x4u);
+    selectionWriter.write<uint16_t>(sampled ? 0x6u : 0x4u);
+    selectionWriter.write<uint16_t>(0x0u);
+    selectionWriter.write<uint32_t>(0x0u);
+    selectionWriter.write<uint32_t>(0x0u);
+
+    selectionWriter.write<uint16_t>(context.regionCity);
+    selectionWriter.write<uint16_t>(0x1u);
+    selectionWriter.set(0, 4);
+    selectionWriter.write<uint8_t>(crossbow::to_underlying(PredicateType::EQUAL));
+    selectionWriter.write<uint8_t>(0x0u);
+    plan->city = plan->scan.slot(selectionWriter, FieldType::SMALLINT);
+    selectionWriter.write<int16_t>(0);
+    selectionWriter.set(0, 4);
+
+    selectionWriter.write<uint16_t>(context.callsSumLocalWeek);
+    selectionWriter.write<uint16_t>(0x1u);
+    selectionWriter.set(0, 4);
+    selectionWriter.write<uint8_t>(crossbow::to_underlying(PredicateType::GREATER));
+    selectionWriter.write<uint8_t>(0x1u);
+    selectionWriter.set(0, 2);
+    plan->alpha = plan->scan.slot(selectionWriter, FieldType::INT);
+    selectionWriter.write<int32_t>(0);
+
+    selectionWriter.write<uint16_t>(context.durSumLocalWeek);
+    selectionWriter.write<uint16_t>(0x1u);
+    selectionWriter.set(0, 4);
+    selectionWriter.write<uint8_t>(crossbow::to_underlying(PredicateType::GREATER));
+    selectionWriter.write<uint8_t>(0x2u);
+    selectionWriter.set(0, 6);
+    plan->beta = plan->scan.slot(selectionWriter, FieldType::BIGINT);
+    selectionWriter.write<int64_t>(0);
+
+    // ignore subscribers whose values are from an older window
+    selectionWriter.write<uint16_t>(context.epochWeekLocal);
+    selectionWriter.write<uint16_t>(0x1u);
+    selectionWriter.set(0, 4);
+    selectionWriter.write<uint8_t>(crossbow::to_underlying(PredicateType::EQUAL));
+    selectionWriter.write<uint8_t>(0x3u);
+    selectionWriter.set(0, 2);
+    plan->weekEpoch = plan->scan.slot(selectionWriter, FieldType::INT);
+    selectionWriter.write<int32_t>(0);
+
+    if (sampled) {
+        plan->sample = writeSamplePredicate(selectionWriter, plan->scan, context, 0x4u);
+    }
 
-        Table resultTable(context.wideTable.value, std::move(resultSchema));
+    crossbow::buffer_writer aggregationWriter(plan->scan.query(), plan->scan.queryLength());
+    aggregationWriter.write<uint16_t>(context.callsSumLocalWeek);
+    aggregationWriter.write<uint16_t>(crossbow::to_underlying(AggregationType::SUM));
+    aggregationWriter.write<uint16_t>(context.callsSumLocalWeek);
+    aggregationWriter.write<uint16_t>(crossbow::to_underlying(AggregationType::CNT));
+    aggregationWriter.write<uint16_t>(context.durSumLocalWeek);
+    aggregationWriter.write<uint16_t>(crossbow::to_underlying(AggregationType::SUM));
+
+    Schema resultSchema(schema.type());
+    resultSchema.addField(FieldType::BIGINT, "sum_calls_sum_local_week", true);
+    resultSchema.addField(FieldType::BIGINT, "cnt_calls_sum_local_week", true);
+    resultSchema.addField(FieldType::BIGINT, "dur_sum_local_week", true);
+    auto resultTable = std::make_shared<Table>(context.wideTable.value, std::move(resultSchema));
+    auto& resultRecord = resultTable->record();
+    Record::id_t field;
+    resultRecord.idOf("sum_calls_sum_local_week", field);
+    plan->sumOffset = resultRecord.getFieldMeta(field).offset;
+    resultRecord.idOf("cnt_calls_sum_local_week", field);
+    plan->cntOffset = resultRecord.getFieldMeta(field).offset;
+    resultRecord.idOf("dur_sum_local_week", field);
+    plan->durOffset = resultRecord.getFieldMeta(field).offset;
+    plan->scan.setResultTable(std::move(resultTable));
+    return plan;
+}
 
-        auto &snapshot = tx.snapshot();
-        auto &clientHandle = tx.getHandle();
-        std::vector<std::shared_ptr<ScanIterator>> scanIterators;
-        uint16_t numberOfCities = region_unique_city.size();
-        scanIterators.reserve(numberOfCities);
-        for (int16_t i = 0; i < numberOfCities; ++i)
-        {
-            *varyPtr = i;
-            scanIterators.push_back(clientHandle.scan(resultTable, snapshot,
-                    *context.scanMemoryMananger, ScanQueryType::AGGREGATION, selectionLength,
-                    selection.get(), aggregationLength, aggregation.get()));
+struct Q4Sums {
+    int64_t sum = 0;
+    int64_t cnt = 0;
+    int64_t dur = 0;
+};
+
+/*
+ * The sums of every city for every replicate of the sample.
+ */
+struct Q4State {
+    std::vector<std::vector<Q4Sums>> sums;
+    std::vector<double> rates;
+};
+
+} // anonymous namespace
+
+Query<Q4Out> Transactions::q4Query(Transaction& tx, Context &context, const Q4In& in)
+{
+    bool sampled = isApproximate(in.sample_permille);
+    auto& plan = context.plans.get<Q4Plan>(Command::Q4, sampled, [&tx, &context, sampled]() {
+        return compile(tx, context, sampled);
+    });
+
+    std::vector<int64_t> values(plan.scan.slots());
+    values[plan.alpha] = in.alpha;
+    values[plan.beta] = in.beta;
+    values[plan.weekEpoch] = Window(WindowType::TUMB, WindowLength::WEEK).epochOf(now());
+
+    uint16_t numberOfCities = region_unique_city.size();
+    auto replicates = sampleReplicates(in.sample_permille);
+    auto state = std::make_shared<Q4State>();
+    state->sums.assign(replicates, std::vector<Q4Sums>(numberOfCities));
+    state->rates.assign(replicates, 1.0);
+    auto sumOffset = plan.sumOffset;
+    auto cntOffset = plan.cntOffset;
+    auto durOffset = plan.durOffset;
+
+    Query<Q4Out> query;
+    for (unsigned r = 0; r < replicates; ++r) {
+        if (sampled) {
+            state->rates[r] = bindReplicate(values, plan.sample, in.sample_permille, r);
         }
+        for (uint16_t i = 0; i < numberOfCities; ++i) {
+            values[plan.city] = i;
+            query.scans.push_back(plan.scan.bind(values,
+                    [state, r, i, sumOffset, cntOffset, durOffset](const char* tuple) {
+                auto& sums = state->sums[r][i];
+                sums.sum = *reinterpret_cast<const int64_t*>(tuple + sumOffset);
+                sums.cnt = *reinterpret_cast<const int64_t*>(tuple + cntOffset);
+                sums.dur = *reinterpret_cast<const int64_t*>(tuple + durOffset);
+            }));
+        }
+    }
 
-        // process results from aggregations
-        for (int16_t i = 0; i < numberOfCities; ++i)
+    auto rate = sampled ? sampleRate(in.sample_permille) : 1.0;
+    query.finish = [state, numberOfCities, sampled, rate]() {
+        Q4Out result;
+        for (uint16_t i = 0; i < numberOfCities; ++i)
         {
-            auto &scanIterator = scanIterators[i];
-            if (scanIterator->hasNext()) {
-                const char* tuple;
-                size_t tupleLength;
-                std::tie(std::ignore, tuple, tupleLength) = scanIterator->next();
-                auto sumCallsSumLocalWeek = resultTable.field<int64_t>(
-                        "sum_calls_sum_local_week", tuple);
-                auto cntCallsSumLocalWeek = resultTable.field<int64_t>(
-                        "cnt_calls_sum_local_week", tuple);
-                auto durSumLocalWeek = resultTable.field<int64_t>(
-                        "dur_sum_local_week", tuple);
-                if (cntCallsSumLocalWeek > 0) {
-                    Q4Out::Q4Tuple q4Tuple;
-                    q4Tuple.city_name = region_unique_city[i];
-                    q4Tuple.avg_num_local_calls_week =
-                            static_cast<double>(sumCallsSumLocalWeek)
-                                    / cntCallsSumLocalWeek;
-                    q4Tuple.sum_duration_local_calls_week = durSumLocalWeek;
-                    result.results.push_back(std::move(q4Tuple));
+            Q4Sums total;
+            std::vector<double> averages;
+            std::vector<double> durations;
+            for (size_t r = 0; r < state->sums.size(); ++r) {
+                auto& sums = state->sums[r][i];
+                total.sum += sums.sum;
+                total.cnt += sums.cnt;
+                total.dur += sums.dur;
+                if (sums.cnt > 0) {
+                    averages.push_back(static_cast<double>(sums.sum) / sums.cnt);
                 }
+                durations.push_back(sums.dur / state->rates[r]);
             }
-        }
-
-        result.success = true;
-        tx.commit();
-
-        for (auto &scanIterator: scanIterators) {
-            if (scanIterator->error()) {
-                result.error = crossbow::to_string(scanIterator->error().value());
-                result.success = false;
-                return result;
+            if (total.cnt > 0) {
+                Q4Out::Q4Tuple q4Tuple;
+                q4Tuple.city_name = region_unique_city[i];
+                q4Tuple.avg_num_local_calls_week = static_cast<double>(total.sum) / total.cnt;
+                // the sum is scaled up to the whole table
+                q4Tuple.sum_duration_local_calls_week = total.dur / rate;
+                if (sampled) {
+                    q4Tuple.avg_num_local_calls_week_error = replicateError(
+                            q4Tuple.avg_num_local_calls_week, averages, rate);
+                    q4Tuple.sum_duration_local_calls_week_error = replicateError(
+                            total.dur / rate, durations, rate);
+                }
+                result.results.push_back(std::move(q4Tuple));
             }
-
         }
-    } catch (std::exception& ex) {
-        result.success = false;
-        result.error = ex.what();
-    }
-
-    return result;
+        return result;
+    };
+    return query;
 }
 
 } // namespace aim
-
@@ -24,139 +24,210 @@
 
 #include <crossbow/enum_underlying.hpp>
 
-#include <map>
-
 #include <common/dimension-tables-unique-values.h>
 #include "Connection.hpp"
+#include "Sampling.hpp"
 
 namespace aim {
 
 using namespace tell::db;
 using namespace tell::store;
 
-Q5Out Transactions::q5Transaction(Transaction& tx, Context &context, const Q5In& in)
+namespace {
+
+/*
+ * Local and long distance costs are valid in different windows: each of
+ * them is summed by its own aggregation scan, which ignores the subscribers
+ * whose window of it is older.
+ */
+struct WindowSumPlan {
+    ScanPlan scan;
+    size_t subType;
+    size_t subCategory;
+    size_t region;
+    size_t weekEpoch;
+    size_t sample;
+    uint32_t sumOffset;
+
+    WindowSumPlan(bool sampled)
+        : scan(ScanQueryType::AGGREGATION, sampled ? 104 : 80, 4)
+        , sample(0)
+    {}
+};
+
+struct Q5Plan : QueryPlan {
+    WindowSumPlan local;
+    WindowSumPlan distant;
+
+    Q5Plan(bool sampled)
+        : local(sampled)
+        , distant(sampled)
+    {}
+};
+
+void compile(Transaction& tx, Context &context, bool sampled, id_t column, id_t epochColumn,
+        WindowSumPlan& plan)
 {
-    Q5Out result;
-
-    try {
-        auto schema = tx.getSchema(context.wideTable);
-
-        // idea: we have to group by cityName
-        // 5 different unique values
-        // aggregate them all in separate scans
-
-        uint32_t selectionLength = 64;
-        std::unique_ptr<char[]> selection(new char[selectionLength]);
-
-        crossbow::buffer_writer selectionWriter(selection.get(), selectionLength);
-        selectionWriter.write<uint32_t>(0x3u);
-        selectionWriter.write<uint16_t>(0x3u);
-        selectionWriter.write<uint16_t>(0x0u);
-        selectionWriter.write<uint32_t>(0x0u);
-        selectionWriter.write<uint32_t>(0x0u);
-
-        selectionWriter.write<uint16_t>(context.regionRegion);
-        selectionWriter.write<uint16_t>(0x1u);
-        selectionWriter.set(0, 4);
-        selectionWriter.write<uint8_t>(crossbow::to_underlying(PredicateType::EQUAL));
-        selectionWriter.write<uint8_t>(0x0u);
-        selectionWriter.set(0, 2);
-        auto valuePtr = selectionWriter.data();
-        selectionWriter.write<int32_t>(0);                // we are going to vary this
-
-        selectionWriter.write<uint16_t>(context.subscriptionTypeId);
-        selectionWriter.write<uint16_t>(0x1u);
-        selectionWriter.set(0, 4);
-        selectionWriter.write<uint8_t>(crossbow::to_underlying(PredicateType::EQUAL));
-        selectionWriter.write<uint8_t>(0x1u);
-        selectionWriter.write<int16_t>(in.sub_type);
-        selectionWriter.set(0, 4);
-
-        selectionWriter.write<uint16_t>(context.categoryId);
-        selectionWriter.write<uint16_t>(0x1u);
-        selectionWriter.set(0, 4);
-        selectionWriter.write<uint8_t>(crossbow::to_underlying(PredicateType::EQUAL));
-        selectionWriter.write<uint8_t>(0x2u);
-        selectionWriter.write<int16_t>(in.sub_category);
-        selectionWriter.set(0, 4);
-
-        // sort aggregation attributes
-        std::map<id_t, std::tuple<AggregationType, FieldType,
-                crossbow::string>> aggregationAttributes;
-        aggregationAttributes[context.costSumLocalWeek] = std::make_tuple(
-                AggregationType::SUM, FieldType::DOUBLE, "sum_cost_sum_local_week");
-        aggregationAttributes[context.costSumDistantWeek] = std::make_tuple(
-                AggregationType::SUM, FieldType::DOUBLE, "sum_cost_sum_distant_week");
-
-        Schema resultSchema(schema.type());
-
-        uint32_t aggregationLength = 4 * aggregationAttributes.size();
-        std::unique_ptr<char[]> aggregation(new char[aggregationLength]);
-
-        crossbow::buffer_writer aggregationWriter(aggregation.get(), aggregationLength);
-        for (auto &attribute : aggregationAttributes) {
-            aggregationWriter.write<uint16_t>(attribute.first);
-            aggregationWriter.write<uint16_t>(
-                    crossbow::to_underlying(std::get<0>(attribute.second)));
-            resultSchema.addField(std::get<1>(attribute.second),
-                    std::get<2>(attribute.second), true);
-        }
+    auto schema = tx.getSchema(context.wideTable);
+
+    crossbow::buffer_writer selectionWriter(plan.scan.selection(), plan.scan.selectionLength());
+    selectionWriter.write<uint32_t>(sampled ? 0x5u : 0x4u);
+    selectionWriter.write<uint16_t>(sampled ? 0x6u : 0x4u);
+    selectionWriter.write<uint16_t>(0x0u);
+    selectionWriter.write<uint32_t>(0x0u);
+    selectionWriter.write<uint32_t>(0x0u);
+
+    selectionWriter.write<uint16_t>(context.subscriptionTypeId);
+    selectionWriter.write<uint16_t>(0x1u);
+    selectionWriter.set(0, 4);
+    selectionWriter.write<uint8_t>(crossbow::to_underlying(PredicateType::EQUAL));
+    selectionWriter.write<uint8_t>(0x0u);
+    plan.subType = plan.scan.slot(selectionWriter, FieldType::SMALLINT);
+    selectionWriter.write<int16_t>(0);
+    selectionWriter.set(0, 4);
+
+    selectionWriter.write<uint16_t>(context.categoryId);
+    selectionWriter.write<uint16_t>(0x1u);
+    selectionWriter.set(0, 4);
+    selectionWriter.write<uint8_t>(crossbow::to_underlying(PredicateType::EQUAL));
+    selectionWriter.write<uint8_t>(0x1u);
+    plan.subCategory = plan.scan.slot(selectionWriter, FieldType::SMALLINT);
+    selectionWriter.write<int16_t>(0);
+    selectionWriter.set(0, 4);
+
+    selectionWriter.write<uint16_t>(context.regionRegion);
+    selectionWriter.write<uint16_t>(0x1u);
+    selectionWriter.set(0, 4);
+    selectionWriter.write<uint8_t>(crossbow::to_underlying(PredicateType::EQUAL));
+    selectionWriter.write<uint8_t>(0x2u);
+    plan.region = plan.scan.slot(selectionWriter, FieldType::SMALLINT);
+    selectionWriter.write<int16_t>(0);
+    selectionWriter.set(0, 4);
+
+    selectionWriter.write<uint16_t>(epochColumn);
+    selectionWriter.write<uint16_t>(0x1u);
+    selectionWriter.set(0, 4);
+    selectionWriter.write<uint8_t>(crossbow::to_underlying(PredicateType::EQUAL));
+    selectionWriter.write<uint8_t>(0x3u);
+    selectionWriter.set(0, 2);
+    plan.weekEpoch = plan.scan.slot(selectionWriter, FieldType::INT);
+    selectionWriter.write<int32_t>(0);
+
+    if (sampled) {
+        plan.sample = writeSamplePredicate(selectionWriter, plan.scan, context, 0x4u);
+    }
 
-        Table resultTable(context.wideTable.value, std::move(resultSchema));
+    crossbow::buffer_writer aggregationWriter(plan.scan.query(), plan.scan.queryLength());
+    aggregationWriter.write<uint16_t>(column);
+    aggregationWriter.write<uint16_t>(crossbow::to_underlying(AggregationType::SUM));
+
+    Schema resultSchema(schema.type());
+    resultSchema.addField(FieldType::DOUBLE, "sum", true);
+    auto resultTable = std::make_shared<Table>(context.wideTable.value, std::move(resultSchema));
+    auto& resultRecord = resultTable->record();
+    Record::id_t field;
+    resultRecord.idOf("sum", field);
+    plan.sumOffset = resultRecord.getFieldMeta(field).offset;
+    plan.scan.setResultTable(std::move(resultTable));
+}
 
-        auto &snapshot = tx.snapshot();
-        auto &clientHandle = tx.getHandle();
-        std::vector<std::shared_ptr<ScanIterator>> scanIterators;
-        uint16_t numberOfRegions = region_unique_region.size();
-        scanIterators.reserve(numberOfRegions);
-        for (int16_t i = 0; i < numberOfRegions; ++i)
-        {
-            *(reinterpret_cast<int32_t*>(valuePtr)) = i;
-            scanIterators.push_back(clientHandle.scan(resultTable, snapshot,
-                    *context.scanMemoryMananger, ScanQueryType::AGGREGATION, selectionLength,
-                    selection.get(), aggregationLength, aggregation.get()));
-        }
+std::unique_ptr<Q5Plan> compile(Transaction& tx, Context &context, bool sampled)
+{
+    // idea: we have to group by region
+    // 3 different unique values
+    // aggregate them all in separate scans, TellStore serves them in one pass
+    std::unique_ptr<Q5Plan> plan(new Q5Plan(sampled));
+    compile(tx, context, sampled, context.costSumLocalWeek, context.epochWeekLocal, plan->local);
+    compile(tx, context, sampled, context.costSumDistantWeek, context.epochWeekDistant, plan->distant);
+    return plan;
+}
 
-        // process results from aggregations
-        for (int16_t i = 0; i < numberOfRegions; ++i)
-        {
-            auto &scanIterator = scanIterators[i];
-            if (scanIterator->hasNext()) {
-                const char* tuple;
-                size_t tupleLength;
-                std::tie(std::ignore, tuple, tupleLength) = scanIterator->next();
-                double sumCostSumLocalWeek = resultTable.field<double>(
-                        "sum_cost_sum_local_week", tuple);
-                double sumCostSumDistantWeek = resultTable.field<double>(
-                        "sum_cost_sum_distant_week", tuple);
-                if (sumCostSumLocalWeek > 0.0) {
-                    Q5Out::Q5Tuple q5Tuple;
-                    q5Tuple.region_name = region_unique_region[i];
-                    q5Tuple.sum_cost_local_calls_week = sumCostSumLocalWeek;
-                    q5Tuple.sum_cost_longdistance_calls_week = sumCostSumDistantWeek;
-                    result.results.push_back(std::move(q5Tuple));
-                }
-            }
-        }
+struct Q5Sums {
+    double local = 0.0;
+    double distant = 0.0;
+};
+
+/*
+ * The sums of every region for every replicate of the sample.
+ */
+struct Q5State {
+    std::vector<std::vector<Q5Sums>> sums;
+    std::vector<double> rates;
+};
 
-        result.success = true;
-        tx.commit();
+} // anonymous namespace
 
-        for (auto &scanIterator: scanIterators) {
-            if (scanIterator->error()) {
-                result.error = crossbow::to_string(scanIterator->error().value());
-                result.success = false;
-                return result;
+Query<Q5Out> Transactions::q5Query(Transaction& tx, Context &context, const Q5In& in)
+{
+    bool sampled = isApproximate(in.sample_permille);
+    auto& plan = context.plans.get<Q5Plan>(Command::Q5, sampled, [&tx, &context, sampled]() {
+        return compile(tx, context, sampled);
+    });
+
+    auto weekEpoch = Window(WindowType::TUMB, WindowLength::WEEK).epochOf(now());
+    uint16_t numberOfRegions = region_unique_region.size();
+    auto replicates = sampleReplicates(in.sample_permille);
+    auto state = std::make_shared<Q5State>();
+    state->sums.assign(replicates, std::vector<Q5Sums>(numberOfRegions));
+    state->rates.assign(replicates, 1.0);
+
+    Query<Q5Out> query;
+    for (auto window : {&plan.local, &plan.distant}) {
+        bool local = window == &plan.local;
+        auto sumOffset = window->sumOffset;
+        std::vector<int64_t> values(window->scan.slots());
+        values[window->subType] = in.sub_type;
+        values[window->subCategory] = in.sub_category;
+        values[window->weekEpoch] = weekEpoch;
+        for (unsigned r = 0; r < replicates; ++r) {
+            if (sampled) {
+                state->rates[r] = bindReplicate(values, window->sample, in.sample_permille, r);
+            }
+            for (uint16_t i = 0; i < numberOfRegions; ++i) {
+                values[window->region] = i;
+                query.scans.push_back(window->scan.bind(values,
+                        [state, r, i, local, sumOffset](const char* tuple) {
+                    auto sum = *reinterpret_cast<const double*>(tuple + sumOffset);
+                    auto& sums = state->sums[r][i];
+                    (local ? sums.local : sums.distant) = sum;
+                }));
             }
         }
-
-    } catch (std::exception& ex) {
-        result.success = false;
-        result.error = ex.what();
     }
 
-    return result;
+    auto rate = sampled ? sampleRate(in.sample_permille) : 1.0;
+    query.finish = [state, numberOfRegions, sampled, rate]() {
+        Q5Out result;
+        for (uint16_t i = 0; i < numberOfRegions; ++i)
+        {
+            Q5Sums total;
+            std::vector<double> local;
+            std::vector<double> distant;
+            for (size_t r = 0; r < state->sums.size(); ++r) {
+                auto& sums = state->sums[r][i];
+                total.local += sums.local;
+                total.distant += sums.distant;
+                local.push_back(sums.local / state->rates[r]);
+                distant.push_back(sums.distant / state->rates[r]);
+            }
+            if (total.local > 0.0) {
+                Q5Out::Q5Tuple q5Tuple;
+                q5Tuple.region_name = region_unique_region[i];
+                // the sums are scaled up to the whole table
+                q5Tuple.sum_cost_local_calls_week = total.local / rate;
+                q5Tuple.sum_cost_longdistance_calls_week = total.distant / rate;
+                if (sampled) {
+                    q5Tuple.sum_cost_local_calls_week_error = replicateError(
+                            q5Tuple.sum_cost_local_calls_week, local, rate);
+                    q5Tuple.sum_cost_longdistance_calls_week_error = replicateError(
+                            q5Tuple.sum_cost_longdistance_calls_week, distant, rate);
+                }
+                result.results.push_back(std::move(q5Tuple));
+            }
+        }
+        return result;
+    };
+    return query;
 }
 
 } // namespace aim
-
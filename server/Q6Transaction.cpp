@@ -24,193 +24,165 @@
 
 #include <crossbow/enum_underlying.hpp>
 
+#include <array>
 #include <map>
 
 #include <common/dimension-tables-unique-values.h>
 #include "Connection.hpp"
+#include "GroupBy.hpp"
 
 namespace aim {
 
 using namespace tell::db;
 using namespace tell::store;
 
-Q6Out Transactions::q6Transaction(Transaction& tx, Context &context, const Q6In& in)
-{
-    Q6Out result;
-
-    try {
-        auto schema = tx.getSchema(context.wideTable);
-        auto &snapshot = tx.snapshot();
-        auto &clientHandle = tx.getHandle();
-
-        {   // find the minima / maxima
-
-            uint32_t selectionLength = 32;
-            std::unique_ptr<char[]> selection(new char[selectionLength]);
-
-            crossbow::buffer_writer selectionWriter(selection.get(), selectionLength);
-            selectionWriter.write<uint32_t>(0x1u);
-            selectionWriter.write<uint16_t>(0x1u);
-            selectionWriter.write<uint16_t>(0x0u);
-            selectionWriter.write<uint32_t>(0x0u);
-            selectionWriter.write<uint32_t>(0x0u);
-
-            selectionWriter.write<uint16_t>(context.regionCountry);
-            selectionWriter.write<uint16_t>(0x1u);
-            selectionWriter.set(0, 4);
-            selectionWriter.write<uint8_t>(crossbow::to_underlying(PredicateType::EQUAL));
-            selectionWriter.write<uint8_t>(0x0u);
-            selectionWriter.set(0, 2);
-            selectionWriter.write<int32_t>(in.country_id);
-
-            // sort aggregation attributes
-            std::map<id_t, std::tuple<AggregationType, FieldType,
-                    crossbow::string>> aggregationAttributes;
-            aggregationAttributes[context.durMaxLocalWeek] = std::make_tuple(
-                    AggregationType::MAX, FieldType::INT, "max_local_week");
-            aggregationAttributes[context.durMaxLocalDay] = std::make_tuple(
-                    AggregationType::MAX, FieldType::INT, "max_local_day");
-            aggregationAttributes[context.durMaxDistantWeek] = std::make_tuple(
-                    AggregationType::MAX, FieldType::INT, "max_distant_week");
-            aggregationAttributes[context.durMaxDistantDay] = std::make_tuple(
-                    AggregationType::MAX, FieldType::INT, "max_distant_day");
-
-            Schema resultSchema(schema.type());
-
-            uint32_t aggregationLength = 4 * aggregationAttributes.size();
-            std::unique_ptr<char[]> aggregation(new char[aggregationLength]);
-
-            crossbow::buffer_writer aggregationWriter(aggregation.get(), aggregationLength);
-            for (auto &attribute : aggregationAttributes) {
-                aggregationWriter.write<uint16_t>(attribute.first);
-                aggregationWriter.write<uint16_t>(
-                        crossbow::to_underlying(std::get<0>(attribute.second)));
-                resultSchema.addField(std::get<1>(attribute.second),
-                        std::get<2>(attribute.second), true);
-            }
+namespace {
 
-            Table resultTable(context.wideTable.value, std::move(resultSchema));
+struct Q6Plan : QueryPlan {
+    ScanPlan scan;
+    size_t countryId;
+    uint32_t subscriberIdOffset;
+    std::array<uint32_t, 4> maxOffsets;
+    std::array<uint32_t, 4> epochOffsets;
 
-            auto scanIterator = clientHandle.scan(resultTable, snapshot,
-                    *context.scanMemoryMananger, ScanQueryType::AGGREGATION, selectionLength,
-                    selection.get(), aggregationLength, aggregation.get());
-
-            if (scanIterator->hasNext()) {
-                const char* tuple;
-                size_t tupleLength;
-                std::tie(std::ignore, tuple, tupleLength) = scanIterator->next();
-                result.max_local_week = resultTable.field<int32_t>("max_local_week", tuple);
-                result.max_local_day = resultTable.field<int32_t>("max_local_day", tuple);
-                result.max_distant_week = resultTable.field<int32_t>("max_distant_week", tuple);
-                result.max_distant_day = resultTable.field<int32_t>("max_distant_day", tuple);
-            }
-
-            if (scanIterator->error()) {
-                result.error = crossbow::to_string(scanIterator->error().value());
-                result.success = false;
-                return result;
-            }
-        }
+    Q6Plan(uint32_t projectionLength)
+        : scan(ScanQueryType::PROJECTION, 32, projectionLength)
+    {}
+};
 
-        {   // find the corresponding IDs with 4 parallel scans
-
-            uint32_t selectionLength = 32;
-            std::unique_ptr<char[]> selection(new char[selectionLength]);
-
-            crossbow::buffer_writer selectionWriter(selection.get(), selectionLength);
-            selectionWriter.write<uint32_t>(0x1u);
-            selectionWriter.write<uint16_t>(0x1u);
-            selectionWriter.write<uint16_t>(0x0u);
-            selectionWriter.write<uint32_t>(0x0u);
-            selectionWriter.write<uint32_t>(0x0u);
-
-            auto columnPtr = selectionWriter.data();
-            selectionWriter.write<uint16_t>(context.durMaxLocalWeek);   // we are going to vary this
-            selectionWriter.write<uint16_t>(0x1u);
-            selectionWriter.set(0, 4);
-            selectionWriter.write<uint8_t>(crossbow::to_underlying(PredicateType::EQUAL));
-            selectionWriter.write<uint8_t>(0x0u);
-            selectionWriter.set(0, 2);
-            auto valuePtr = selectionWriter.data();
-            selectionWriter.write<int32_t>(result.max_local_week);      // we are going to vary this
-
-            std::vector<std::pair<id_t, int32_t>> selectionValues;
-            selectionValues.reserve(4);
-            selectionValues.emplace_back(context.durMaxLocalWeek, result.max_local_week);
-            selectionValues.emplace_back(context.durMaxLocalDay, result.max_local_day);
-            selectionValues.emplace_back(context.durMaxDistantWeek, result.max_distant_week);
-            selectionValues.emplace_back(context.durMaxDistantDay, result.max_distant_day);
-
-
-            uint32_t aggregationLength = 4;
-            std::unique_ptr<char[]> aggregation(new char[aggregationLength]);
-            crossbow::buffer_writer aggregationWriter(aggregation.get(), aggregationLength);
-            aggregationWriter.write<uint16_t>(context.subscriberId);
-            aggregationWriter.write<uint16_t>(crossbow::to_underlying(AggregationType::MIN));
-
-            Schema resultSchema(schema.type());
-            resultSchema.addField(FieldType::BIGINT, "min_subscriber_id", true);
-            Table resultTable(context.wideTable.value, std::move(resultSchema));
-
-            std::vector<std::shared_ptr<ScanIterator>> scanIterators;
-            scanIterators.reserve(4);
-            for (uint i = 0; i < 4; ++i) {
-                *(reinterpret_cast<int16_t*>(columnPtr)) = selectionValues[i].first;
-                *(reinterpret_cast<int32_t*>(valuePtr)) = selectionValues[i].second;
-                scanIterators.push_back(
-                        clientHandle.scan(resultTable, snapshot,
-                        *context.scanMemoryMananger, ScanQueryType::AGGREGATION, selectionLength,
-                        selection.get(), aggregationLength, aggregation.get()));
-            }
+/*
+ * The four maxima (local week, local day, distant week, distant day) with
+ * the epoch columns of their windows.
+ */
+std::array<std::pair<id_t, id_t>, 4> maxAttributes(Context &context) {
+    return {{
+            std::make_pair(context.durMaxLocalWeek, context.epochWeekLocal),
+            std::make_pair(context.durMaxLocalDay, context.epochDayLocal),
+            std::make_pair(context.durMaxDistantWeek, context.epochWeekDistant),
+            std::make_pair(context.durMaxDistantDay, context.epochDayDistant)
+    }};
+}
 
-            // query the results
-            const char* tuple;
-            size_t tupleLength;
+std::unique_ptr<Q6Plan> compile(Transaction& tx, Context &context)
+{
+    auto schema = tx.getSchema(context.wideTable);
+    auto attributes = maxAttributes(context);
+
+    // sort projection attributes
+    std::map<id_t, std::tuple<FieldType, crossbow::string>> projectionAttributes;
+    projectionAttributes[context.subscriberId] = std::make_tuple(
+            FieldType::BIGINT, "subscriber_id");
+    for (auto &attribute : attributes) {
+        projectionAttributes[attribute.first] = std::make_tuple(
+                FieldType::INT, "max_" + crossbow::to_string(attribute.first));
+        projectionAttributes[attribute.second] = std::make_tuple(
+                FieldType::INT, "epoch_" + crossbow::to_string(attribute.second));
+    }
 
-            auto &scanIterator = scanIterators[0];
-            if (scanIterator->hasNext()) {
-                std::tie(std::ignore, tuple, tupleLength) = scanIterator->next();
-                result.max_local_week_id = resultTable.field<int64_t>("min_subscriber_id", tuple);
-            }
+    std::unique_ptr<Q6Plan> plan(new Q6Plan(sizeof(uint16_t) * projectionAttributes.size()));
+
+    // find the maxima and their (lowest) subscriber ids in one projection scan
+    crossbow::buffer_writer selectionWriter(plan->scan.selection(), plan->scan.selectionLength());
+    selectionWriter.write<uint32_t>(0x1u);
+    selectionWriter.write<uint16_t>(0x1u);
+    selectionWriter.write<uint16_t>(0x0u);
+    selectionWriter.write<uint32_t>(0x0u);
+    selectionWriter.write<uint32_t>(0x0u);
+
+    selectionWriter.write<uint16_t>(context.regionCountry);
+    selectionWriter.write<uint16_t>(0x1u);
+    selectionWriter.set(0, 4);
+    selectionWriter.write<uint8_t>(crossbow::to_underlying(PredicateType::EQUAL));
+    selectionWriter.write<uint8_t>(0x0u);
+    selectionWriter.set(0, 2);
+    plan->countryId = plan->scan.slot(selectionWriter, FieldType::INT);
+    selectionWriter.write<int32_t>(0);
+
+    Schema resultSchema(schema.type());
+
+    crossbow::buffer_writer projectionWriter(plan->scan.query(), plan->scan.queryLength());
+    for (auto &attribute : projectionAttributes) {
+        projectionWriter.write<uint16_t>(attribute.first);
+        resultSchema.addField(std::get<0>(attribute.second),
+                std::get<1>(attribute.second), true);
+    }
 
-            scanIterator = scanIterators[1];
-            if (scanIterator->hasNext()) {
-                std::tie(std::ignore, tuple, tupleLength) = scanIterator->next();
-                result.max_local_day_id = resultTable.field<int64_t>("min_subscriber_id", tuple);
-            }
+    auto resultTable = std::make_shared<Table>(context.wideTable.value, std::move(resultSchema));
+    auto& resultRecord = resultTable->record();
+    auto offsetOf = [&resultRecord](const crossbow::string& name) {
+        Record::id_t field;
+        if (!resultRecord.idOf(name, field)) {
+            throw std::runtime_error(name + " field not found");
+        }
+        return resultRecord.getFieldMeta(field).offset;
+    };
 
-            scanIterator = scanIterators[2];
-            if (scanIterator->hasNext()) {
-                std::tie(std::ignore, tuple, tupleLength) = scanIterator->next();
-                result.max_distant_week_id = resultTable.field<int64_t>("min_subscriber_id", tuple);
-            }
+    plan->subscriberIdOffset = offsetOf("subscriber_id");
+    for (size_t i = 0; i < attributes.size(); ++i) {
+        plan->maxOffsets[i] = offsetOf("max_" + crossbow::to_string(attributes[i].first));
+        plan->epochOffsets[i] = offsetOf("epoch_" + crossbow::to_string(attributes[i].second));
+    }
+    plan->scan.setResultTable(std::move(resultTable));
+    return plan;
+}
 
-            scanIterator = scanIterators[3];
-            if (scanIterator->hasNext()) {
-                std::tie(std::ignore, tuple, tupleLength) = scanIterator->next();
-                result.max_distant_day_id = resultTable.field<int64_t>("min_subscriber_id", tuple);
-            }
+} // anonymous namespace
 
-            // check for errors
-            for (auto &scanIterator: scanIterators) {
-                if (scanIterator->error()) {
-                    result.error = crossbow::to_string(scanIterator->error().value());
-                    result.success = false;
-                    return result;
-                }
+Query<Q6Out> Transactions::q6Query(Transaction& tx, Context &context, const Q6In& in)
+{
+    auto& plan = context.plans.get<Q6Plan>(Command::Q6, 0, [&tx, &context]() {
+        return compile(tx, context);
+    });
+
+    std::vector<int64_t> values(plan.scan.slots());
+    values[plan.countryId] = in.country_id;
+
+    // the four maxima are valid in different windows, every maximum only
+    // looks at subscribers whose values are from the current window
+    auto dayEpoch = Window(WindowType::TUMB, WindowLength::DAY).epochOf(now());
+    auto weekEpoch = Window(WindowType::TUMB, WindowLength::WEEK).epochOf(now());
+    std::array<int32_t, 4> epochs = {{weekEpoch, dayEpoch, weekEpoch, dayEpoch}};
+
+    struct State {
+        std::array<ArgExtreme<int32_t>, 4> maxima = {{
+                ArgExtreme<int32_t>(AggregationType::MAX),
+                ArgExtreme<int32_t>(AggregationType::MAX),
+                ArgExtreme<int32_t>(AggregationType::MAX),
+                ArgExtreme<int32_t>(AggregationType::MAX)
+        }};
+    };
+    auto state = std::make_shared<State>();
+
+    auto subscriberIdOffset = plan.subscriberIdOffset;
+    auto maxOffsets = plan.maxOffsets;
+    auto epochOffsets = plan.epochOffsets;
+    Query<Q6Out> query;
+    query.scans.push_back(plan.scan.bind(values,
+            [state, epochs, subscriberIdOffset, maxOffsets, epochOffsets](const char* tuple) {
+        auto subscriberId = *reinterpret_cast<const int64_t*>(tuple + subscriberIdOffset);
+        for (size_t i = 0; i < epochs.size(); ++i) {
+            if (*reinterpret_cast<const int32_t*>(tuple + epochOffsets[i]) == epochs[i]) {
+                state->maxima[i].update(subscriberId, *reinterpret_cast<const int32_t*>(tuple + maxOffsets[i]));
             }
         }
-
-        result.success = true;
-        tx.commit();
-
-    } catch (std::exception& ex) {
-        result.success = false;
-        result.error = ex.what();
-    }
-
-    return result;
+    }));
+    query.finish = [state]() {
+        // Leave the explicit empty values of Q6Out for epochs without any call
+        auto assign = [](const ArgExtreme<int32_t>& max, int32_t& value, uint64_t& id) {
+            if (max.valid()) {
+                value = max.value();
+                id = max.key();
+            }
+        };
+        auto& maxima = state->maxima;
+        Q6Out result;
+        assign(maxima[0], result.max_local_week, result.max_local_week_id);
+        assign(maxima[1], result.max_local_day, result.max_local_day_id);
+        assign(maxima[2], result.max_distant_week, result.max_distant_week_id);
+        assign(maxima[3], result.max_distant_day, result.max_distant_day_id);
+        return result;
+    };
+    return query;
 }
 
 } // namespace aim
-
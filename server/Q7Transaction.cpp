@@ -28,137 +28,160 @@
 
 #include <common/dimension-tables-unique-values.h>
 #include "Connection.hpp"
+#include "GroupBy.hpp"
 
 namespace aim {
 
 using namespace tell::db;
 using namespace tell::store;
 
-Q7Out Transactions::q7Transaction(Transaction& tx, Context &context, const Q7In& in)
-{
-    Q7Out result;
-
-    try {
-        auto schema = tx.getSchema(context.wideTable);
-
-        // idea: we have to group by cityName
-        // 5 different unique values
-        // aggregate them all in separate scans
-
-        uint32_t selectionLength = 32;
-        std::unique_ptr<char[]> selection(new char[selectionLength]);
-
-        crossbow::buffer_writer selectionWriter(selection.get(), selectionLength);
-        selectionWriter.write<uint32_t>(0x1u);
-        selectionWriter.write<uint16_t>(0x1u);
-        selectionWriter.write<uint16_t>(0x0u);
-        selectionWriter.write<uint32_t>(0x0u);
-        selectionWriter.write<uint32_t>(0x0u);
-
-        selectionWriter.write<uint16_t>(context.valueTypeId);
-        selectionWriter.write<uint16_t>(0x1u);
-        selectionWriter.set(0, 4);
-        selectionWriter.write<uint8_t>(crossbow::to_underlying(PredicateType::EQUAL));
-        selectionWriter.write<uint8_t>(0x0u);
-        selectionWriter.set(0, 2);
-        selectionWriter.write<int32_t>(in.subscriber_value_type);
-
-        // sort aggregation attributes
-        id_t costSumAllIdx = in.window_length == 0 ?
-                    context.costSumAllDay : context.costSumAllWeek;
-        id_t durSumAllIdx = in.window_length == 0 ?
-                    context.durSumAllDay : context.durSumAllWeek;
-        id_t callsSumAllIdx = in.window_length == 0 ?
-                    context.callsSumAllDay : context.callsSumAllWeek;
-        std::map<id_t, std::tuple<FieldType, crossbow::string>> projectionAttributes;
-        projectionAttributes[context.subscriberId] = std::make_tuple(
-                FieldType::BIGINT, "subscriber_id");
-        projectionAttributes[costSumAllIdx] = std::make_tuple(
-                FieldType::DOUBLE, "cost_sum_all");
-        projectionAttributes[durSumAllIdx] = std::make_tuple(
-                FieldType::BIGINT, "dur_sum_all");
-        projectionAttributes[callsSumAllIdx] = std::make_tuple(
-                FieldType::INT, "calls_sum_all");
-
-        Schema resultSchema(schema.type());
-
-        uint32_t projectionLength = sizeof(uint16_t) * projectionAttributes.size();
-        std::unique_ptr<char[]> projection(new char[projectionLength]);
-
-        crossbow::buffer_writer projectionWriter(projection.get(), projectionLength);
-        for (auto &attribute : projectionAttributes) {
-            projectionWriter.write<uint16_t>(attribute.first);
-            resultSchema.addField(std::get<0>(attribute.second),
-                    std::get<1>(attribute.second), true);
-        }
+namespace {
 
-        Table resultTable(context.wideTable.value, std::move(resultSchema));
-        auto& resultRecord = resultTable.record();
-
-        Record::id_t subscriberIdField;
-        if (!resultRecord.idOf("subscriber_id", subscriberIdField)) {
-            throw std::runtime_error("subscriber_id field not found");
-        }
-        auto subscriberIdOffset = resultRecord.getFieldMeta(subscriberIdField).offset;
+struct Q7Plan : QueryPlan {
+    ScanPlan scan;
+    size_t subscriberValueType;
+    size_t epoch;
+    uint32_t subscriberIdOffset;
+    uint32_t costSumAllOffset;
+    uint32_t durSumAllOffset;
 
-        Record::id_t costSumAllField;
-        if (!resultRecord.idOf("cost_sum_all", costSumAllField)) {
-            throw std::runtime_error("cost_sum_all field not found");
-        }
-        auto costSumAllOffset = resultRecord.getFieldMeta(costSumAllField).offset;
+    Q7Plan()
+        : scan(ScanQueryType::PROJECTION, 88, 6)
+    {}
+};
 
-        Record::id_t durSumAllField;
-        if (!resultRecord.idOf("dur_sum_all", durSumAllField)) {
-            throw std::runtime_error("dur_sum_all field not found");
-        }
-        auto durSumAllOffset = resultRecord.getFieldMeta(durSumAllField).offset;
+std::unique_ptr<Q7Plan> compile(Transaction& tx, Context &context, uint8_t windowLength)
+{
+    auto schema = tx.getSchema(context.wideTable);
+
+    id_t costSumAllIdx = windowLength == 0 ?
+                context.costSumAllDay : context.costSumAllWeek;
+    id_t durSumAllIdx = windowLength == 0 ?
+                context.durSumAllDay : context.durSumAllWeek;
+    id_t callsSumAllIdx = windowLength == 0 ?
+                context.callsSumAllDay : context.callsSumAllWeek;
+
+    // sort projection attributes
+    std::map<id_t, std::tuple<FieldType, crossbow::string>> projectionAttributes;
+    projectionAttributes[context.subscriberId] = std::make_tuple(
+            FieldType::BIGINT, "subscriber_id");
+    projectionAttributes[costSumAllIdx] = std::make_tuple(
+            FieldType::DOUBLE, "cost_sum_all");
+    projectionAttributes[durSumAllIdx] = std::make_tuple(
+            FieldType::BIGINT, "dur_sum_all");
+
+    std::unique_ptr<Q7Plan> plan(new Q7Plan());
+
+    crossbow::buffer_writer selectionWriter(plan->scan.selection(), plan->scan.selectionLength());
+    selectionWriter.write<uint32_t>(0x4u);
+    selectionWriter.write<uint16_t>(0x4u);
+    selectionWriter.write<uint16_t>(0x0u);
+    selectionWriter.write<uint32_t>(0x0u);
+    selectionWriter.write<uint32_t>(0x0u);
+
+    selectionWriter.write<uint16_t>(context.valueTypeId);
+    selectionWriter.write<uint16_t>(0x1u);
+    selectionWriter.set(0, 4);
+    selectionWriter.write<uint8_t>(crossbow::to_underlying(PredicateType::EQUAL));
+    selectionWriter.write<uint8_t>(0x0u);
+    selectionWriter.set(0, 2);
+    plan->subscriberValueType = plan->scan.slot(selectionWriter, FieldType::INT);
+    selectionWriter.write<int32_t>(0);
+
+    // ignore subscribers whose values are from an older window
+    selectionWriter.write<uint16_t>(windowLength == 0 ?
+                context.epochDayAll : context.epochWeekAll);
+    selectionWriter.write<uint16_t>(0x1u);
+    selectionWriter.set(0, 4);
+    selectionWriter.write<uint8_t>(crossbow::to_underlying(PredicateType::EQUAL));
+    selectionWriter.write<uint8_t>(0x1u);
+    selectionWriter.set(0, 2);
+    plan->epoch = plan->scan.slot(selectionWriter, FieldType::INT);
+    selectionWriter.write<int32_t>(0);
+
+    // only subscribers with calls have a flat rate, let the scan drop the others
+    selectionWriter.write<uint16_t>(callsSumAllIdx);
+    selectionWriter.write<uint16_t>(0x1u);
+    selectionWriter.set(0, 4);
+    selectionWriter.write<uint8_t>(crossbow::to_underlying(PredicateType::GREATER));
+    selectionWriter.write<uint8_t>(0x2u);
+    selectionWriter.set(0, 2);
+    selectionWriter.write<int32_t>(0);
+
+    selectionWriter.write<uint16_t>(durSumAllIdx);
+    selectionWriter.write<uint16_t>(0x1u);
+    selectionWriter.set(0, 4);
+    selectionWriter.write<uint8_t>(crossbow::to_underlying(PredicateType::GREATER));
+    selectionWriter.write<uint8_t>(0x3u);
+    selectionWriter.set(0, 6);
+    selectionWriter.write<int64_t>(0);
+
+    Schema resultSchema(schema.type());
+
+    crossbow::buffer_writer projectionWriter(plan->scan.query(), plan->scan.queryLength());
+    for (auto &attribute : projectionAttributes) {
+        projectionWriter.write<uint16_t>(attribute.first);
+        resultSchema.addField(std::get<0>(attribute.second),
+                std::get<1>(attribute.second), true);
+    }
 
-        Record::id_t callsSumAllField;
-        if (!resultRecord.idOf("calls_sum_all", callsSumAllField)) {
-            throw std::runtime_error("calls_sum_all field not found");
-        }
-        auto callsSumAllOffset = resultRecord.getFieldMeta(callsSumAllField).offset;
-
-        auto &snapshot = tx.snapshot();
-        auto &clientHandle = tx.getHandle();
-        auto scanIterator = clientHandle.scan(resultTable, snapshot,
-                    *context.scanMemoryMananger, ScanQueryType::PROJECTION, selectionLength,
-                    selection.get(), projectionLength, projection.get());
-
-        result.flat_rate = std::numeric_limits<double>().max();
-        result.subscriber_id = 1;
-        while (scanIterator->hasNext()) {
-            const char* tuple;
-            size_t tupleLength;
-            std::tie(std::ignore, tuple, tupleLength) = scanIterator->next();
-            auto callsSumAll = *reinterpret_cast<const int32_t*>(tuple + callsSumAllOffset);
-            auto durSumAll = *reinterpret_cast<const int64_t*>(tuple + durSumAllOffset);
-            if (callsSumAll && durSumAll) {
-                auto flatRate = *reinterpret_cast<const double*>(tuple + costSumAllOffset);
-                flatRate /= durSumAll;
-                if (flatRate < result.flat_rate) {
-                    result.flat_rate = flatRate;
-                    result.subscriber_id = *reinterpret_cast<const int64_t*>(tuple + subscriberIdOffset);
-                }
-            }
+    auto resultTable = std::make_shared<Table>(context.wideTable.value, std::move(resultSchema));
+    auto& resultRecord = resultTable->record();
+    auto offsetOf = [&resultRecord](const crossbow::string& name) {
+        Record::id_t field;
+        if (!resultRecord.idOf(name, field)) {
+            throw std::runtime_error(name + " field not found");
         }
+        return resultRecord.getFieldMeta(field).offset;
+    };
+
+    plan->subscriberIdOffset = offsetOf("subscriber_id");
+    plan->costSumAllOffset = offsetOf("cost_sum_all");
+    plan->durSumAllOffset = offsetOf("dur_sum_all");
+    plan->scan.setResultTable(std::move(resultTable));
+    return plan;
+}
 
-        result.success = true;
-        tx.commit();
+} // anonymous namespace
 
-        if (scanIterator->error()) {
-            result.error = crossbow::to_string(scanIterator->error().value());
-            result.success = false;
-            return result;
+Query<Q7Out> Transactions::q7Query(Transaction& tx, Context &context, const Q7In& in)
+{
+    // the window decides on the scanned columns, every window has its plan
+    uint8_t windowLength = in.window_length == 0 ? 0 : 1;
+    auto& plan = context.plans.get<Q7Plan>(Command::Q7, windowLength, [&tx, &context, windowLength]() {
+        return compile(tx, context, windowLength);
+    });
+
+    std::vector<int64_t> values(plan.scan.slots());
+    values[plan.subscriberValueType] = in.subscriber_value_type;
+    values[plan.epoch] = Window(WindowType::TUMB,
+            windowLength == 0 ? WindowLength::DAY : WindowLength::WEEK).epochOf(now());
+
+    auto flatRate = std::make_shared<ArgExtreme<double>>(AggregationType::MIN);
+    auto subscriberIdOffset = plan.subscriberIdOffset;
+    auto costSumAllOffset = plan.costSumAllOffset;
+    auto durSumAllOffset = plan.durSumAllOffset;
+    Query<Q7Out> query;
+    query.scans.push_back(plan.scan.bind(values,
+            [flatRate, subscriberIdOffset, costSumAllOffset, durSumAllOffset](const char* tuple) {
+        // avg cost / avg duration = sum cost / sum duration, the scan only
+        // returns subscribers with a duration
+        auto durSumAll = *reinterpret_cast<const int64_t*>(tuple + durSumAllOffset);
+        auto rate = *reinterpret_cast<const double*>(tuple + costSumAllOffset) / durSumAll;
+        flatRate->update(*reinterpret_cast<const int64_t*>(tuple + subscriberIdOffset), rate);
+    }));
+    query.finish = [flatRate]() {
+        Q7Out result;
+        if (flatRate->valid()) {
+            result.flat_rate = flatRate->value();
+            result.subscriber_id = flatRate->key();
+        } else {
+            result.flat_rate = std::numeric_limits<double>().max();
+            result.subscriber_id = 1;
         }
-
-    } catch (std::exception& ex) {
-        result.success = false;
-        result.error = ex.what();
-    }
-
-    return result;
+        return result;
+    };
+    return query;
 }
 
 } // namespace aim
-
@@ -0,0 +1,87 @@
+/*
+ * (C) Copyright 2015 ETH Zurich Systems Group (http://www.systems.ethz.ch/) and others.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Contributors:
+ *     Markus Pilman <mpilman@inf.ethz.ch>
+ *     Simon Loesing <sloesing@inf.ethz.ch>
+ *     Thomas Etter <etterth@gmail.com>
+ *     Kevin Bocksrocker <kevin.bocksrocker@gmail.com>
+ *     Lucas Braun <braunl@inf.ethz.ch>
+ */
+#include "QueryPlan.hpp"
+
+#include <cstring>
+#include <stdexcept>
+
+namespace aim {
+
+using namespace tell::store;
+
+namespace {
+
+template<class T>
+void patch(char* buffer, uint32_t offset, int64_t value) {
+    auto v = static_cast<T>(value);
+    memcpy(buffer + offset, &v, sizeof(T));
+}
+
+} // anonymous namespace
+
+ScanPlan::ScanPlan(ScanQueryType type, uint32_t selectionLength, uint32_t queryLength)
+    : mType(type)
+    , mSelection(selectionLength, 0)
+    , mQuery(queryLength, 0)
+{}
+
+size_t ScanPlan::slot(crossbow::buffer_writer& selectionWriter, FieldType type) {
+    switch (type) {
+    case FieldType::SMALLINT:
+    case FieldType::INT:
+    case FieldType::BIGINT:
+        break;
+    default:
+        throw std::invalid_argument("Slot of non integer type");
+    }
+    mSlots.push_back(Slot{static_cast<uint32_t>(selectionWriter.data() - mSelection.data()), type});
+    return mSlots.size() - 1;
+}
+
+ScanRequest ScanPlan::bind(const std::vector<int64_t>& values,
+        std::function<void(const char* tuple)> consume) const {
+    if (values.size() != mSlots.size()) {
+        throw std::invalid_argument("Wrong number of slot values");
+    }
+    std::unique_ptr<char[]> selection(new char[mSelection.size()]);
+    memcpy(selection.get(), mSelection.data(), mSelection.size());
+    for (size_t i = 0; i < mSlots.size(); ++i) {
+        switch (mSlots[i].type) {
+        case FieldType::SMALLINT:
+            patch<int16_t>(selection.get(), mSlots[i].offset, values[i]);
+            break;
+        case FieldType::INT:
+            patch<int32_t>(selection.get(), mSlots[i].offset, values[i]);
+            break;
+        default:
+            patch<int64_t>(selection.get(), mSlots[i].offset, values[i]);
+            break;
+        }
+    }
+    std::unique_ptr<char[]> query(new char[mQuery.size()]);
+    memcpy(query.get(), mQuery.data(), mQuery.size());
+    return ScanRequest(mType, mSelection.size(), std::move(selection),
+            mQuery.size(), std::move(query), mResultTable, std::move(consume));
+}
+
+} // namespace aim
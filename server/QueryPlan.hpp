@@ -0,0 +1,132 @@
+/*
+ * (C) Copyright 2015 ETH Zurich Systems Group (http://www.systems.ethz.ch/) and others.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Contributors:
+ *     Markus Pilman <mpilman@inf.ethz.ch>
+ *     Simon Loesing <sloesing@inf.ethz.ch>
+ *     Thomas Etter <etterth@gmail.com>
+ *     Kevin Bocksrocker <kevin.bocksrocker@gmail.com>
+ *     Lucas Braun <braunl@inf.ethz.ch>
+ */
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include <crossbow/Serializer.hpp>
+
+#include <telldb/Transaction.hpp>
+
+#include <common/Protocol.hpp>
+
+#include "SharedScan.hpp"
+
+namespace aim {
+
+/*
+ * Selection and projection / aggregation program of one scan together with
+ * the layout of its result tuples. It only depends on the schema and is
+ * compiled once; values that change from one execution to the next (query
+ * parameters, the current epoch) are slots in the selection, which bind()
+ * patches in a copy of the program.
+ */
+class ScanPlan {
+public:
+    ScanPlan(tell::store::ScanQueryType type, uint32_t selectionLength, uint32_t queryLength);
+
+    char* selection() {
+        return mSelection.data();
+    }
+
+    uint32_t selectionLength() const {
+        return mSelection.size();
+    }
+
+    char* query() {
+        return mQuery.data();
+    }
+
+    uint32_t queryLength() const {
+        return mQuery.size();
+    }
+
+    /*
+     * Declares the value the selection writer writes next as a slot of the
+     * given type and returns the number of the slot.
+     */
+    size_t slot(crossbow::buffer_writer& selectionWriter, tell::store::FieldType type);
+
+    size_t slots() const {
+        return mSlots.size();
+    }
+
+    void setResultTable(std::shared_ptr<tell::store::Table> resultTable) {
+        mResultTable = std::move(resultTable);
+    }
+
+    const tell::store::Table& resultTable() const {
+        return *mResultTable;
+    }
+
+    /*
+     * Creates the scan request with value i written to slot i.
+     */
+    ScanRequest bind(const std::vector<int64_t>& values,
+            std::function<void(const char* tuple)> consume) const;
+
+private:
+    struct Slot {
+        uint32_t offset;
+        tell::store::FieldType type;
+    };
+
+    tell::store::ScanQueryType mType;
+    std::vector<char> mSelection;
+    std::vector<char> mQuery;
+    std::vector<Slot> mSlots;
+    std::shared_ptr<tell::store::Table> mResultTable;
+};
+
+/*
+ * Base of the compiled plans of the queries.
+ */
+struct QueryPlan {
+    virtual ~QueryPlan() = default;
+};
+
+/*
+ * The plans compiled by one Context. A query has one plan per variant
+ * (parameters that change the scanned columns, like the window of Q7), it is
+ * compiled on first use and kept for the lifetime of the context.
+ */
+class QueryPlanCache {
+public:
+    template<class Plan, class Compile>
+    const Plan& get(Command query, uint32_t variant, Compile compile) {
+        auto& plan = mPlans[std::make_pair(query, variant)];
+        if (!plan) {
+            plan = compile();
+        }
+        return static_cast<const Plan&>(*plan);
+    }
+
+private:
+    std::map<std::pair<Command, uint32_t>, std::unique_ptr<QueryPlan>> mPlans;
+};
+
+} // namespace aim
@@ -0,0 +1,144 @@
+/*
+ * (C) Copyright 2015 ETH Zurich Systems Group (http://www.systems.ethz.ch/) and others.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Contributors:
+ *     Markus Pilman <mpilman@inf.ethz.ch>
+ *     Simon Loesing <sloesing@inf.ethz.ch>
+ *     Thomas Etter <etterth@gmail.com>
+ *     Kevin Bocksrocker <kevin.bocksrocker@gmail.com>
+ *     Lucas Braun <braunl@inf.ethz.ch>
+ */
+#include "ResultCache.hpp"
+
+#include <crossbow/logger.hpp>
+
+namespace aim {
+
+namespace {
+
+/*
+ * Upper bound on the number of cached results, only reached with parameters
+ * from large domains (e.g. Q1 alpha). Stale entries are dropped first.
+ */
+constexpr size_t MAX_ENTRIES = 0x4000;
+
+} // anonymous namespace
+
+ResultCache::ResultCache(boost::asio::io_service& service, unsigned maxAge, unsigned maxBatches,
+        unsigned statsInterval)
+    : mMaxAge(maxAge)
+    , mMaxBatches(maxBatches)
+    , mStatsInterval(statsInterval)
+    , mStatsTimer(service)
+    , mBatches(0)
+    , mHits(0)
+    , mMisses(0)
+    , mExpired(0)
+    , mHitAgeSum(0)
+    , mHitBatchSum(0)
+{}
+
+void ResultCache::run() {
+    LOG_INFO("Result cache: max age %1%ms, max %2% event batches", mMaxAge.count(), mMaxBatches);
+    scheduleStats();
+}
+
+bool ResultCache::isStale(const Entry& entry, std::chrono::steady_clock::time_point now,
+        uint64_t batches) const {
+    return (mMaxAge.count() != 0 && now - entry.start > mMaxAge)
+            || (mMaxBatches != 0 && batches - entry.batches > mMaxBatches);
+}
+
+std::shared_ptr<const void> ResultCache::lookup(const Key& key) {
+    auto now = std::chrono::steady_clock::now();
+    auto batches = mBatches.load(std::memory_order_acquire);
+    std::lock_guard<std::mutex> _(mMutex);
+    auto iter = mEntries.find(key);
+    if (iter == mEntries.end()) {
+        mMisses.fetch_add(1, std::memory_order_relaxed);
+        return nullptr;
+    }
+    auto& entry = iter->second;
+    if (isStale(entry, now, batches)) {
+        mEntries.erase(iter);
+        mMisses.fetch_add(1, std::memory_order_relaxed);
+        mExpired.fetch_add(1, std::memory_order_relaxed);
+        return nullptr;
+    }
+    mHits.fetch_add(1, std::memory_order_relaxed);
+    mHitAgeSum.fetch_add(std::chrono::duration_cast<std::chrono::microseconds>(now - entry.start).count(),
+            std::memory_order_relaxed);
+    mHitBatchSum.fetch_add(batches - entry.batches, std::memory_order_relaxed);
+    return entry.result;
+}
+
+void ResultCache::insert(const Ticket& ticket, std::shared_ptr<const void> result) {
+    auto now = std::chrono::steady_clock::now();
+    auto batches = mBatches.load(std::memory_order_acquire);
+    std::lock_guard<std::mutex> _(mMutex);
+    auto iter = mEntries.find(ticket.key);
+    if (iter != mEntries.end()) {
+        // keep the fresher one of two concurrent executions
+        if (iter->second.start < ticket.start) {
+            iter->second = Entry{std::move(result), ticket.start, ticket.batches};
+        }
+        return;
+    }
+    if (mEntries.size() >= MAX_ENTRIES) {
+        for (auto i = mEntries.begin(); i != mEntries.end();) {
+            if (isStale(i->second, now, batches)) {
+                i = mEntries.erase(i);
+            } else {
+                ++i;
+            }
+        }
+        if (mEntries.size() >= MAX_ENTRIES) {
+            return;
+        }
+    }
+    mEntries.emplace(ticket.key, Entry{std::move(result), ticket.start, ticket.batches});
+}
+
+void ResultCache::scheduleStats() {
+    if (mStatsInterval == 0) {
+        return;
+    }
+    mStatsTimer.expires_from_now(std::chrono::seconds(mStatsInterval));
+    mStatsTimer.async_wait([this](const boost::system::error_code& ec) {
+        if (ec) {
+            return;
+        }
+        logStats();
+        scheduleStats();
+    });
+}
+
+void ResultCache::logStats() {
+    size_t entries;
+    {
+        std::lock_guard<std::mutex> _(mMutex);
+        entries = mEntries.size();
+    }
+    auto hits = mHits.load(std::memory_order_relaxed);
+    auto misses = mMisses.load(std::memory_order_relaxed);
+    LOG_INFO("Result cache: %1% entries, hits %2%, misses %3% (%4% stale), hit rate %5% percent, "
+            "avg hit age %6%us, avg hit staleness %7% batches",
+            entries, hits, misses, mExpired.load(std::memory_order_relaxed),
+            hits + misses ? 100 * hits / (hits + misses) : 0,
+            hits ? mHitAgeSum.load(std::memory_order_relaxed) / hits : 0,
+            hits ? static_cast<double>(mHitBatchSum.load(std::memory_order_relaxed)) / hits : 0.0);
+}
+
+} // namespace aim
@@ -0,0 +1,160 @@
+/*
+ * (C) Copyright 2015 ETH Zurich Systems Group (http://www.systems.ethz.ch/) and others.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Contributors:
+ *     Markus Pilman <mpilman@inf.ethz.ch>
+ *     Simon Loesing <sloesing@inf.ethz.ch>
+ *     Thomas Etter <etterth@gmail.com>
+ *     Kevin Bocksrocker <kevin.bocksrocker@gmail.com>
+ *     Lucas Braun <braunl@inf.ethz.ch>
+ */
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+#include <common/Protocol.hpp>
+
+namespace aim {
+
+/*
+ * Results of recent RTA queries keyed by the command and its parameters.
+ * rta_client draws the parameters of most queries from tiny domains, so
+ * concurrent clients often send the same request; within the staleness
+ * bound it is answered from memory instead of running the query again.
+ *
+ * An entry is stale once it is older than maxAge milliseconds or once more
+ * than maxBatches event batches were committed after its query started, a
+ * bound of 0 does not limit that dimension. The batches are the ones
+ * processed by this server, with several servers use the time bound.
+ *
+ * Take a ticket before the query is submitted and put() the result with it,
+ * such that the staleness is measured from the start of the query.
+ */
+class ResultCache {
+public:
+    using Key = std::pair<Command, std::vector<int64_t>>;
+
+    struct Ticket {
+        Key key;
+        std::chrono::steady_clock::time_point start;
+        uint64_t batches;
+    };
+
+    ResultCache(boost::asio::io_service& service, unsigned maxAge, unsigned maxBatches,
+            unsigned statsInterval);
+
+    /*
+     * Copies the cached result to out, false on a miss.
+     */
+    template<class Out>
+    bool get(const Key& key, Out& out) {
+        auto entry = lookup(key);
+        if (!entry) {
+            return false;
+        }
+        out = *std::static_pointer_cast<const Out>(entry);
+        return true;
+    }
+
+    Ticket ticket(Key key) const {
+        return Ticket{std::move(key), std::chrono::steady_clock::now(),
+                mBatches.load(std::memory_order_acquire)};
+    }
+
+    /*
+     * Failed queries are not cached.
+     */
+    template<class Out>
+    void put(const Ticket& ticket, const Out& out) {
+        if (out.success) {
+            insert(ticket, std::make_shared<Out>(out));
+        }
+    }
+
+    /*
+     * Called after every committed event batch.
+     */
+    void committed() {
+        mBatches.fetch_add(1, std::memory_order_acq_rel);
+    }
+
+    void run();
+
+private:
+    struct Entry {
+        std::shared_ptr<const void> result;
+        std::chrono::steady_clock::time_point start;
+        uint64_t batches;
+    };
+
+    std::shared_ptr<const void> lookup(const Key& key);
+    void insert(const Ticket& ticket, std::shared_ptr<const void> result);
+    bool isStale(const Entry& entry, std::chrono::steady_clock::time_point now, uint64_t batches) const;
+    void scheduleStats();
+    void logStats();
+
+    std::chrono::milliseconds mMaxAge;
+    uint64_t mMaxBatches;
+    unsigned mStatsInterval;    // seconds, 0 disables periodic reports
+    boost::asio::steady_timer mStatsTimer;
+    std::atomic<uint64_t> mBatches;
+
+    std::mutex mMutex;
+    std::map<Key, Entry> mEntries;
+
+    std::atomic<uint64_t> mHits;
+    std::atomic<uint64_t> mMisses;
+    std::atomic<uint64_t> mExpired;         // misses on a stale entry
+    std::atomic<uint64_t> mHitAgeSum;       // microseconds
+    std::atomic<uint64_t> mHitBatchSum;
+};
+
+inline std::vector<int64_t> cacheKey(const Q1In& in) {
+    return {in.alpha, in.sample_permille};
+}
+
+inline std::vector<int64_t> cacheKey(const Q2In& in) {
+    return {in.alpha};
+}
+
+inline std::vector<int64_t> cacheKey(const Q3In& in) {
+    return {in.sample_permille};
+}
+
+inline std::vector<int64_t> cacheKey(const Q4In& in) {
+    return {in.alpha, in.beta, in.sample_permille};
+}
+
+inline std::vector<int64_t> cacheKey(const Q5In& in) {
+    return {in.sub_type, in.sub_category, in.sample_permille};
+}
+
+inline std::vector<int64_t> cacheKey(const Q6In& in) {
+    return {in.country_id};
+}
+
+inline std::vector<int64_t> cacheKey(const Q7In& in) {
+    return {in.subscriber_value_type, in.window_length};
+}
+
+} // namespace aim
@@ -0,0 +1,87 @@
+/*
+ * (C) Copyright 2015 ETH Zurich Systems Group (http://www.systems.ethz.ch/) and others.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Contributors:
+ *     Markus Pilman <mpilman@inf.ethz.ch>
+ *     Simon Loesing <sloesing@inf.ethz.ch>
+ *     Thomas Etter <etterth@gmail.com>
+ *     Kevin Bocksrocker <kevin.bocksrocker@gmail.com>
+ *     Lucas Braun <braunl@inf.ethz.ch>
+ */
+#include "Sampling.hpp"
+
+#include <crossbow/enum_underlying.hpp>
+
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+
+#include "Connection.hpp"
+
+namespace aim {
+
+using namespace tell::db;
+using namespace tell::store;
+
+size_t writeSamplePredicate(crossbow::buffer_writer& selectionWriter, ScanPlan& plan,
+        const Context& context, uint8_t conjunct) {
+    selectionWriter.write<uint16_t>(context.sampleBucket);
+    selectionWriter.write<uint16_t>(0x2u);
+    selectionWriter.set(0, 4);
+    selectionWriter.write<uint8_t>(crossbow::to_underlying(PredicateType::GREATER_EQUAL));
+    selectionWriter.write<uint8_t>(conjunct);
+    auto slot = plan.slot(selectionWriter, FieldType::SMALLINT);
+    selectionWriter.write<int16_t>(0);
+    selectionWriter.set(0, 4);
+    selectionWriter.write<uint8_t>(crossbow::to_underlying(PredicateType::LESS));
+    selectionWriter.write<uint8_t>(conjunct + 1);
+    plan.slot(selectionWriter, FieldType::SMALLINT);
+    selectionWriter.write<int16_t>(0);
+    selectionWriter.set(0, 4);
+    return slot;
+}
+
+double bindReplicate(std::vector<int64_t>& values, size_t slot, uint16_t samplePermille,
+        unsigned replicate) {
+    auto replicates = sampleReplicates(samplePermille);
+    if (replicate >= replicates) {
+        throw std::out_of_range("No such replicate");
+    }
+    int64_t first = replicate * samplePermille / replicates;
+    int64_t last = (replicate + 1) * samplePermille / replicates;
+    values[slot] = first;
+    values[slot + 1] = last;
+    return static_cast<double>(last - first) / SAMPLE_BUCKETS;
+}
+
+double replicateError(double estimate, const std::vector<double>& replicates, double rate) {
+    // 97.5% quantiles of Student's t distribution with 1, 2, ... degrees of freedom
+    static const double quantiles[] = {12.706, 4.303, 3.182, 2.776};
+    static_assert(sizeof(quantiles) / sizeof(quantiles[0]) == SAMPLE_REPLICATES - 1,
+            "one quantile per degree of freedom of the replicates");
+
+    auto count = replicates.size();
+    if (count < 2 || count > SAMPLE_REPLICATES) {
+        return std::numeric_limits<double>::infinity();
+    }
+    double squares = 0.0;
+    for (auto replicate : replicates) {
+        squares += (replicate - estimate) * (replicate - estimate);
+    }
+    auto variance = (1.0 - rate) * squares / (count * (count - 1));
+    return quantiles[count - 2] * std::sqrt(variance);
+}
+
+} // namespace aim
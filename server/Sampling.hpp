@@ -0,0 +1,114 @@
+/*
+ * (C) Copyright 2015 ETH Zurich Systems Group (http://www.systems.ethz.ch/) and others.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Contributors:
+ *     Markus Pilman <mpilman@inf.ethz.ch>
+ *     Simon Loesing <sloesing@inf.ethz.ch>
+ *     Thomas Etter <etterth@gmail.com>
+ *     Kevin Bocksrocker <kevin.bocksrocker@gmail.com>
+ *     Lucas Braun <braunl@inf.ethz.ch>
+ */
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include <crossbow/Serializer.hpp>
+
+#include "QueryPlan.hpp"
+
+namespace aim {
+
+struct Context;
+
+/*
+ * Approximate queries (see isApproximate) scan a deterministic sample of the
+ * wide table chosen by a hash of the subscriber id. TellStore can not
+ * evaluate a hash in a selection, so the populator stores the hash bucket of
+ * every subscriber in the sample_bucket column (see sampleBucket) and a
+ * sample of sample_permille consists of the buckets [0, sample_permille).
+ *
+ * A TellStore scan reads the whole table whatever its selection, a sample
+ * predicate only reduces the tuples that are aggregated. The sampled plans
+ * therefore run the same storage-side aggregation scans as the exact ones
+ * and only ship aggregates: the sample is split into replicates of
+ * consecutive buckets, each replicate is aggregated by its own scans and the
+ * spread of the replicate estimates gives the confidence interval of the
+ * estimate over the whole sample (the random groups method).
+ */
+
+/*
+ * Number of buckets of the sample_bucket column.
+ */
+constexpr int16_t SAMPLE_BUCKETS = 1000;
+
+/*
+ * Number of replicates a sample is split into.
+ */
+constexpr unsigned SAMPLE_REPLICATES = 5;
+
+/*
+ * The bucket of a subscriber: the id mixed with the 64 bit finalizer of
+ * MurmurHash3, modulo SAMPLE_BUCKETS.
+ */
+inline int16_t sampleBucket(uint64_t subscriberId) {
+    auto hash = subscriberId;
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ull;
+    hash ^= hash >> 33;
+    return static_cast<int16_t>(hash % SAMPLE_BUCKETS);
+}
+
+inline double sampleRate(uint16_t samplePermille) {
+    return samplePermille / 1000.0;
+}
+
+/*
+ * Number of replicates of a sample, every replicate gets at least one
+ * bucket. Exact queries have a single replicate.
+ */
+inline unsigned sampleReplicates(uint16_t samplePermille) {
+    if (!isApproximate(samplePermille)) {
+        return 1;
+    }
+    return std::min<unsigned>(SAMPLE_REPLICATES, samplePermille);
+}
+
+/*
+ * Writes the conjuncts first <= sample_bucket (at conjunct) and
+ * sample_bucket < last (at conjunct + 1) into the selection of the plan and
+ * returns the slot of first, last is the slot after it.
+ */
+size_t writeSamplePredicate(crossbow::buffer_writer& selectionWriter, ScanPlan& plan,
+        const Context& context, uint8_t conjunct);
+
+/*
+ * Sets the slots written by writeSamplePredicate to the buckets of the given
+ * replicate of the sample and returns the sampling rate of the replicate.
+ */
+double bindReplicate(std::vector<int64_t>& values, size_t slot, uint16_t samplePermille,
+        unsigned replicate);
+
+/*
+ * Half width of the 95% confidence interval of an estimate over the whole
+ * sample, given the estimates of the same quantity from the replicates the
+ * sample consists of. Replicates without an estimate (e.g. a mean over no
+ * tuple) are left out, with less than two replicates the error is infinite.
+ */
+double replicateError(double estimate, const std::vector<double>& replicates, double rate);
+
+} // namespace aim
@@ -0,0 +1,188 @@
+/*
+ * (C) Copyright 2015 ETH Zurich Systems Group (http://www.systems.ethz.ch/) and others.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Contributors:
+ *     Markus Pilman <mpilman@inf.ethz.ch>
+ *     Simon Loesing <sloesing@inf.ethz.ch>
+ *     Thomas Etter <etterth@gmail.com>
+ *     Kevin Bocksrocker <kevin.bocksrocker@gmail.com>
+ *     Lucas Braun <braunl@inf.ethz.ch>
+ */
+#include "SharedScan.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#include "Connection.hpp"
+
+namespace aim {
+
+using namespace tell::store;
+
+bool ScanRequest::sameScan(const ScanRequest& other) const {
+    return type == other.type
+            && selectionLength == other.selectionLength
+            && queryLength == other.queryLength
+            && memcmp(selection.get(), other.selection.get(), selectionLength) == 0
+            && memcmp(query.get(), other.query.get(), queryLength) == 0;
+}
+
+struct SharedScanScheduler::Batch {
+    std::vector<Builder> builders;
+    std::unique_ptr<tell::db::TransactionFiber<Context>> fiber;
+};
+
+void SharedScanScheduler::submit(Builder builder) {
+    std::lock_guard<std::mutex> _(mMutex);
+    mPending.emplace_back(std::move(builder));
+    if (!mScheduled) {
+        mScheduled = true;
+        schedule();
+    }
+}
+
+void SharedScanScheduler::schedule() {
+    if (mWindow == 0) {
+        mService.post([this]() {
+            run();
+        });
+        return;
+    }
+    mTimer.expires_from_now(std::chrono::microseconds(mWindow));
+    mTimer.async_wait([this](const boost::system::error_code& ec) {
+        if (ec) {
+            LOG_ERROR("Shared scan timer failed: %1%", ec.message());
+        }
+        run();
+    });
+}
+
+void SharedScanScheduler::run() {
+    auto batch = std::make_shared<Batch>();
+    {
+        std::lock_guard<std::mutex> _(mMutex);
+        batch->builders.swap(mPending);
+        mScheduled = false;
+    }
+    if (batch->builders.empty()) {
+        return;
+    }
+    auto transaction = [this, batch](tell::db::Transaction& tx, Context& context) {
+        execute(tx, context, *batch);
+        mService.post([batch]() {
+            batch->fiber->wait();
+            batch->fiber.reset(nullptr);
+        });
+    };
+    batch->fiber.reset(new tell::db::TransactionFiber<Context>(
+            mClientManager.startTransaction(transaction, TransactionType::ANALYTICAL)));
+}
+
+void SharedScanScheduler::execute(tell::db::Transaction& tx, Context& context, Batch& batch) {
+    initializeContextIfNecessary(tx, context, mAIMSchema, mClientManager.getScanMemoryManager());
+
+    std::vector<SharedQuery> queries;
+    queries.reserve(batch.builders.size());
+    for (auto& build : batch.builders) {
+        queries.emplace_back(build(tx, context));
+    }
+
+    // merge identical scans of different queries
+    struct Consumer {
+        size_t query;
+        ScanRequest* request;
+    };
+    struct MergedScan {
+        ScanRequest* request;
+        std::vector<Consumer> consumers;
+        std::shared_ptr<ScanIterator> iterator;
+    };
+    std::vector<MergedScan> scans;
+    size_t requested = 0;
+    for (size_t i = 0; i < queries.size(); ++i) {
+        for (auto& request : queries[i].scans) {
+            ++requested;
+            auto iter = std::find_if(scans.begin(), scans.end(), [&request](const MergedScan& scan) {
+                return scan.request->sameScan(request);
+            });
+            if (iter == scans.end()) {
+                scans.emplace_back();
+                scans.back().request = &request;
+                iter = scans.end() - 1;
+            }
+            iter->consumers.push_back(Consumer{i, &request});
+        }
+    }
+
+    std::vector<crossbow::string> errors(queries.size());
+    try {
+        // start all scans before consuming any of them
+        auto &snapshot = tx.snapshot();
+        auto &clientHandle = tx.getHandle();
+        for (auto& scan : scans) {
+            auto& request = *scan.request;
+            scan.iterator = clientHandle.scan(*request.resultTable, snapshot,
+                    *context.scanMemoryMananger, request.type, request.selectionLength,
+                    request.selection.get(), request.queryLength, request.query.get());
+        }
+
+        for (auto& scan : scans) {
+            auto& consumers = scan.consumers;
+            while (scan.iterator->hasNext()) {
+                const char* tuple;
+                size_t tupleLength;
+                std::tie(std::ignore, tuple, tupleLength) = scan.iterator->next();
+                for (size_t i = 0; i < consumers.size();) {
+                    try {
+                        consumers[i].request->consume(tuple);
+                        ++i;
+                    } catch (std::exception& ex) {
+                        // the query failed, stop feeding it
+                        errors[consumers[i].query] = ex.what();
+                        consumers.erase(consumers.begin() + i);
+                    }
+                }
+            }
+            if (scan.iterator->error()) {
+                for (auto& consumer : consumers) {
+                    errors[consumer.query] = crossbow::to_string(scan.iterator->error().value());
+                }
+            }
+        }
+
+        tx.commit();
+    } catch (std::exception& ex) {
+        // the whole batch failed, every query still gets its answer
+        LOG_ERROR("Shared scan batch failed: %1%", ex.what());
+        try {
+            tx.rollback();
+        } catch (std::exception& rollbackEx) {
+            LOG_ERROR("Rollback failed: %1%", rollbackEx.what());
+        }
+        for (auto& error : errors) {
+            if (error.empty()) {
+                error = ex.what();
+            }
+        }
+    }
+
+    LOG_DEBUG("Shared scan batch: %1% queries, %2% scans requested, %3% scans run",
+            queries.size(), requested, scans.size());
+    for (size_t i = 0; i < queries.size(); ++i) {
+        queries[i].finish(errors[i]);
+    }
+}
+
+} // namespace aim
@@ -0,0 +1,186 @@
+/*
+ * (C) Copyright 2015 ETH Zurich Systems Group (http://www.systems.ethz.ch/) and others.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Contributors:
+ *     Markus Pilman <mpilman@inf.ethz.ch>
+ *     Simon Loesing <sloesing@inf.ethz.ch>
+ *     Thomas Etter <etterth@gmail.com>
+ *     Kevin Bocksrocker <kevin.bocksrocker@gmail.com>
+ *     Lucas Braun <braunl@inf.ethz.ch>
+ */
+#pragma once
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+#include <telldb/TellDB.hpp>
+
+#include "server/sep/aim_schema.h"
+
+namespace aim {
+
+struct Context;
+
+/*
+ * One scan over the wide table: the scan type, the selection and the
+ * projection / aggregation buffers as built with crossbow::buffer_writer,
+ * the layout of the result tuples and a consumer that is called for every
+ * result tuple.
+ */
+struct ScanRequest {
+    tell::store::ScanQueryType type;
+    uint32_t selectionLength;
+    std::unique_ptr<char[]> selection;
+    uint32_t queryLength;
+    std::unique_ptr<char[]> query;
+    std::shared_ptr<tell::store::Table> resultTable;
+    std::function<void(const char* tuple)> consume;
+
+    ScanRequest(tell::store::ScanQueryType type,
+            uint32_t selectionLength, std::unique_ptr<char[]> selection,
+            uint32_t queryLength, std::unique_ptr<char[]> query,
+            std::shared_ptr<tell::store::Table> resultTable,
+            std::function<void(const char* tuple)> consume)
+        : type(type)
+        , selectionLength(selectionLength)
+        , selection(std::move(selection))
+        , queryLength(queryLength)
+        , query(std::move(query))
+        , resultTable(std::move(resultTable))
+        , consume(std::move(consume))
+    {}
+
+    /*
+     * Scans with the same type, selection and query return the same tuples.
+     */
+    bool sameScan(const ScanRequest& other) const;
+};
+
+/*
+ * A query split into the scans it needs and a function that assembles the
+ * result once all of them have been consumed.
+ */
+template<class Result>
+struct Query {
+    std::vector<ScanRequest> scans;
+    std::function<Result()> finish;
+};
+
+/*
+ * Query with a type erased result: finish gets the error of the first
+ * failed scan or an empty string and delivers the result.
+ */
+struct SharedQuery {
+    std::vector<ScanRequest> scans;
+    std::function<void(const crossbow::string& error)> finish;
+};
+
+/*
+ * Runs concurrent RTA queries on shared scans. Queries submitted within the
+ * share window are executed as one batch in a single ANALYTICAL transaction,
+ * i.e. on a common snapshot: the scans of all queries are started before any
+ * of them is consumed, such that TellStore serves them in one pass over the
+ * data, and identical scans (e.g. two Q3 or two Q6 on the same country) are
+ * only run once and their tuples are handed to all queries requesting them.
+ */
+class SharedScanScheduler {
+public:
+    using Builder = std::function<SharedQuery(tell::db::Transaction&, Context&)>;
+
+    SharedScanScheduler(boost::asio::io_service& service,
+            tell::db::ClientManager<Context>& clientManager,
+            const AIMSchema& aimSchema,
+            unsigned window)
+        : mService(service)
+        , mClientManager(clientManager)
+        , mAIMSchema(aimSchema)
+        , mWindow(window)
+        , mTimer(service)
+        , mScheduled(false)
+    {}
+
+    /*
+     * The builder is called from within the batch transaction and creates
+     * the scans of the query.
+     */
+    void submit(Builder builder);
+
+    /*
+     * Submits a typed query: callback gets the result (or the error in
+     * Result::error) from within the batch transaction.
+     */
+    template<class Result>
+    void submit(std::function<Query<Result>(tell::db::Transaction&, Context&)> build,
+            std::function<void(const Result&)> callback) {
+        submit([build, callback](tell::db::Transaction& tx, Context& context) {
+            SharedQuery shared;
+            std::function<Result()> finish;
+            try {
+                auto query = build(tx, context);
+                shared.scans = std::move(query.scans);
+                finish = std::move(query.finish);
+            } catch (std::exception& ex) {
+                crossbow::string error = ex.what();
+                shared.scans.clear();
+                shared.finish = [callback, error](const crossbow::string&) {
+                    Result result;
+                    result.success = false;
+                    result.error = error;
+                    callback(result);
+                };
+                return shared;
+            }
+            shared.finish = [finish, callback](const crossbow::string& error) {
+                Result result;
+                if (error.empty()) {
+                    try {
+                        result = finish();
+                    } catch (std::exception& ex) {
+                        result.success = false;
+                        result.error = ex.what();
+                    }
+                } else {
+                    result.success = false;
+                    result.error = error;
+                }
+                callback(result);
+            };
+            return shared;
+        });
+    }
+
+private:
+    struct Batch;
+
+    void schedule();
+    void run();
+    void execute(tell::db::Transaction& tx, Context& context, Batch& batch);
+
+    boost::asio::io_service& mService;
+    tell::db::ClientManager<Context>& mClientManager;
+    const AIMSchema& mAIMSchema;
+    unsigned mWindow;   // microseconds
+    boost::asio::steady_timer mTimer;
+
+    std::mutex mMutex;
+    bool mScheduled;
+    std::vector<Builder> mPending;
+};
+
+} // namespace aim
@@ -26,6 +26,9 @@
 #include <common/Util.hpp>
 
 #include "CreateSchema.hpp"
+#include "MaterializedViews.hpp"
+#include "ResultCache.hpp"
+#include "SharedScan.hpp"
 
 #include "server/sep/aim_schema.h"
 
@@ -40,27 +43,45 @@ public:
     /**
      * takes a transaction in the constructor such that schema can be obained at startup time
      */
-    Transactions(const AIMSchema &aimSchema):
-            mAimSchema(aimSchema)
+    Transactions(const AIMSchema &aimSchema, MaterializedViews* views = nullptr,
+            ResultCache* cache = nullptr):
+            mAimSchema(aimSchema),
+            mViews(views),
+            mCache(cache)
     {}
 
     const AIMSchema &getAimSchema() {
         return mAimSchema;
     }
 
-    void processEvents(tell::db::Transaction& tx, Context &context,
+    /*
+     * Applies the events and commits, returns false if the transaction
+     * failed and was rolled back.
+     */
+    bool processEvents(tell::db::Transaction& tx, Context &context,
                 std::vector<Event> &events);
 
-    Q1Out q1Transaction(tell::db::Transaction& tx, Context &context, const Q1In& in);
-    Q2Out q2Transaction(tell::db::Transaction& tx, Context &context, const Q2In& in);
-    Q3Out q3Transaction(tell::db::Transaction& tx, Context &context);
-    Q4Out q4Transaction(tell::db::Transaction& tx, Context &context, const Q4In& in);
-    Q5Out q5Transaction(tell::db::Transaction& tx, Context &context, const Q5In& in);
-    Q6Out q6Transaction(tell::db::Transaction& tx, Context &context, const Q6In& in);
-    Q7Out q7Transaction(tell::db::Transaction& tx, Context &context, const Q7In& in);
+    /*
+     * The queries only create their scans, the SharedScanScheduler runs them
+     * (possibly together with the scans of other queries) and commits.
+     */
+    Query<Q1Out> q1Query(tell::db::Transaction& tx, Context &context, const Q1In& in);
+    Query<Q2Out> q2Query(tell::db::Transaction& tx, Context &context, const Q2In& in);
+    Query<Q3Out> q3Query(tell::db::Transaction& tx, Context &context, const Q3In& in);
+    Query<Q4Out> q4Query(tell::db::Transaction& tx, Context &context, const Q4In& in);
+    Query<Q5Out> q5Query(tell::db::Transaction& tx, Context &context, const Q5In& in);
+    Query<Q6Out> q6Query(tell::db::Transaction& tx, Context &context, const Q6In& in);
+    Query<Q7Out> q7Query(tell::db::Transaction& tx, Context &context, const Q7In& in);
+
+    /*
+     * Reads the record of a single subscriber and commits.
+     */
+    LookupOut lookup(tell::db::Transaction& tx, Context &context, uint64_t subscriberId);
 
 private:
     const AIMSchema &mAimSchema;
+    MaterializedViews* mViews;  // nullptr if disabled
+    ResultCache* mCache;        // nullptr if disabled
 
 };
 
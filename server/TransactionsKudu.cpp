@@ -533,8 +533,6 @@ Q5Out Transactions::q5Transaction(KuduSession &session, const Q5In &in)
 Q6Out Transactions::q6Transaction(KuduSession &session, const Q6In &in)
 {
     Q6Out result;
-    result.max_local_week = result.max_local_day = result.max_distant_week =
-            result.max_distant_day = std::numeric_limits<int32_t>::min();
 
     try {
         std::tr1::shared_ptr<KuduTable> wTable;
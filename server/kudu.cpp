@@ -90,10 +90,10 @@ public:
     }
 
     template<Command C, class Callback>
-    typename std::enable_if<C == Command::PROCESS_EVENT, void>::type
+    typename std::enable_if<C == Command::PROCESS_EVENT || C == Command::PROCESS_EVENT_BATCH, void>::type
     execute(const typename Signature<C>::arguments& args, const Callback& callback) {
-        LOG_ERROR("PROCESS_EVENT must be called over udp");
-        std::terminate();
+        LOG_ERROR("Closing connection: events have to be sent over udp");
+        mServer.reject();
     }
 
     template<Command C, class Callback>
@@ -126,7 +126,7 @@ public:
 
     template<Command C, class Callback>
     typename std::enable_if<C == Command::Q3, void>::type
-    execute(const Callback& callback) {
+    execute(const typename Signature<C>::arguments&, const Callback& callback) {
        callback(mTxs.q3Transaction(*mSession));
     }
 
@@ -153,6 +153,15 @@ public:
     execute(const typename Signature<C>::arguments& args, const Callback& callback) {
         callback(mTxs.q7Transaction(*mSession, args));
     }
+
+    template<Command C, class Callback>
+    typename std::enable_if<C == Command::LOOKUP, void>::type
+    execute(const typename Signature<C>::arguments&, const Callback& callback) {
+        LookupOut result;
+        result.success = false;
+        result.error = "Point lookups are not supported on Kudu";
+        callback(result);
+    }
 };
 
 void accept(io_service& service, ip::tcp::acceptor& a, kudu::client::KuduClient& client,
@@ -179,6 +188,7 @@ class UdpServer {
     std::unique_ptr<char[]> mBuffer;
     unsigned mEventBatchSize;
     std::vector<std::vector<Event>> mEventBatches;
+    std::vector<Event> mReceivedEvents;
 
 public:
     UdpServer(boost::asio::io_service& service,
@@ -188,7 +198,7 @@ public:
               const AIMSchema &aimSchema)
         : mSocket(service)
         , mTxs(aimSchema)
-        , mBufferSize(1024)
+        , mBufferSize(MAX_EVENT_DATAGRAM_SIZE)
         , mBuffer(new char[mBufferSize])
         , mEventBatchSize(eventBatchSize)
         , mEventBatches(numThreads, std::vector<Event>())
@@ -244,19 +254,19 @@ public:
             size_t reqSize = *reinterpret_cast<size_t*>(mBuffer.get());
             assert(reqSize == bt);
             auto cmd = *reinterpret_cast<Command*>(mBuffer.get() + sizeof(size_t));
-            assert (cmd == Command::PROCESS_EVENT);
+            assert (cmd == Command::PROCESS_EVENT || cmd == Command::PROCESS_EVENT_BATCH);
     #endif
-            crossbow::deserializer des(reinterpret_cast<uint8_t*>(mBuffer.get() + sizeof(size_t) + sizeof(Command)));
-            Event ev;
-            des & ev;
-            auto &eventBatch = mEventBatches[UDP_THREAD_ID];
-            if (eventBatch.size() >= mEventBatchSize) {
-                std::vector<Event> events;
-                events.swap(eventBatch);
-                mTxs.processEvent(*(mSessions[UDP_THREAD_ID]), events);
-                eventBatch.reserve(mEventBatchSize);
-            }
-            eventBatch.push_back(ev);
+            deserializeEvents(reinterpret_cast<uint8_t*>(mBuffer.get()), mReceivedEvents,
+                    [this](const Event& ev) {
+                auto &eventBatch = mEventBatches[UDP_THREAD_ID];
+                if (eventBatch.size() >= mEventBatchSize) {
+                    std::vector<Event> events;
+                    events.swap(eventBatch);
+                    mTxs.processEvent(*(mSessions[UDP_THREAD_ID]), events);
+                    eventBatch.reserve(mEventBatchSize);
+                }
+                eventBatch.push_back(ev);
+            });
             run();
         });
     }
@@ -27,6 +27,9 @@
 #include <telldb/TellDB.hpp>
 
 #include <boost/asio.hpp>
+#include <algorithm>
+#include <cstdio>
+#include <memory>
 #include <string>
 #include <iostream>
 #include <thread>
@@ -41,9 +44,12 @@ using namespace boost::asio;
 void accept(boost::asio::io_service &service,
         boost::asio::ip::tcp::acceptor &a,
         tell::db::ClientManager<aim::Context>& clientManager,
-        const AIMSchema &aimSchema) {
-    auto conn = new aim::Connection(service, clientManager, aimSchema);
-    a.async_accept(conn->socket(), [conn, &service, &a, &clientManager, &aimSchema](
+        const AIMSchema &aimSchema,
+        aim::SharedScanScheduler& scheduler,
+        aim::MaterializedViews* views,
+        aim::ResultCache* cache) {
+    auto conn = new aim::Connection(service, clientManager, aimSchema, scheduler, views, cache);
+    a.async_accept(conn->socket(), [conn, &service, &a, &clientManager, &aimSchema, &scheduler, views, cache](
                    const boost::system::error_code &err) {
         if (err) {
             delete conn;
@@ -51,7 +57,7 @@ void accept(boost::asio::io_service &service,
             return;
         }
         conn->run();
-        accept(service, a, clientManager, aimSchema);
+        accept(service, a, clientManager, aimSchema, scheduler, views, cache);
     });
 }
 
@@ -60,6 +66,8 @@ int main(int argc, const char** argv) {
     std::string host;
     std::string port("8713");
     std::string udpPort("8714");
+    std::string eventPort("");
+    std::string eventSocket("");
     std::string logLevel("DEBUG");
     std::string schemaFile("");
     crossbow::string commitManager;
@@ -67,6 +75,14 @@ int main(int argc, const char** argv) {
     unsigned eventBatchSize = 100u;
     unsigned networkThreads = 1u;
     unsigned processingThreads = 2u;
+    unsigned udpReceiveThreads = 0u;
+    aim::EventQueueConfig queueConfig;
+    unsigned queueCapacity = queueConfig.capacity;
+    std::string overloadPolicy("block");
+    unsigned scanShareWindow = 0u;
+    unsigned viewBuckets = 0u;
+    unsigned cacheMaxAge = 0u;
+    unsigned cacheMaxBatches = 0u;
     unsigned scanBlockNumber = 1;
     unsigned scanBlockSize = 0x6400000;
     auto opts = create_options("aim_server",
@@ -74,6 +90,8 @@ int main(int argc, const char** argv) {
             value<'H'>("host", &host, tag::description{"Host to bind to"}),
             value<'p'>("port", &port, tag::description{"Port to bind to"}),
             value<'u'>("udp-port", &udpPort, tag::description{"Udp-port to receive events"}),
+            value<'e'>("event-port", &eventPort, tag::description{"TCP port to receive event streams (empty disables it)"}),
+            value<'U'>("event-socket", &eventSocket, tag::description{"Unix socket path to receive event streams (empty disables it)"}),
             value<'l'>("log-level", &logLevel, tag::description{"The log level"}),
             value<'c'>("commit-manager", &commitManager, tag::description{"Address to the commit manager"}),
             value<'s'>("storage-nodes", &storageNodes, tag::description{"Semicolon-separated list of storage node addresses"}),
@@ -81,6 +99,16 @@ int main(int argc, const char** argv) {
             value<'b'>("batch-size", &eventBatchSize, tag::description{"size of event batches"}),
             value<'n'>("network-threads", &networkThreads, tag::description{"number of (TCP) networking threads"}),
             value<'t'>("processing-threads", &processingThreads, tag::description{"number of (Infiniband) processing threads"}),
+            value<'r'>("udp-receive-threads", &udpReceiveThreads, tag::description{"number of UDP sockets bound with SO_REUSEPORT, each drained by its own thread (0 receives all events on one socket)"}),
+            value<'q'>("queue-capacity", &queueCapacity, tag::description{"maximal number of queued events per processing thread"}),
+            value<'o'>("overload-policy", &overloadPolicy, tag::description{"what to do with events if a queue is full: drop-newest, drop-oldest or block"}),
+            value<'i'>("queue-stats-interval", &queueConfig.statsInterval, tag::description{"seconds between event queue and result cache reports (0 disables them)"}),
+            value<'D'>("pipeline-depth", &queueConfig.pipelineDepth, tag::description{"number of event transactions in flight per processing thread"}),
+            value<'d'>("max-batch-delay-us", &queueConfig.maxBatchDelay, tag::description{"hand off partial event batches once their oldest event waited this many microseconds (0 waits for full batches)"}),
+            value<'w'>("scan-share-window-us", &scanShareWindow, tag::description{"queries arriving within this many microseconds share their scans (0, the default, only shares queries submitted together, e.g. 500 for many RTA clients)"}),
+            value<'V'>("view-buckets", &viewBuckets, tag::description{"answer Q1 and Q2 from materialized views with this many buckets of alpha, only valid if this server processes all events (0 disables them)"}),
+            value<'a'>("cache-max-age-ms", &cacheMaxAge, tag::description{"answer identical queries from a result cache while the result is at most this many milliseconds old (0 does not bound the age)"}),
+            value<'B'>("cache-max-batches", &cacheMaxBatches, tag::description{"answer identical queries from a result cache while at most this many event batches were committed since (0 does not bound it), the cache is disabled if both bounds are 0"}),
             value<'M'>("block-number", &scanBlockNumber, tag::description{"number of scan memory blocks"}),
             value<'m'>("block-size", &scanBlockSize, tag::description{"size of scan memory blocks"})
             );
@@ -96,6 +124,15 @@ int main(int argc, const char** argv) {
         return 0;
     }
 
+    queueConfig.capacity = queueCapacity;
+    queueConfig.pipelineDepth = std::max(queueConfig.pipelineDepth, 1u);
+    try {
+        queueConfig.policy = aim::overloadPolicyFromString(overloadPolicy);
+    } catch (std::invalid_argument& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+
     if (!schemaFile.size()) {
         std::cerr << "no schema file!\n";
         return 1;
@@ -145,12 +182,44 @@ int main(int argc, const char** argv) {
             return 1;
         }
         a.listen();
+        aim::SharedScanScheduler scheduler(service, clientManager, aimSchema, scanShareWindow);
+        std::unique_ptr<aim::MaterializedViews> views;
+        if (viewBuckets != 0) {
+            views.reset(new aim::MaterializedViews(viewBuckets));
+        }
+        std::unique_ptr<aim::ResultCache> cache;
+        if (cacheMaxAge != 0 || cacheMaxBatches != 0) {
+            cache.reset(new aim::ResultCache(service, cacheMaxAge, cacheMaxBatches, queueConfig.statsInterval));
+            cache->run();
+        }
         // we do not need to delete this object, it will delete itself
-        accept(service, a, clientManager, aimSchema);
+        accept(service, a, clientManager, aimSchema, scheduler, views.get(), cache.get());
 
-        aim::UdpServer udpServer(service, clientManager, processingThreads, eventBatchSize, aimSchema);
+        aim::UdpServer udpServer(service, clientManager, processingThreads, eventBatchSize, aimSchema,
+                udpReceiveThreads, queueConfig, views.get(), cache.get());
         udpServer.bind(host, udpPort);
         udpServer.run();
+
+        std::unique_ptr<aim::EventStreamServer<ip::tcp>> tcpEventServer;
+        if (!eventPort.empty()) {
+            ip::tcp::resolver::iterator eventIter;
+            if (host == "") {
+                eventIter = resolver.resolve(ip::tcp::resolver::query(eventPort));
+            } else {
+                eventIter = resolver.resolve(ip::tcp::resolver::query(host, eventPort));
+            }
+            tcpEventServer.reset(new aim::EventStreamServer<ip::tcp>(service, udpServer));
+            tcpEventServer->bind(eventIter->endpoint());
+            tcpEventServer->run();
+        }
+        std::unique_ptr<aim::EventStreamServer<local::stream_protocol>> unixEventServer;
+        if (!eventSocket.empty()) {
+            // remove the socket file of a previous run
+            std::remove(eventSocket.c_str());
+            unixEventServer.reset(new aim::EventStreamServer<local::stream_protocol>(service, udpServer));
+            unixEventServer->bind(local::stream_protocol::endpoint(eventSocket));
+            unixEventServer->run();
+        }
         std::vector<std::thread> threads;
         threads.reserve(networkThreads-1);
         for (unsigned i = 0; i < networkThreads-1; ++i)
@@ -0,0 +1,65 @@
+/*
+ * (C) Copyright 2015 ETH Zurich Systems Group (http://www.systems.ethz.ch/) and others.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Contributors:
+ *     Markus Pilman <mpilman@inf.ethz.ch>
+ *     Simon Loesing <sloesing@inf.ethz.ch>
+ *     Thomas Etter <etterth@gmail.com>
+ *     Kevin Bocksrocker <kevin.bocksrocker@gmail.com>
+ *     Lucas Braun <braunl@inf.ethz.ch>
+ */
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+#include "server/sep/utils.h"
+
+/*
+ * AIMRecordView: typed access to an analytics matrix record in the flat
+ * binary layout described by AIMSchema. The timestamp of the subscriber's
+ * last event is at offset 0, attribute i at AIMSchema::OffsetAt(i). The
+ * view does not own the memory, which has to be AIMSchema::size() bytes.
+ *
+ * Attributes are accessed with memcpy as their offsets are not aligned.
+ */
+class AIMRecordView
+{
+public:
+    explicit AIMRecordView(char *data) : _data(data) {}
+
+public:
+    char *data() const { return _data; }
+
+    Timestamp timestamp() const { return get<Timestamp>(0); }
+    void setTimestamp(Timestamp ts) { set<Timestamp>(0, ts); }
+
+    template <typename T>
+    T get(uint16_t offset) const
+    {
+        T value;
+        memcpy(&value, _data + offset, sizeof(T));
+        return value;
+    }
+
+    template <typename T>
+    void set(uint16_t offset, T value)
+    {
+        memcpy(_data + offset, &value, sizeof(T));
+    }
+
+private:
+    char *_data;
+};
@@ -90,6 +90,21 @@ crossbow::string AIMSchema::getName(Metric metric, AggrFun aggr_fun, FilterType
     return iter->second;
 }
 
+crossbow::string AIMSchema::getEpochName(FilterType filter_type, WindowLength window_size)
+{
+    crossbow::string name = window_size == WindowLength::DAY ? "epoch_day" : "epoch_week";
+    switch (filter_type) {
+    case FilterType::NO:
+        return name + "_all";
+    case FilterType::LOCAL:
+        return name + "_local";
+    case FilterType::NONLOCAL:
+        return name + "_distant";
+    }
+    assert(false);
+    return name;
+}
+
 uint64_t
 AIMSchema::_getEntryHash(Metric metric, AggrFun aggr_fun,
                          FilterType filter_type,
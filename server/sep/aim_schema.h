@@ -76,6 +76,13 @@ public:
     crossbow::string getName(Metric metric, AggrFun aggr_fun, FilterType filter_type,
                          WindowLength window_size) const;
 
+    /*
+     * Name of the column holding the epoch (see Window::epochOf) of the last
+     * update of the attributes with the given filter and window. Attributes
+     * of an older epoch are logically reset to their default value.
+     */
+    static crossbow::string getEpochName(FilterType filter_type, WindowLength window_size);
+
 private:
     uint64_t _getEntryHash(Metric metric, AggrFun aggr_fun,
                            FilterType filter_type,
@@ -0,0 +1,211 @@
+/*
+ * (C) Copyright 2015 ETH Zurich Systems Group (http://www.systems.ethz.ch/) and others.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Contributors:
+ *     Markus Pilman <mpilman@inf.ethz.ch>
+ *     Simon Loesing <sloesing@inf.ethz.ch>
+ *     Thomas Etter <etterth@gmail.com>
+ *     Kevin Bocksrocker <kevin.bocksrocker@gmail.com>
+ *     Lucas Braun <braunl@inf.ethz.ch>
+ */
+#include "aim_schema_kernel.h"
+
+#include <algorithm>
+#include <string>
+
+namespace {
+
+template <typename T> tell::store::FieldType fieldTypeOf();
+template <> tell::store::FieldType fieldTypeOf<int32_t>() { return tell::store::FieldType::INT; }
+template <> tell::store::FieldType fieldTypeOf<int64_t>() { return tell::store::FieldType::BIGINT; }
+template <> tell::store::FieldType fieldTypeOf<double>() { return tell::store::FieldType::DOUBLE; }
+
+/*
+ * The native type the update functions of an entry work with.
+ */
+template <typename Extractor>
+tell::store::FieldType
+nativeType(AggrFun aggr_fun)
+{
+    if (aggr_fun == AggrFun::SUM)
+        return fieldTypeOf<typename Extractor::sum_type>();
+    return fieldTypeOf<typename Extractor::type>();
+}
+
+tell::store::FieldType
+nativeType(AggrFun aggr_fun, Metric metric)
+{
+    switch (metric) {
+    case Metric::CALL:
+        return nativeType<CallExtractor>(aggr_fun);
+    case Metric::DUR:
+        return nativeType<DurExtractor>(aggr_fun);
+    case Metric::COST:
+        return nativeType<CostExtractor>(aggr_fun);
+    }
+    return tell::store::FieldType::NOTYPE;
+}
+
+} // anonymous namespace
+
+/*
+ * Adds an entry to the group with the same window, filter, aggregation and
+ * metric, opening a new group (and window and epoch) if there is none yet.
+ */
+void
+AIMSchemaKernel::addEntry(uint16_t field_id, uint16_t offset, const AIMSchemaEntry &entry,
+                          uint16_t epoch_id)
+{
+    if (entry.type() != nativeType(entry.valAggrFun(), entry.valMetric()))
+        throw std::invalid_argument("type of AIM attribute " +
+                std::string(entry.name().c_str(), entry.name().size()) +
+                " does not match its aggregation");
+
+    size_t window = 0;
+    for (; window < _windows.size(); ++window) {
+        if (_windows[window].init_info == entry.winInitInfo() &&
+                _windows[window].duration == entry.winDuration())
+            break;
+    }
+    if (window == _windows.size()) {
+        if (_windows.size() == MAX_WINDOWS)
+            throw std::length_error("too many distinct windows in AIM schema");
+        _windows.push_back(WindowBounds{entry.winInitInfo(), entry.winDuration()});
+    }
+
+    size_t epoch = 0;
+    for (; epoch < _epochs.size(); ++epoch) {
+        if (_epochs[epoch].field_id == epoch_id)
+            break;
+    }
+    if (epoch == _epochs.size()) {
+        _epochs.push_back(Epoch{epoch_id, window, entry.filterType()});
+    } else if (_epochs[epoch].window != window ||
+            _epochs[epoch].filter_type != entry.filterType()) {
+        throw std::invalid_argument("epoch column shared by different windows or filters");
+    }
+
+    _columns.push_back(Column{field_id, offset, entry.type()});
+    _attr_size = std::max<size_t>(_attr_size, offset + entry.size());
+
+    for (auto &group: _groups) {
+        if (group.window == window && group.filter_type == entry.filterType() &&
+                group.aggr_fun == entry.valAggrFun() &&
+                group.metric == entry.valMetric()) {
+            group.offsets.push_back(offset);
+            return;
+        }
+    }
+    Group group;
+    group.window = window;
+    group.epoch = epoch;
+    group.filter_type = entry.filterType();
+    group.aggr_fun = entry.valAggrFun();
+    group.metric = entry.valMetric();
+    group.offsets.push_back(offset);
+    _groups.push_back(std::move(group));
+}
+
+void
+AIMSchemaKernel::apply(AIMRecordView record, const Event &e) const
+{
+    // window number of the event per window (see Window::epochOf)
+    int32_t event_epoch[MAX_WINDOWS];
+    for (size_t i = 0; i < _windows.size(); ++i) {
+        const auto &w = _windows[i];
+        event_epoch[i] = int32_t((e.timestamp - w.init_info) / w.duration);
+    }
+
+    // indexed by FilterType
+    const bool filter[] = {noFilter(e), localFilter(e), nonlocalFilter(e)};
+
+    for (const auto &group: _groups) {
+        // attributes not selected by their filter keep their value, they
+        // are reset lazily through their epoch
+        if (!filter[static_cast<size_t>(group.filter_type)])
+            continue;
+        auto record_epoch = record.get<int32_t>(epochOffset(group.epoch));
+        // a late event of an already closed window must not end up in the
+        // aggregates of the current one
+        if (event_epoch[group.window] < record_epoch)
+            continue;
+        bool same = event_epoch[group.window] == record_epoch;
+        switch (group.metric) {
+        case Metric::CALL:
+            applyGroup<CallExtractor>(record, group, same, e);
+            break;
+        case Metric::DUR:
+            applyGroup<DurExtractor>(record, group, same, e);
+            break;
+        case Metric::COST:
+            applyGroup<CostExtractor>(record, group, same, e);
+            break;
+        }
+    }
+
+    for (size_t i = 0; i < _epochs.size(); ++i) {
+        const auto &epoch = _epochs[i];
+        if (!filter[static_cast<size_t>(epoch.filter_type)])
+            continue;
+        auto offset = epochOffset(i);
+        record.set<int32_t>(offset, std::max(record.get<int32_t>(offset),
+                                             event_epoch[epoch.window]));
+    }
+
+    record.setTimestamp(std::max(record.timestamp(), e.timestamp));
+}
+
+/*
+ * Native version of updateSum, updateMax and updateMin, a value of a stale
+ * epoch (!same_window) counts as its default. Events older than the epoch
+ * of the record are skipped by apply.
+ */
+template <typename Extractor>
+void
+AIMSchemaKernel::applyGroup(AIMRecordView record, const Group &group,
+                            bool same_window, const Event &e)
+{
+    using type = typename Extractor::type;
+    using sum_type = typename Extractor::sum_type;
+    switch (group.aggr_fun) {
+    case AggrFun::SUM: {
+        auto value = sum_type(Extractor::extract(e));
+        if (same_window) {
+            for (auto offset: group.offsets)
+                record.set<sum_type>(offset, record.get<sum_type>(offset) + value);
+        } else {
+            for (auto offset: group.offsets)
+                record.set<sum_type>(offset, value);
+        }
+        break;
+    }
+    case AggrFun::MAX: {
+        type value = Extractor::extract(e);
+        for (auto offset: group.offsets) {
+            if (!same_window || !(record.get<type>(offset) >= value))
+                record.set<type>(offset, value);
+        }
+        break;
+    }
+    case AggrFun::MIN: {
+        type value = Extractor::extract(e);
+        for (auto offset: group.offsets) {
+            if (!same_window || !(record.get<type>(offset) <= value))
+                record.set<type>(offset, value);
+        }
+        break;
+    }
+    }
+}
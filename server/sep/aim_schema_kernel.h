@@ -0,0 +1,198 @@
+/*
+ * (C) Copyright 2015 ETH Zurich Systems Group (http://www.systems.ethz.ch/) and others.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Contributors:
+ *     Markus Pilman <mpilman@inf.ethz.ch>
+ *     Simon Loesing <sloesing@inf.ethz.ch>
+ *     Thomas Etter <etterth@gmail.com>
+ *     Kevin Bocksrocker <kevin.bocksrocker@gmail.com>
+ *     Lucas Braun <braunl@inf.ethz.ch>
+ */
+#pragma once
+
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+#include <telldb/Field.hpp>
+
+#include <common/Protocol.hpp>
+#include "server/sep/aim_record.h"
+#include "server/sep/aim_schema.h"
+#include "server/sep/aim_schema_entry.h"
+
+/*
+ * AIMSchemaKernel: compiled form of the AIMSchemaEntries of a record. Instead
+ * of dispatching filter, update and maintain through function pointers for
+ * every entry, entries are grouped by (window, filter, aggregation, metric).
+ * For every event the window of the event and the filter outcomes are
+ * computed once and each group is updated in a loop specialized on its
+ * aggregation and metric.
+ *
+ * Window rollover is lazy: every (window, filter) pair has an epoch column
+ * (see AIMSchema::getEpochName) holding the window number of its last
+ * update. Values of an older epoch are treated as their default (initDef)
+ * when updated and have to be ignored by readers. Attributes whose filter
+ * does not select the event are therefore never touched, unlike the eager
+ * reset done by maintain.
+ *
+ * The kernel works on native values in the flat AIMSchema record layout
+ * (see AIMRecordView). load and store convert between a tuple and that
+ * layout, so a subscriber record is unboxed and boxed only once no matter
+ * how many events are applied to it.
+ *
+ * Sample Usage:    AIMSchemaKernel kernel;
+ *                  for (...) kernel.addEntry(fieldId, schema.OffsetAt(i), schema[i], epochId);
+ *                  kernel.load(tuple, timestampId, record);
+ *                  kernel.apply(record, event);
+ *                  kernel.store(record, timestampId, tuple);
+ *
+ * Tuple is anything that maps a field id to a tell::db::Field via operator[],
+ * e.g. tell::db::Tuple.
+ */
+class AIMSchemaKernel
+{
+public:
+    /*
+     * Maximal number of distinct windows (duration and start) of a schema.
+     */
+    static constexpr size_t MAX_WINDOWS = 8;
+
+    AIMSchemaKernel() = default;
+
+    /*
+     * field_id is the id of the attribute in the storage schema, offset its
+     * position in the flat record (AIMSchema::OffsetAt) and epoch_id the id
+     * of the epoch column of the attribute's window and filter.
+     */
+    void addEntry(uint16_t field_id, uint16_t offset, const AIMSchemaEntry &entry,
+                  uint16_t epoch_id);
+
+    /*
+     * Size of a flat record holding all entries added so far, the epochs are
+     * stored as int32_t behind the attributes.
+     */
+    size_t recordSize() const { return _attr_size + _epochs.size() * sizeof(int32_t); }
+
+    /*
+     * Applies e to the record and advances the record's timestamp. Groups
+     * whose epoch is already past the window of e ignore the event.
+     */
+    void apply(AIMRecordView record, const Event &e) const;
+
+    template <typename Tuple>
+    void load(Tuple &tuple, uint16_t timestamp_id, AIMRecordView record) const;
+
+    template <typename Tuple>
+    void store(AIMRecordView record, uint16_t timestamp_id, Tuple &tuple) const;
+
+    size_t numOfGroups() const { return _groups.size(); }
+    size_t numOfEntries() const { return _columns.size(); }
+
+private:
+    struct WindowBounds
+    {
+        Timestamp init_info;
+        Timestamp duration;
+    };
+
+    struct Column
+    {
+        uint16_t field_id;
+        uint16_t offset;
+        tell::store::FieldType type;
+    };
+
+    struct Epoch
+    {
+        uint16_t field_id;
+        size_t window;              // index into _windows
+        FilterType filter_type;
+    };
+
+    struct Group
+    {
+        size_t window;              // index into _windows
+        size_t epoch;               // index into _epochs
+        FilterType filter_type;
+        AggrFun aggr_fun;
+        Metric metric;
+        std::vector<uint16_t> offsets;
+    };
+
+    template <typename Extractor>
+    static void applyGroup(AIMRecordView record, const Group &group,
+                           bool same_window, const Event &e);
+
+    uint16_t epochOffset(size_t epoch) const
+    {
+        return uint16_t(_attr_size + epoch * sizeof(int32_t));
+    }
+
+private:
+    std::vector<WindowBounds> _windows;
+    std::vector<Epoch> _epochs;
+    std::vector<Group> _groups;
+    std::vector<Column> _columns;
+    size_t _attr_size = sizeof(Timestamp);
+};
+
+template <typename Tuple>
+void
+AIMSchemaKernel::load(Tuple &tuple, uint16_t timestamp_id, AIMRecordView record) const
+{
+    record.setTimestamp(tuple[timestamp_id].template value<Timestamp>());
+    for (const auto &column: _columns) {
+        switch (column.type) {
+        case tell::store::FieldType::INT:
+            record.set(column.offset, tuple[column.field_id].template value<int32_t>());
+            break;
+        case tell::store::FieldType::BIGINT:
+            record.set(column.offset, tuple[column.field_id].template value<int64_t>());
+            break;
+        case tell::store::FieldType::DOUBLE:
+            record.set(column.offset, tuple[column.field_id].template value<double>());
+            break;
+        default:
+            throw std::logic_error("unsupported AIM attribute type");
+        }
+    }
+    for (size_t i = 0; i < _epochs.size(); ++i)
+        record.set(epochOffset(i), tuple[_epochs[i].field_id].template value<int32_t>());
+}
+
+template <typename Tuple>
+void
+AIMSchemaKernel::store(AIMRecordView record, uint16_t timestamp_id, Tuple &tuple) const
+{
+    tuple[timestamp_id] = tell::db::Field(record.timestamp());
+    for (const auto &column: _columns) {
+        switch (column.type) {
+        case tell::store::FieldType::INT:
+            tuple[column.field_id] = tell::db::Field(record.get<int32_t>(column.offset));
+            break;
+        case tell::store::FieldType::BIGINT:
+            tuple[column.field_id] = tell::db::Field(record.get<int64_t>(column.offset));
+            break;
+        case tell::store::FieldType::DOUBLE:
+            tuple[column.field_id] = tell::db::Field(record.get<double>(column.offset));
+            break;
+        default:
+            throw std::logic_error("unsupported AIM attribute type");
+        }
+    }
+    for (size_t i = 0; i < _epochs.size(); ++i)
+        tuple[_epochs[i].field_id] = tell::db::Field(record.get<int32_t>(epochOffset(i)));
+}
@@ -39,6 +39,11 @@ public:
     WindowLength length() const { return _length; }
     WindowType type() const { return _type; }
 
+    /*
+     * Number of the window (since _init_info) ts falls into.
+     */
+    int32_t epochOf(Timestamp ts) const { return int32_t((ts - _init_info) / _duration); }
+
 public:
     WindowType _type;           //window type (TUMB, STEP, CONT)
     Timestamp _duration;        //size of window (in msecs)
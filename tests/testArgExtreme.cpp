@@ -0,0 +1,107 @@
+/*
+ * (C) Copyright 2015 ETH Zurich Systems Group (http://www.systems.ethz.ch/) and others.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Contributors:
+ *     Markus Pilman <mpilman@inf.ethz.ch>
+ *     Simon Loesing <sloesing@inf.ethz.ch>
+ *     Thomas Etter <etterth@gmail.com>
+ *     Kevin Bocksrocker <kevin.bocksrocker@gmail.com>
+ *     Lucas Braun <braunl@inf.ethz.ch>
+ */
+#include <server/GroupBy.hpp>
+#include <common/Protocol.hpp>
+
+#include <gtest/gtest.h>
+
+#include <limits>
+#include <stdexcept>
+
+using namespace aim;
+using tell::store::AggregationType;
+
+namespace {
+
+TEST(ArgExtremeTest, emptyInput) {
+    ArgExtreme<int32_t> max(AggregationType::MAX);
+    EXPECT_FALSE(max.valid());
+
+    ArgExtreme<double> min(AggregationType::MIN);
+    EXPECT_FALSE(min.valid());
+}
+
+TEST(ArgExtremeTest, onlyMinAndMax) {
+    EXPECT_THROW(ArgExtreme<int32_t>(AggregationType::SUM), std::invalid_argument);
+    EXPECT_THROW(ArgExtreme<int32_t>(AggregationType::CNT), std::invalid_argument);
+}
+
+TEST(ArgExtremeTest, maximum) {
+    ArgExtreme<int32_t> max(AggregationType::MAX);
+    max.update(5, 10);
+    max.update(3, 7);
+    max.update(9, 12);
+    max.update(1, -4);
+    ASSERT_TRUE(max.valid());
+    EXPECT_EQ(9u, max.key());
+    EXPECT_EQ(12, max.value());
+}
+
+TEST(ArgExtremeTest, minimum) {
+    ArgExtreme<double> min(AggregationType::MIN);
+    min.update(5, 0.5);
+    min.update(3, 0.25);
+    min.update(9, 0.75);
+    ASSERT_TRUE(min.valid());
+    EXPECT_EQ(3u, min.key());
+    EXPECT_EQ(0.25, min.value());
+}
+
+TEST(ArgExtremeTest, tiesGoToLowestKey) {
+    // the result must not depend on the order of the tuples
+    ArgExtreme<int32_t> ascending(AggregationType::MAX);
+    ArgExtreme<int32_t> descending(AggregationType::MAX);
+    for (uint64_t key = 1; key <= 10; ++key) {
+        ascending.update(key, 42);
+        descending.update(11 - key, 42);
+    }
+    EXPECT_EQ(1u, ascending.key());
+    EXPECT_EQ(1u, descending.key());
+
+    ArgExtreme<double> min(AggregationType::MIN);
+    min.update(8, 1.5);
+    min.update(4, 2.0);
+    min.update(6, 1.5);
+    min.update(7, 1.5);
+    EXPECT_EQ(6u, min.key());
+    EXPECT_EQ(1.5, min.value());
+}
+
+TEST(ArgExtremeTest, noMaximum) {
+    // Q6 reports a maximum without any call as NO_MAXIMUM / NO_SUBSCRIBER
+    Q6Out result;
+    EXPECT_EQ(Q6Out::NO_MAXIMUM, result.max_local_week);
+    EXPECT_EQ(Q6Out::NO_SUBSCRIBER, result.max_local_week_id);
+
+    // a value equal to NO_MAXIMUM is still a maximum, valid() tells them apart
+    ArgExtreme<int32_t> max(AggregationType::MAX);
+    max.update(7, Q6Out::NO_MAXIMUM);
+    ASSERT_TRUE(max.valid());
+    EXPECT_EQ(7u, max.key());
+    EXPECT_EQ(Q6Out::NO_MAXIMUM, max.value());
+
+    max.update(8, Q6Out::NO_MAXIMUM + 1);
+    EXPECT_EQ(8u, max.key());
+}
+
+} // anonymous namespace
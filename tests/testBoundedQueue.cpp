@@ -0,0 +1,149 @@
+/*
+ * (C) Copyright 2015 ETH Zurich Systems Group (http://www.systems.ethz.ch/) and others.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Contributors:
+ *     Markus Pilman <mpilman@inf.ethz.ch>
+ *     Simon Loesing <sloesing@inf.ethz.ch>
+ *     Thomas Etter <etterth@gmail.com>
+ *     Kevin Bocksrocker <kevin.bocksrocker@gmail.com>
+ *     Lucas Braun <braunl@inf.ethz.ch>
+ */
+#include <server/EventQueue.hpp>
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+using namespace aim;
+
+namespace {
+
+TEST(BoundedQueueTest, capacityRoundedUpToPowerOfTwo) {
+    EXPECT_EQ(2u, BoundedQueue<int>(1).capacity());
+    EXPECT_EQ(8u, BoundedQueue<int>(8).capacity());
+    EXPECT_EQ(16u, BoundedQueue<int>(9).capacity());
+}
+
+TEST(BoundedQueueTest, emptyQueue) {
+    BoundedQueue<int> queue(4);
+    int value = -1;
+    EXPECT_FALSE(queue.tryPop(value));
+    EXPECT_EQ(-1, value);
+    EXPECT_EQ(0u, queue.size());
+}
+
+TEST(BoundedQueueTest, fullAtCapacity) {
+    BoundedQueue<int> queue(4);
+    for (int i = 0; i < 4; ++i) {
+        EXPECT_TRUE(queue.tryPush(i));
+    }
+    EXPECT_EQ(4u, queue.size());
+    EXPECT_FALSE(queue.tryPush(4));
+
+    int value;
+    EXPECT_TRUE(queue.tryPop(value));
+    EXPECT_EQ(0, value);
+    EXPECT_TRUE(queue.tryPush(4));
+    EXPECT_FALSE(queue.tryPush(5));
+}
+
+TEST(BoundedQueueTest, drainedAtCapacity) {
+    BoundedQueue<int> queue(4);
+    for (int i = 0; i < 4; ++i) {
+        EXPECT_TRUE(queue.tryPush(i));
+    }
+    int value;
+    for (int i = 0; i < 4; ++i) {
+        EXPECT_TRUE(queue.tryPop(value));
+        EXPECT_EQ(i, value);
+    }
+    EXPECT_FALSE(queue.tryPop(value));
+    EXPECT_EQ(0u, queue.size());
+}
+
+TEST(BoundedQueueTest, wrapAround) {
+    BoundedQueue<int> queue(4);
+    int next = 0;
+    int expected = 0;
+    int value;
+    // the positions go around the ring several times at every fill level
+    for (int lap = 0; lap < 10; ++lap) {
+        for (int fill = 1; fill <= 4; ++fill) {
+            for (int i = 0; i < fill; ++i) {
+                ASSERT_TRUE(queue.tryPush(next++));
+            }
+            EXPECT_EQ(static_cast<size_t>(fill), queue.size());
+            for (int i = 0; i < fill; ++i) {
+                ASSERT_TRUE(queue.tryPop(value));
+                EXPECT_EQ(expected++, value);
+            }
+            EXPECT_FALSE(queue.tryPop(value));
+        }
+    }
+}
+
+TEST(BoundedQueueTest, concurrentProducersAndConsumers) {
+    constexpr int PRODUCERS = 4;
+    constexpr int CONSUMERS = 4;
+    constexpr int VALUES = 100000;  // per producer
+    BoundedQueue<int> queue(64);
+    std::vector<std::vector<int>> popped(CONSUMERS);
+    std::atomic<int> remaining(PRODUCERS * VALUES);
+
+    std::vector<std::thread> threads;
+    for (int p = 0; p < PRODUCERS; ++p) {
+        threads.emplace_back([&queue, p]() {
+            for (int i = 0; i < VALUES; ++i) {
+                while (!queue.tryPush(p * VALUES + i)) {
+                    std::this_thread::yield();
+                }
+            }
+        });
+    }
+    for (int c = 0; c < CONSUMERS; ++c) {
+        threads.emplace_back([&queue, &popped, &remaining, c]() {
+            int value;
+            while (remaining.load() > 0) {
+                if (queue.tryPop(value)) {
+                    popped[c].push_back(value);
+                    --remaining;
+                } else {
+                    std::this_thread::yield();
+                }
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    // every value is popped exactly once, in order per producer and consumer
+    std::vector<int> count(PRODUCERS * VALUES, 0);
+    for (auto& values : popped) {
+        std::vector<int> last(PRODUCERS, -1);
+        for (auto value : values) {
+            ++count[value];
+            EXPECT_LT(last[value / VALUES], value);
+            last[value / VALUES] = value;
+        }
+    }
+    for (auto c : count) {
+        ASSERT_EQ(1, c);
+    }
+}
+
+} // anonymous namespace
@@ -0,0 +1,130 @@
+/*
+ * (C) Copyright 2015 ETH Zurich Systems Group (http://www.systems.ethz.ch/) and others.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Contributors:
+ *     Markus Pilman <mpilman@inf.ethz.ch>
+ *     Simon Loesing <sloesing@inf.ethz.ch>
+ *     Thomas Etter <etterth@gmail.com>
+ *     Kevin Bocksrocker <kevin.bocksrocker@gmail.com>
+ *     Lucas Braun <braunl@inf.ethz.ch>
+ */
+#include <server/GroupBy.hpp>
+
+#include <gtest/gtest.h>
+
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <vector>
+
+using namespace aim;
+using namespace tell::store;
+
+namespace {
+
+constexpr id_t GROUP_COLUMN = 3;
+constexpr id_t CALLS_COLUMN = 5;
+constexpr id_t COST_COLUMN = 7;
+constexpr id_t DURATION_COLUMN = 9;
+
+class GroupByScanTest : public ::testing::Test {
+protected:
+    GroupByScanTest()
+        : mScan(GROUP_COLUMN, FieldType::SMALLINT)
+        , mCount(mScan.add(AggregationType::CNT))
+        , mCallsSum(mScan.add(AggregationType::SUM, CALLS_COLUMN, FieldType::INT))
+        , mCostSum(mScan.add(AggregationType::SUM, COST_COLUMN, FieldType::DOUBLE))
+        , mCallsMin(mScan.add(AggregationType::MIN, CALLS_COLUMN, FieldType::INT))
+        , mCostMax(mScan.add(AggregationType::MAX, COST_COLUMN, FieldType::DOUBLE))
+        , mDurationMax(mScan.add(AggregationType::MAX, DURATION_COLUMN, FieldType::BIGINT))
+    {
+        mScan.setResultRecord(Record(mScan.resultSchema(TableType::NON_TRANSACTIONAL)));
+    }
+
+    template<class T>
+    void write(std::vector<char>& tuple, id_t column, T value) {
+        memcpy(tuple.data() + mScan.offset(column), &value, sizeof(T));
+    }
+
+    void consume(int16_t group, int32_t calls, double cost, int64_t duration) {
+        std::vector<char> tuple(256, 0);
+        write(tuple, GROUP_COLUMN, group);
+        write(tuple, CALLS_COLUMN, calls);
+        write(tuple, COST_COLUMN, cost);
+        write(tuple, DURATION_COLUMN, duration);
+        mScan.consume(tuple.data());
+    }
+
+    GroupByScan mScan;
+    size_t mCount;
+    size_t mCallsSum;
+    size_t mCostSum;
+    size_t mCallsMin;
+    size_t mCostMax;
+    size_t mDurationMax;
+};
+
+TEST_F(GroupByScanTest, projection) {
+    // the group column and every aggregated column once, CNT needs none
+    EXPECT_EQ(4 * sizeof(uint16_t), mScan.projectionLength());
+    EXPECT_THROW(mScan.offset(11), std::invalid_argument);
+}
+
+TEST_F(GroupByScanTest, noTuples) {
+    EXPECT_TRUE(mScan.groups().empty());
+}
+
+TEST_F(GroupByScanTest, groupKeys) {
+    consume(10, 1, 1.0, 1);
+    consume(-4, 1, 1.0, 1);
+    consume(10, 1, 1.0, 1);
+    consume(std::numeric_limits<int16_t>::max(), 1, 1.0, 1);
+
+    auto& groups = mScan.groups();
+    ASSERT_EQ(3u, groups.size());
+    EXPECT_EQ(2, groups.at(10)[mCount].integer);
+    EXPECT_EQ(1, groups.at(-4)[mCount].integer);
+    EXPECT_EQ(1, groups.at(std::numeric_limits<int16_t>::max())[mCount].integer);
+}
+
+TEST_F(GroupByScanTest, aggregates) {
+    consume(10, 12, 2.5, 300);
+    consume(10, 15, 0.5, 700);
+    consume(10, 11, 1.25, 200);
+    consume(20, -3, -1.5, -8);
+
+    auto& ten = mScan.groups().at(10);
+    EXPECT_EQ(3, ten[mCount].integer);
+    EXPECT_EQ(38, ten[mCallsSum].integer);
+    EXPECT_DOUBLE_EQ(4.25, ten[mCostSum].real);
+    EXPECT_EQ(11, ten[mCallsMin].integer);
+    EXPECT_DOUBLE_EQ(2.5, ten[mCostMax].real);
+    EXPECT_EQ(700, ten[mDurationMax].integer);
+
+    // a single negative tuple is its own minimum and maximum
+    auto& twenty = mScan.groups().at(20);
+    EXPECT_EQ(1, twenty[mCount].integer);
+    EXPECT_EQ(-3, twenty[mCallsSum].integer);
+    EXPECT_DOUBLE_EQ(-1.5, twenty[mCostSum].real);
+    EXPECT_EQ(-3, twenty[mCallsMin].integer);
+    EXPECT_DOUBLE_EQ(-1.5, twenty[mCostMax].real);
+    EXPECT_EQ(-8, twenty[mDurationMax].integer);
+}
+
+TEST(GroupByScanColumnTest, realGroupColumn) {
+    EXPECT_THROW(GroupByScan(GROUP_COLUMN, FieldType::DOUBLE), std::invalid_argument);
+}
+
+} // anonymous namespace
@@ -0,0 +1,201 @@
+/*
+ * (C) Copyright 2015 ETH Zurich Systems Group (http://www.systems.ethz.ch/) and others.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Contributors:
+ *     Markus Pilman <mpilman@inf.ethz.ch>
+ *     Simon Loesing <sloesing@inf.ethz.ch>
+ *     Thomas Etter <etterth@gmail.com>
+ *     Kevin Bocksrocker <kevin.bocksrocker@gmail.com>
+ *     Lucas Braun <braunl@inf.ethz.ch>
+ */
+#include <common/Histogram.hpp>
+
+#include <gtest/gtest.h>
+
+#include <cstdint>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using namespace aim;
+
+namespace {
+
+std::string serialized(const Histogram& histogram) {
+    std::ostringstream out;
+    histogram.serialize(out);
+    return out.str();
+}
+
+/*
+ * The range of values equivalent to value: min() and max() of a histogram
+ * holding only value.
+ */
+std::pair<uint64_t, uint64_t> equivalentRange(unsigned significantDigits, uint64_t value) {
+    Histogram histogram(significantDigits);
+    histogram.record(value);
+    return std::make_pair(histogram.min(), histogram.max());
+}
+
+TEST(HistogramTest, invalidPrecision) {
+    EXPECT_THROW(Histogram(0), std::invalid_argument);
+    EXPECT_THROW(Histogram(6), std::invalid_argument);
+    EXPECT_THROW(Histogram(3, 1), std::invalid_argument);
+}
+
+TEST(HistogramTest, empty) {
+    Histogram histogram;
+    EXPECT_EQ(0u, histogram.count());
+    EXPECT_EQ(0u, histogram.min());
+    EXPECT_EQ(0u, histogram.max());
+    EXPECT_EQ(0.0, histogram.mean());
+    EXPECT_EQ(0u, histogram.percentile(99.0));
+}
+
+TEST(HistogramTest, smallValuesAreExact) {
+    // 3 digits count every value below 2048 in its own bucket
+    for (uint64_t value = 0; value < 2048; ++value) {
+        auto range = equivalentRange(3, value);
+        ASSERT_EQ(value, range.first);
+        ASSERT_EQ(value, range.second);
+    }
+}
+
+TEST(HistogramTest, indexRoundTrip) {
+    for (unsigned digits = 1; digits <= 4; ++digits) {
+        uint64_t resolution = 1;
+        for (unsigned i = 0; i < digits; ++i) {
+            resolution *= 10;
+        }
+        for (uint64_t value = 1; value < Histogram::DEFAULT_HIGHEST_TRACKABLE_VALUE; value = value * 3 / 2 + 1) {
+            auto range = equivalentRange(digits, value);
+            // the bucket of a value contains it and has the requested precision
+            ASSERT_LE(range.first, value);
+            ASSERT_GE(range.second, value);
+            ASSERT_LE(range.second - range.first, value / resolution);
+            // the bounds map back to the same bucket, their neighbours do not
+            ASSERT_EQ(range, equivalentRange(digits, range.first));
+            ASSERT_EQ(range, equivalentRange(digits, range.second));
+            if (range.first > 0) {
+                ASSERT_NE(range, equivalentRange(digits, range.first - 1));
+            }
+            // max() is clamped to the range of the histogram
+            if (range.second < Histogram::DEFAULT_HIGHEST_TRACKABLE_VALUE) {
+                ASSERT_NE(range, equivalentRange(digits, range.second + 1));
+            }
+        }
+    }
+}
+
+TEST(HistogramTest, valuesAboveRange) {
+    Histogram histogram(3, 1000000);
+    histogram.record(5000000);
+    EXPECT_EQ(1u, histogram.count());
+    EXPECT_EQ(1000000u, histogram.max());
+}
+
+TEST(HistogramTest, percentiles) {
+    Histogram histogram;
+    for (uint64_t value = 1; value <= 100000; ++value) {
+        histogram.record(value);
+    }
+    EXPECT_EQ(100000u, histogram.count());
+    EXPECT_EQ(1u, histogram.min());
+    EXPECT_EQ(1u, histogram.percentile(0.0));
+    for (double percentile : {10.0, 50.0, 90.0, 99.0, 99.9, 100.0}) {
+        auto expected = static_cast<uint64_t>(percentile * 1000);
+        auto actual = histogram.percentile(percentile);
+        EXPECT_GE(actual, expected) << percentile;
+        EXPECT_LE(actual, expected + expected / 1000) << percentile;
+    }
+    EXPECT_EQ(histogram.max(), histogram.percentile(100.0));
+    EXPECT_NEAR(50000.5, histogram.mean(), 50.0);
+}
+
+TEST(HistogramTest, weightedRecord) {
+    Histogram histogram;
+    histogram.record(10, 90);
+    histogram.record(1000, 10);
+    EXPECT_EQ(100u, histogram.count());
+    EXPECT_EQ(10u, histogram.percentile(90.0));
+    EXPECT_EQ(1000u, histogram.percentile(90.1));
+    EXPECT_DOUBLE_EQ(109.0, histogram.mean());
+}
+
+TEST(HistogramTest, mergeEqualsRecordingIntoOne) {
+    std::mt19937_64 engine(42);
+    std::lognormal_distribution<double> latency(7.0, 1.5);
+    Histogram all;
+    std::vector<Histogram> clients(4);
+    for (int i = 0; i < 100000; ++i) {
+        auto value = static_cast<uint64_t>(latency(engine));
+        all.record(value);
+        clients[i % clients.size()].record(value);
+    }
+    Histogram merged;
+    for (auto& client : clients) {
+        merged.merge(client);
+    }
+    EXPECT_EQ(all.count(), merged.count());
+    EXPECT_EQ(all.min(), merged.min());
+    EXPECT_EQ(all.max(), merged.max());
+    EXPECT_DOUBLE_EQ(all.mean(), merged.mean());
+    for (double percentile = 0.0; percentile <= 100.0; percentile += 0.5) {
+        EXPECT_EQ(all.percentile(percentile), merged.percentile(percentile)) << percentile;
+    }
+    EXPECT_EQ(serialized(all), serialized(merged));
+}
+
+TEST(HistogramTest, mergeDifferentPrecision) {
+    Histogram histogram(3);
+    EXPECT_THROW(histogram.merge(Histogram(2)), std::invalid_argument);
+    EXPECT_THROW(histogram.merge(Histogram(3, 1000)), std::invalid_argument);
+}
+
+TEST(HistogramTest, serialization) {
+    Histogram histogram(2, 1000000);
+    histogram.record(3);
+    histogram.record(700, 5);
+    histogram.record(123456);
+    std::istringstream in(serialized(histogram));
+    auto copy = Histogram::deserialize(in);
+    EXPECT_EQ(2u, copy.significantDigits());
+    EXPECT_EQ(1000000u, copy.highestTrackableValue());
+    EXPECT_EQ(serialized(histogram), serialized(copy));
+}
+
+TEST(HistogramTest, histogramFilesMergeByName) {
+    Histogram q1;
+    q1.record(100);
+    Histogram q2;
+    q2.record(200);
+    std::ostringstream first;
+    writeHistograms(first, {{"Q1", q1}, {"Q2", q2}});
+    std::ostringstream second;
+    writeHistograms(second, {{"Q1", q1}});
+
+    std::map<std::string, Histogram> histograms;
+    std::istringstream firstIn(first.str());
+    readHistograms(firstIn, histograms);
+    std::istringstream secondIn(second.str());
+    readHistograms(secondIn, histograms);
+    ASSERT_EQ(2u, histograms.size());
+    EXPECT_EQ(2u, histograms.at("Q1").count());
+    EXPECT_EQ(1u, histograms.at("Q2").count());
+}
+
+} // anonymous namespace
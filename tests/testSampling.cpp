@@ -0,0 +1,185 @@
+/*
+ * (C) Copyright 2015 ETH Zurich Systems Group (http://www.systems.ethz.ch/) and others.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Contributors:
+ *     Markus Pilman <mpilman@inf.ethz.ch>
+ *     Simon Loesing <sloesing@inf.ethz.ch>
+ *     Thomas Etter <etterth@gmail.com>
+ *     Kevin Bocksrocker <kevin.bocksrocker@gmail.com>
+ *     Lucas Braun <braunl@inf.ethz.ch>
+ */
+#include <server/Sampling.hpp>
+
+#include <gtest/gtest.h>
+
+#include <cmath>
+#include <limits>
+#include <random>
+#include <stdexcept>
+#include <vector>
+
+using namespace aim;
+
+namespace {
+
+constexpr uint64_t SUBSCRIBERS = 200000;
+
+TEST(SamplingTest, bucketsAreUniform) {
+    std::vector<uint64_t> counts(SAMPLE_BUCKETS, 0);
+    for (uint64_t id = 1; id <= SUBSCRIBERS; ++id) {
+        auto bucket = sampleBucket(id);
+        ASSERT_GE(bucket, 0);
+        ASSERT_LT(bucket, SAMPLE_BUCKETS);
+        ++counts[bucket];
+    }
+    // 200 subscribers per bucket on average, 6 standard deviations
+    auto expected = SUBSCRIBERS / SAMPLE_BUCKETS;
+    for (auto count : counts) {
+        EXPECT_NEAR(expected, count, 6 * std::sqrt(expected));
+    }
+}
+
+TEST(SamplingTest, consecutiveIdsAreSpread) {
+    // consecutive ids (subscribers populated together) land in different buckets
+    std::vector<bool> seen(SAMPLE_BUCKETS, false);
+    unsigned distinct = 0;
+    for (uint64_t id = 1; id <= 100; ++id) {
+        if (!seen[sampleBucket(id)]) {
+            seen[sampleBucket(id)] = true;
+            ++distinct;
+        }
+    }
+    EXPECT_GT(distinct, 90u);
+}
+
+TEST(SamplingTest, replicates) {
+    EXPECT_EQ(1u, sampleReplicates(0));
+    EXPECT_EQ(1u, sampleReplicates(1000));
+    EXPECT_EQ(1u, sampleReplicates(1));
+    EXPECT_EQ(3u, sampleReplicates(3));
+    EXPECT_EQ(SAMPLE_REPLICATES, sampleReplicates(100));
+    EXPECT_EQ(SAMPLE_REPLICATES, sampleReplicates(999));
+}
+
+TEST(SamplingTest, replicatesPartitionTheSample) {
+    for (uint16_t permille : {1, 2, 7, 50, 333, 999}) {
+        std::vector<int64_t> values(4, -1);
+        int64_t next = 0;
+        double rates = 0.0;
+        for (unsigned r = 0; r < sampleReplicates(permille); ++r) {
+            auto rate = bindReplicate(values, 1, permille, r);
+            EXPECT_EQ(-1, values[0]);
+            EXPECT_EQ(-1, values[3]);
+            // [first, last) follows the previous replicate and is not empty
+            EXPECT_EQ(next, values[1]);
+            EXPECT_LT(values[1], values[2]);
+            EXPECT_DOUBLE_EQ(static_cast<double>(values[2] - values[1]) / SAMPLE_BUCKETS, rate);
+            next = values[2];
+            rates += rate;
+        }
+        EXPECT_EQ(permille, next);
+        EXPECT_NEAR(sampleRate(permille), rates, 1e-12);
+        EXPECT_THROW(bindReplicate(values, 1, permille, sampleReplicates(permille)), std::out_of_range);
+    }
+}
+
+/*
+ * A sum over the subscribers in the buckets [first, last), scaled by the
+ * rate of the buckets, like the sampled plans do with their aggregates.
+ */
+class SampleEstimateTest : public ::testing::Test {
+protected:
+    SampleEstimateTest()
+        : mValues(SUBSCRIBERS + 1, 0.0)
+        , mTotal(0.0)
+    {
+        std::mt19937_64 engine(7);
+        std::exponential_distribution<double> cost(0.01);
+        for (uint64_t id = 1; id <= SUBSCRIBERS; ++id) {
+            mValues[id] = cost(engine);
+            mTotal += mValues[id];
+        }
+    }
+
+    double estimate(int64_t first, int64_t last, double rate) const {
+        double sum = 0.0;
+        for (uint64_t id = 1; id <= SUBSCRIBERS; ++id) {
+            auto bucket = sampleBucket(id);
+            if (bucket >= first && bucket < last) {
+                sum += mValues[id];
+            }
+        }
+        return sum / rate;
+    }
+
+    std::vector<double> mValues;
+    double mTotal;
+};
+
+TEST_F(SampleEstimateTest, scaledEstimates) {
+    for (uint16_t permille : {50, 100, 500}) {
+        auto rate = sampleRate(permille);
+        auto total = estimate(0, permille, rate);
+        EXPECT_NEAR(mTotal, total, 0.05 * mTotal) << permille;
+
+        // every replicate estimates the total on its own
+        std::vector<int64_t> values(2);
+        std::vector<double> replicates;
+        double mean = 0.0;
+        for (unsigned r = 0; r < sampleReplicates(permille); ++r) {
+            auto replicateRate = bindReplicate(values, 0, permille, r);
+            replicates.push_back(estimate(values[0], values[1], replicateRate));
+            EXPECT_NEAR(mTotal, replicates.back(), 0.2 * mTotal) << permille;
+            mean += replicates.back() * replicateRate / rate;
+        }
+        // weighted by their rates the replicates add up to the estimate of the sample
+        EXPECT_NEAR(total, mean, 1e-9 * total) << permille;
+
+        auto error = replicateError(total, replicates, rate);
+        EXPECT_GT(error, 0.0);
+        EXPECT_LE(std::abs(total - mTotal), error) << permille;
+    }
+}
+
+TEST(ReplicateErrorTest, students) {
+    // two replicates 1 apart from the estimate: 12.706 * sqrt(2 / 2)
+    EXPECT_NEAR(12.706, replicateError(10.0, {9.0, 11.0}, 0.0), 1e-9);
+    // five replicates: 2.776 * sqrt(10 / 20)
+    EXPECT_NEAR(2.776 * std::sqrt(0.5), replicateError(0.0, {-2.0, -1.0, 0.0, 1.0, 2.0}, 0.0), 1e-9);
+}
+
+TEST(ReplicateErrorTest, finitePopulationCorrection) {
+    std::vector<double> replicates = {9.0, 10.0, 11.0};
+    auto full = replicateError(10.0, replicates, 0.0);
+    EXPECT_NEAR(full * std::sqrt(0.75), replicateError(10.0, replicates, 0.25), 1e-12);
+    EXPECT_EQ(0.0, replicateError(10.0, replicates, 1.0));
+}
+
+TEST(ReplicateErrorTest, scalesWithTheEstimates) {
+    std::vector<double> replicates = {9.0, 10.5, 11.0, 9.5};
+    std::vector<double> scaled;
+    for (auto replicate : replicates) {
+        scaled.push_back(replicate * 1000.0);
+    }
+    EXPECT_NEAR(1000.0 * replicateError(10.0, replicates, 0.1), replicateError(10000.0, scaled, 0.1), 1e-9);
+}
+
+TEST(ReplicateErrorTest, tooFewReplicates) {
+    EXPECT_EQ(std::numeric_limits<double>::infinity(), replicateError(1.0, {}, 0.1));
+    EXPECT_EQ(std::numeric_limits<double>::infinity(), replicateError(1.0, {1.0}, 0.1));
+    EXPECT_EQ(0.0, replicateError(1.0, {1.0, 1.0}, 0.1));
+}
+
+} // anonymous namespace